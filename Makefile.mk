@@ -9,6 +9,9 @@
 #   DEBUG:      Debug symbols       (default: DEBUG=NO)
 #   LEDS:       Use leds            (default: LEDS=YES)
 #   POWER:      Self/bus powered    (default: POWER=SELF)
+#   USBXMTR:    USB xmtr backend    (default: USBXMTR=SEMA)
+#   USBCSR:     UDP CSR sync        (default: USBCSR=DEFERRED)
+#   USBISR:     USB event handling  (default: USBISR=DIRECT)
 
 TARGET    = AT91SAM7S256
 BOARD     = AT91SAM7SEK
@@ -99,6 +102,39 @@ POWER = SELF
 endif
 endif
 
+#-------------------------------------------------------------------------------
+#       Check USB transmitter backend
+#-------------------------------------------------------------------------------
+ifndef USBXMTR
+USBXMTR = SEMA
+else
+ifneq ($(USBXMTR),LOCKFREE)
+USBXMTR = SEMA
+endif
+endif
+
+#-------------------------------------------------------------------------------
+#       Check UDP CSR synchronization
+#-------------------------------------------------------------------------------
+ifndef USBCSR
+USBCSR = DEFERRED
+else
+ifneq ($(USBCSR),SYNC)
+USBCSR = DEFERRED
+endif
+endif
+
+#-------------------------------------------------------------------------------
+#       Check USB interrupt handling
+#-------------------------------------------------------------------------------
+ifndef USBISR
+USBISR = DIRECT
+else
+ifneq ($(USBISR),TASK)
+USBISR = DIRECT
+endif
+endif
+
 #-------------------------------------------------------------------------------
 #       Check mode
 #-------------------------------------------------------------------------------
@@ -148,6 +184,18 @@ else
 DEFS += -DUSB_BUS_POWERED
 endif
 
+ifeq ($(USBXMTR),LOCKFREE)
+DEFS += -DUSB_XMTR_LOCKFREE
+endif
+
+ifeq ($(USBCSR),SYNC)
+DEFS += -DUSB_CSR_SYNC
+endif
+
+ifeq ($(USBISR),TASK)
+DEFS += -DUSB_ISR_DEFERRED
+endif
+
 ifdef MODE
 ifneq ($(MODE),NO)
 DEFS += -D$(MODE)
@@ -0,0 +1,231 @@
+//---------------------------------------------------------------------------------------
+//      Includes
+//---------------------------------------------------------------------------------------
+
+#include "sam7xpud.hpp"
+
+#include <string.h> // memcpy
+
+//---------------------------------------------------------------------------------------
+//      Exported Symbols
+//---------------------------------------------------------------------------------------
+
+CMDEXEC cmdExec;
+
+//---------------------------------------------------------------------------------------
+//      Module Implementation
+//---------------------------------------------------------------------------------------
+
+//---------------------------------------------------------------------------------------
+// Command Executor task
+//---------------------------------------------------------------------------------------
+portTASK_FUNCTION( CMDEXEC::MainTask, pvParameters )
+{
+    (void) pvParameters; // The parameters are not used.
+
+#ifdef TR_INFO
+    taskENTER_CRITICAL();
+    TRACE_INFO( "CMDEXEC: Main Task\n" );
+    taskEXIT_CRITICAL();
+#endif
+
+    for(;;)
+    {
+        if ( ! cmdExec.semaFull.Wait( 1, 1000 ) )
+            continue;
+
+        CMD& cmd = cmdExec.queue[ cmdExec.head ];
+
+        int status = cmdExec.Execute( cmd );
+
+        if ( cmd.tag >= 0 )
+            Reply( cmd.tag, cmd.type, status );
+
+        cmdExec.lastStatus = uchar( status );
+        cmdExec.doneCount++;
+
+        cmdExec.head = ( cmdExec.head + 1 ) % CMD_QUEUE_LEN;
+        cmdExec.semaEmpty.Release( 1 );
+        }
+    }
+
+bool CMDEXEC::Post
+(
+    uchar type,
+    uchar subtype,
+    const uchar* data,
+    uint len,
+    int tag,
+    portTickType xTicksToWait
+    )
+{
+    if ( ! semaEmpty.Wait( 1, xTicksToWait ) )
+        return false;
+
+    // The vendor request handler may post from the USB interrupt
+    //
+    taskENTER_CRITICAL ();
+    Fill( type, subtype, data, len, tag );
+    taskEXIT_CRITICAL ();
+
+    semaFull.Release( 1 );
+
+    return true;
+    }
+
+bool CMDEXEC::PostFromISR
+(
+    uchar type,
+    uchar subtype,
+    const uchar* data,
+    uint len,
+    int tag,
+    signed portBASE_TYPE& isTaskWoken
+    )
+{
+    if ( ! semaEmpty.WaitFromISR( 1 ) )
+        return false;
+
+    Fill( type, subtype, data, len, tag );
+
+    if ( semaFull.ReleaseFromISR( 1, isTaskWoken ) )
+        isTaskWoken = pdTRUE;
+
+    return true;
+    }
+
+void CMDEXEC::Fill( uchar type, uchar subtype, const uchar* data, uint len, int tag )
+{
+    CMD& cmd = queue[ tail ];
+
+    cmd.type    = type;
+    cmd.subtype = subtype;
+    cmd.tag     = tag;
+    cmd.len     = len < CMD_DATA_MAX ? len : CMD_DATA_MAX;
+    memcpy( cmd.data, data, cmd.len );
+
+    tail = ( tail + 1 ) % CMD_QUEUE_LEN;
+
+    uint queued = ++postCount - doneCount;
+    if ( queued > maxQueued )
+        maxQueued = queued;
+    }
+
+void CMDEXEC::Reply( int tag, uchar type, int status )
+{
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_CMD_DONE, uchar( tag ), 2, 100 );
+    if ( pMsg )
+    {
+        pMsg->data[ 0 ] = type;
+        pMsg->data[ 1 ] = uchar( status );
+        usbOut.Commit( pMsg );
+        }
+    }
+
+void CMDEXEC::DumpStatus( void )
+{
+    tracef( 2, "CMD: Queued max %u of %u\n", maxQueued, CMD_QUEUE_LEN );
+    }
+
+//---------------------------------------------------------------------------------------
+// Executes the command; returns XPI_CMD_STATUS
+//---------------------------------------------------------------------------------------
+int CMDEXEC::Execute( CMD& cmd )
+{
+    int status = XPI_CMD_OK;
+
+    switch( cmd.type )
+    {
+        //-------------------------------------------------------------------------------
+        case XPI_OMSG_FPGA_INIT:
+        {
+            bool coldStart    = cmd.len >= 1 ? cmd.data[ 0 ] : false;
+            bool forcePassive = cmd.len >= 2 ? cmd.data[ 1 ] : false;
+            xpi.InitializeFPGA( coldStart, forcePassive );
+            }
+            break;
+
+        //-------------------------------------------------------------------------------
+        case XPI_OMSG_QUERY:
+        {
+            if ( cmd.subtype == XPI_QUERY_XPI_STATUS )
+            {
+                xpi.DumpStatus ();
+                }
+            else if ( cmd.subtype == XPI_QUERY_CAPS )
+            {
+                XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_CAPS, 0, XPI_CAPS_LEN, 100 );
+                if ( ! pMsg )
+                    status = XPI_CMD_FAILED;
+                else
+                {
+                    sysGetCapabilities( pMsg->data );
+                    usbOut.Commit( pMsg );
+                    }
+                }
+            else if ( cmd.subtype == XPI_QUERY_SC_RTT )
+            {
+                uint len = xpi.GetRtt( NULL, 0 );
+
+                XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_SC_RTT, 0, len, 100 );
+                if ( ! pMsg )
+                    status = XPI_CMD_FAILED;
+                else
+                {
+                    xpi.GetRtt( pMsg->data, len );
+                    usbOut.Commit( pMsg );
+                    }
+                }
+            else
+            {
+                sysDumpStatus ();
+                }
+            }
+            break;
+
+        //-------------------------------------------------------------------------------
+        case XPI_OMSG_FC_CMD:
+        {
+            if ( cmd.len >= 2 ) // Addr with D1 and D0
+            {
+                int card = cmd.data[ 0 ] & 0x3F;
+
+                FPGA_FC_Command( ( card << 2 ) | ( cmd.data[ 1 ] & 0x03 )  );
+                vTaskDelay( 2 );
+                }
+            else if ( cmd.len >= 1 ) // Only Addr
+            {
+                int card = cmd.data[ 0 ] & 0x3F;
+
+                // Turn off and reset the board
+                //
+                FPGA_FC_Command( ( card << 2 ) | 0x00 );
+                vTaskDelay( 2 );
+
+                // Turn on the board
+                //
+                FPGA_FC_Command( ( card << 2 ) | 0x01 );
+                vTaskDelay( 2 );
+
+                // Is the board installed?
+                //
+                if ( FPGA_FC_Command( ( card << 2 ) | 0x03 ) )
+                {
+                    vTaskDelay( 2 );
+
+                    // Is the board turned on and installed?
+                    //
+                    FPGA_FC_Command( ( card << 2 ) | 0x02 );
+                    }
+                else
+                {
+                    status = XPI_CMD_FAILED;
+                    }
+                vTaskDelay( 2 );
+                }
+            }
+            break;
+        }
+
+    return status;
+    }
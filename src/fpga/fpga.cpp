@@ -17,11 +17,28 @@ extern void ISR_Wrapper_FPGA( void );
 
 xSEMA fpgaEvent;
 
+// FPGA bus shadow state; see FPGA_Bus* methods
+//
+uint  fpgaBusPage = FPGA_PAGE_UNKNOWN;
+bool  isFpgaBusWrite = false;
+ulong fpgaPageWrites = 0;
+ulong fpgaPageSkips = 0;
+
+LATENCY latFpgaWake;
+
+// TC1 time of the last ISR_FPGA; valid while isFpgaIrqStamped is set
+//
+static volatile uint dFpgaIrqStamp;
+static volatile bool isFpgaIrqStamped = false;
+
 //---------------------------------------------------------------------------------------
 // Handler for the FPGA state change interrupt
 //---------------------------------------------------------------------------------------
 void ISR_FPGA( void )
 {
+    dFpgaIrqStamp = LAT_Now ();
+    isFpgaIrqStamped = true;
+
     // Disable interrupt until interrupt is handled and enabled again (in some task).
     //
     AT91F_AIC_DisableIt( AT91C_BASE_AIC, AT91C_ID_IRQ0 );
@@ -59,25 +76,23 @@ bool FPGA_FC_Command( uint cmd )
 
     taskENTER_CRITICAL ();
 
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_Write( XPI_W_P0_FC_CONTROL, 0x00 ); // FCC, FCD, FCE = 0
+    FPGA_BusPage( 0 );
+    FPGA_BusWrite( XPI_W_P0_FC_CONTROL, 0x00 ); // FCC, FCD, FCE = 0
 
     for ( int i = 0; i < 8; i++ )
     {
-        FPGA_Write( XPI_W_P0_FC_CONTROL, FCD[ i ] ); // FCD with FCC = 0
+        FPGA_BusWrite( XPI_W_P0_FC_CONTROL, FCD[ i ] ); // FCD with FCC = 0
         FCD[ i ] |= XPI_FC_FCC;
-        FPGA_Write( XPI_W_P0_FC_CONTROL, FCD[ i ] ); // FCD with FCC = 1
+        FPGA_BusWrite( XPI_W_P0_FC_CONTROL, FCD[ i ] ); // FCD with FCC = 1
         }
 
-    FPGA_Write( XPI_W_P0_FC_CONTROL, XPI_FC_FCE ); // FCE = 1, FCC = 0
+    FPGA_BusWrite( XPI_W_P0_FC_CONTROL, XPI_FC_FCE ); // FCE = 1, FCC = 0
 
-    FPGA_BegRead ();
-    cmd = FPGA_Read( XPI_R_P0_FC_STATUS );
+    cmd = FPGA_BusRead( XPI_R_P0_FC_STATUS );
 
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_P0_FC_CONTROL, 0x00 ); // FCE = 0
+    FPGA_BusWrite( XPI_W_P0_FC_CONTROL, 0x00 ); // FCE = 0
 
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
     return ( cmd & XPI_FC_SENSE ) != 0; // Return SENSE
@@ -219,6 +234,15 @@ portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters )
             continue;
             }
 
+        // Account the delay from ISR_FPGA until now (fpgaEvent may also be 
+        // released by tasks)
+        //
+        if ( isFpgaIrqStamped )
+        {
+            isFpgaIrqStamped = false;
+            latFpgaWake.Add( dFpgaIrqStamp );
+            }
+
         int irq_count = 10000; // protection from IRQ flood
         while( --irq_count >= 0 )
         {
@@ -226,13 +250,11 @@ portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters )
             //
             xpi.StartTransmissionIfIdle ();
 
-            // Set Page 0 and IRQ status bitmap
+            // Get IRQ status bitmap (page independent)
             //
             taskENTER_CRITICAL ();
-            FPGA_BegWrite ();
-            FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-            FPGA_BegRead ();
-            uint irq_list = FPGA_Read( XPI_R_INT_REQUEST );
+            uint irq_list = FPGA_BusRead( XPI_R_INT_REQUEST );
+            FPGA_BusEnd ();
             taskEXIT_CRITICAL ();
 
             if ( ! irq_list )
@@ -244,11 +266,11 @@ portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters )
                 }
             if ( irq_list & XPI_IRQ_CTX ) // CTX FIFO
             {
-                xpi.On_CTX ();
+                xpi.On_CTX( irq_list );
                 }
             if ( irq_list & XPI_IRQ_CRX ) // CRX FIFO
             {
-                xpi.On_CRX ();
+                xpi.On_CRX( irq_list );
                 }
             if ( irq_list & XPI_IRQ_EIRQ ) // EIRQ FIFO
             {
@@ -261,16 +283,15 @@ portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters )
             if ( irq_list & XPI_IRQ_PCM ) // PCM FIFO
             {
                 taskENTER_CRITICAL ();
-                FPGA_BegWrite ();
-                FPGA_Write( XPI_W_PAGE_ADDR, 2 ); // Page 2
-                FPGA_BegRead ();
+                FPGA_BusPage( 2 );
                 
                 // Collect 160 samples and send them as a packet to host.
                 // At the same time read-in RPCM data from the last RPCM packet.
                 // int octet = FPGA_Read( XPI_R_P2_PCM_R1 );
                 
                 // Acknowledge interrupt
-                FPGA_Read( XPI_R_P2_PCM_ACK );
+                FPGA_BusRead( XPI_R_P2_PCM_ACK );
+                FPGA_BusEnd ();
                 taskEXIT_CRITICAL ();
                 }
             }
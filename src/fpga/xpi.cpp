@@ -42,19 +42,46 @@ void XPI::DumpStatus( void )
     tracef( 2, "fpgaOK = %d, isMCPU = %d, isEIRQ = %d, isCTXE = %d, xsvfRC = %d\n",
            fpgaOK, isMCPU, isEIRQ, isCTXE, xsvf.GetLastRC () );
     
-    tracef( 2, "trace = %02x, state = %d, timer = %d, pRead = %d, pWrite = %d, \n",
-           traceMask, state, timer, pRead - buf, pWrite - buf, traceMask );
+    tracef( 2, "trace = %02x, state = %d, timer = %d\n", traceMask, state, timer );
 
     tracef( 2, "semaMutex = %d, semaFull = %d, semaEmpty = %d, semaSent = %d\n",
            semaMutex.GetCount (), semaFull.GetCount (), semaEmpty.GetCount (), 
            semaSent.GetCount ()
            );
     
-    tracef( 2, "EIRQ: Count = %lu, Stuck = %lu\n", eirq_count, stuck_eirq_count );
+    tracef( 2, "Queued %u octets, %u frames; Credits %s, freed %lu octets, %u frames\n",
+           queuedBytes, queuedFrames, isCredit ? "on" : "off", freedBytes, freedFrames );
 
-    tracef( 2, "Active boards %d:", poll_active_cnt );
+    tracef( 2, "SC queues:" );
+    for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+    {
+        if ( scQueue[ i ].head != SC_SLOT_NONE )
+            tracef( 2, " %02x%s", i, scQueue[ i ].holdoff ? "(held)" : "" );
+        }
+    tracef( 2, "\n" );
+
+    ulong steps100 = eirq_count ? poll_steps * 100 / eirq_count : 0;
+    tracef( 2, "EIRQ: Count = %lu, Stuck = %lu, Polls/EIRQ = %lu.%02lu\n", 
+           eirq_count, stuck_eirq_count, steps100 / 100, steps100 % 100 );
+
+    tracef( 2, "SC RTT (us, timeout ms):" );
+    for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+    {
+        if ( scRtt[ i ].samples > 0 )
+            tracef( 2, " %02x: %u+-%u %ld", i, scRtt[ i ].srtt8 >> 3, 
+                    scRtt[ i ].rttvar4 >> 2, BoardTimeout( i, RECEIVE_TIMEOUT, true ) );
+        }
+    tracef( 2, "\n" );
+
+    tracef( 2, "FIFO: %lu bursts, %lu octets, max %u\n", 
+           fifo_bursts, fifo_octets, fifo_burst_max );
+
+    tracef( 2, "Bus: %lu page writes, %lu skipped\n", fpgaPageWrites, fpgaPageSkips );
+
+    tracef( 2, "Active boards %d (weight):", poll_active_cnt );
     for ( int i = 0; i < poll_active_cnt; i++ )
-        tracef( 2, " %02x", poll_list[ i ] & 0x3F );
+        tracef( 2, " %02x(%u)", poll_list[ i ] & 0x3F, 
+                eirq_weight[ poll_list[ i ] & 0x3F ] >> 8 );
     tracef( 2, "\n" );
     
     tracef( 2, "Passive boards %d:", maxboardc - poll_active_cnt );
@@ -101,16 +128,20 @@ void XPI::ResetFPGA( void )
 
     // SYS message to host
     //
-    sMsg.timeStamp = dTimerTick;
-    sMsg.type      = XPI_IMSG_FPGA_STATUS;
-    sMsg.subtype   = 0;
-    sMsg.data[0]   = fpgaOK;
-    sMsg.data[1]   = isMCPU;
-    sMsg.data[2]   = boardPos;
-    sMsg.data[3]   = xsvf.GetLastRC ();
-
-    usbOut.Put( NULL, 0, 1000 );
-    usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 4, 1000 );
+    usbOut.Put( NULL, 0, 1000, USB_LANE_CTRL );
+
+    uchar status[ 4 ] = { uchar( fpgaOK ), uchar( isMCPU ), uchar( boardPos ), uchar( xsvf.GetLastRC () ) };
+    usbNotify.Event( XPI_IMSG_FPGA_STATUS, 0, status, sizeof( status ) );
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FPGA_STATUS, 0, 4, 1000 );
+    if ( pMsg )
+    {
+        pMsg->data[0] = fpgaOK;
+        pMsg->data[1] = isMCPU;
+        pMsg->data[2] = boardPos;
+        pMsg->data[3] = xsvf.GetLastRC ();
+        usbOut.Commit( pMsg );
+        }
     }
 
 //---------------------------------------------------------------------------------------
@@ -138,12 +169,11 @@ void XPI::InitializeFPGA( bool coldStart, bool forcePassive )
     // Get FPGA magic ID and board position (slot#)
     //
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-    FPGA_BegRead ();
-    uint magic = FPGA_Read( XPI_R_P1_MAGIC_LSB ) 
-               | ( FPGA_Read( XPI_R_P1_MAGIC_MSB ) << 8 );
-    boardPos = FPGA_Read( XPI_R_P1_BOARD_POS );
+    FPGA_BusPage( 1 );
+    uint magic = FPGA_BusRead( XPI_R_P1_MAGIC_LSB ) 
+               | ( FPGA_BusRead( XPI_R_P1_MAGIC_MSB ) << 8 );
+    boardPos = FPGA_BusRead( XPI_R_P1_BOARD_POS );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
     // tracef( 2, "FPGA Magic %04X\n", magic );
@@ -164,10 +194,9 @@ void XPI::InitializeFPGA( bool coldStart, bool forcePassive )
             // Are we CPU-D_?
             //
             taskENTER_CRITICAL ();
-            FPGA_BegWrite ();
-            FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-            isMCPU = ISSET( FPGA_Read( XPI_R_P0_GLB_STATUS ), XPI_GLB_MCPU );
-            FPGA_BegRead ();
+            FPGA_BusPage( 0 );
+            isMCPU = ISSET( FPGA_BusRead( XPI_R_P0_GLB_STATUS ), XPI_GLB_MCPU );
+            FPGA_BusEnd ();
             taskEXIT_CRITICAL ();
 
             fpgaOK = true;
@@ -178,12 +207,11 @@ void XPI::InitializeFPGA( bool coldStart, bool forcePassive )
             // and get board position again
             //
             taskENTER_CRITICAL ();
-            FPGA_BegWrite ();
-            FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-            FPGA_Write( XPI_W_P0_GLB_CONTROL, XPI_GLB_MCPU );
-            FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-            FPGA_BegRead ();
-            boardPos = FPGA_Read( XPI_R_P1_BOARD_POS );
+            FPGA_BusPage( 0 );
+            FPGA_BusWrite( XPI_W_P0_GLB_CONTROL, XPI_GLB_MCPU );
+            FPGA_BusPage( 1 );
+            boardPos = FPGA_BusRead( XPI_R_P1_BOARD_POS );
+            FPGA_BusEnd ();
             taskEXIT_CRITICAL ();
 
             if ( ( boardPos & 0x30 ) != 0 )
@@ -203,29 +231,20 @@ void XPI::InitializeFPGA( bool coldStart, bool forcePassive )
 
     if ( fpgaOK )
     {
-        // Set green LED and clear yellow and red LED
-        //
-        taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_LED_SET, XPI_LED_G );
-        FPGA_Write( XPI_W_P0_LED_CLEAR, XPI_LED_R | XPI_LED_Y );
-        FPGA_BegRead ();
-        taskEXIT_CRITICAL ();
-        
-        // Unmask Interrupts: 
+        // Set green LED and clear yellow and red LED, then unmask interrupts: 
         // 1) EIRQ, CRX, CTX, FC: always
         // 2) CTXE: only if isMCPU mode
         //
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_IRQ_ENABLE, 
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_G );
+        FPGA_BusWrite( XPI_W_P0_LED_CLEAR, XPI_LED_R | XPI_LED_Y );
+        FPGA_BusWrite( XPI_W_P0_IRQ_ENABLE, 
             XPI_IRQ_EIRQ | XPI_IRQ_CRX | XPI_IRQ_CTX | XPI_IRQ_FC
             );
         if ( isMCPU )
-            FPGA_Write( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_CTXE );
-        FPGA_BegRead ();
+            FPGA_BusWrite( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_CTXE );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
 
         // Initialize SC transceiver state
@@ -246,37 +265,68 @@ void XPI::InitializeFPGA( bool coldStart, bool forcePassive )
         AT91F_AIC_EnableIt( AT91C_BASE_AIC, AT91C_ID_IRQ0 );
         }
 
-    sMsg.timeStamp = dTimerTick;
-    sMsg.type      = XPI_IMSG_FPGA_STATUS;
-    sMsg.subtype   = 0;
-    sMsg.data[0]   = fpgaOK;
-    sMsg.data[1]   = isMCPU;
-    sMsg.data[2]   = boardPos;
-    sMsg.data[4]   = xsvf.GetLastRC ();
+    usbOut.Put( NULL, 0, 1000, USB_LANE_CTRL );
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FPGA_STATUS, 0, 4, 1000 );
+    if ( pMsg )
+    {
+        pMsg->data[0] = fpgaOK;
+        pMsg->data[1] = isMCPU;
+        pMsg->data[2] = boardPos;
+        pMsg->data[3] = xsvf.GetLastRC ();
+        usbOut.Commit( pMsg );
+        }
+    }
 
-    usbOut.Put( NULL, 0, 1000 );
-    usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 4, 1000 );
+//---------------------------------------------------------------------------------------
+// Send assembled CTX/CRX frame to host as XPI_IMSG of the given type
+//---------------------------------------------------------------------------------------
+void XPI::PutFrame
+(
+    uchar type, 
+    uchar subtype, 
+    ulong timeStamp,
+    const uchar* data, 
+    int len, 
+    portTickType xTicksToWait
+    )
+{
+    XPI_IMSG* pMsg = usbOut.BeginMsg( type, subtype, len, xTicksToWait );
+    if ( pMsg )
+    {
+        pMsg->timeStamp = timeStamp;
+        memcpy( pMsg->data, data, len );
+        usbOut.Commit( pMsg );
+        }
     }
 
 void XPI::On_FC( void )
 {
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_BegRead ();
-    uint fc_cmd = FPGA_Read( XPI_R_P0_FC_FDFA );
-    uint fc_sense = FPGA_Read( XPI_R_P0_FC_SENSE );
+    FPGA_BusPage( 0 );
+    uint fc_cmd = FPGA_BusRead( XPI_R_P0_FC_FDFA );
+    uint fc_sense = FPGA_BusRead( XPI_R_P0_FC_SENSE );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
     
-    sMsg.timeStamp = dTimerTick;
-    sMsg.type      = XPI_IMSG_FC_EVENT;
-    sMsg.subtype   = 0;
-    sMsg.data[0]   = ( ( fc_cmd ) >> 2 ) & 0x3F;
-    sMsg.data[1]   = ( fc_cmd ) & 0x03;
-    sMsg.data[2]   = fc_sense;
-    sMsg.data[3]   = state;
-
-    usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 4, 1 );
+    // FC event hints that the board may raise EIRQ. Passive boards do not
+    // answer polls, so they are not weighted.
+    //
+    if ( IsBoardActive( ( fc_cmd >> 2 ) & 0x3F ) )
+        CountEirqHit( ( fc_cmd >> 2 ) & 0x3F, EIRQ_HINT_WEIGHT );
+
+    uchar event[ 4 ] = 
+    {
+        uchar( ( fc_cmd >> 2 ) & 0x3F ), uchar( fc_cmd & 0x03 ), uchar( fc_sense ), uchar( state )
+        };
+    usbNotify.Event( XPI_IMSG_FC_EVENT, 0, event, sizeof( event ) );
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FC_EVENT, 0, 4, 1 );
+    if ( pMsg )
+    {
+        memcpy( pMsg->data, event, sizeof( event ) );
+        usbOut.Commit( pMsg );
+        }
     }
 
 void XPI::On_EIRQ( void )
@@ -290,31 +340,30 @@ void XPI::On_EIRQ( void )
         // new EIRQ if present.)
         //
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_IRQ_DISABLE, XPI_IRQ_EIRQ );
-        FPGA_BegRead ();
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_IRQ_DISABLE, XPI_IRQ_EIRQ );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
         }
     else
     {
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_BegRead ();
-        isEIRQ = FPGA_Read( XPI_R_P0_SC_EIRQ ); // EIRQ FIFO
+        FPGA_BusPage( 0 );
+        isEIRQ = FPGA_BusRead( XPI_R_P0_SC_EIRQ ); // EIRQ FIFO
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
         }
 
     if ( traceMask & DBG_EIRQ )
     {
-        sMsg.timeStamp = dTimerTick;
-        sMsg.type      = XPI_IMSG_TRACE_EIRQ;
-        sMsg.subtype   = 0;
-        sMsg.data[0]   = isEIRQ;
-        sMsg.data[1]   = ctxLen;
-        sMsg.data[2]   = state;
-        usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 3, 1 );
+        XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_EIRQ, 0, 3, 1 );
+        if ( pMsg )
+        {
+            pMsg->data[0] = isEIRQ;
+            pMsg->data[1] = ctxLen;
+            pMsg->data[2] = state;
+            usbOut.Commit( pMsg );
+            }
         }    
     }
 
@@ -335,10 +384,9 @@ void XPI::On_CTXE( void )
     // as much data into FIFO as it gets (max 31 octet) from the beginning.)
     //
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_Write( XPI_W_P0_IRQ_DISABLE, XPI_IRQ_CTXE );
-    FPGA_BegRead ();
+    FPGA_BusPage( 0 );
+    FPGA_BusWrite( XPI_W_P0_IRQ_DISABLE, XPI_IRQ_CTXE );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
     if ( state == WAIT_SENT )
@@ -371,6 +419,9 @@ void XPI::ResetPollList( void )
     for ( int i = 0; i < maxboardc; i++ )
         poll_list[ i ] = i;
 
+    for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+        eirq_weight[ i ] = 0;
+
     poll_cur = -1;
     poll_active_cnt = 0;
     rearrange_poll_list = false;
@@ -385,6 +436,9 @@ void XPI::PollNextBoard( void )
     else
         ++poll_cur;
 
+    if ( poll_cur < maxboardc )
+        ++poll_steps;
+
     if ( poll_cur >= maxboardc )
     {
         // The last board reached while polling EIRQ
@@ -403,10 +457,9 @@ void XPI::PollNextBoard( void )
         // Enable EIRQ interrupt
         //
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
-        FPGA_BegRead ();
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
         
         Goto( IDLE );
@@ -424,14 +477,16 @@ void XPI::PollNextBoard( void )
     //
     isCTXE = false;
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-    FPGA_Write( XPI_W_P1_SC_CTX_DATA, poll_list[ poll_cur ] & 0x3F );
-    FPGA_Write( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
-    FPGA_BegRead ();
+    FPGA_BusPage( 1 );
+    FPGA_BusWrite( XPI_W_P1_SC_CTX_DATA, poll_list[ poll_cur ] & 0x3F );
+    FPGA_BusWrite( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
-    Goto( POLL_EIRQ, EIRQ_POLL_DELAY );
+    StartRtt( poll_list[ poll_cur ] & 0x3F );
+
+    Goto( POLL_EIRQ, 
+        BoardTimeout( poll_list[ poll_cur ] & 0x3F, EIRQ_POLL_DELAY, false ) );
 
     // tracef( 2, "SC: %02x\n", poll_list[ poll_cur ] & 0x3F ); 
     }
@@ -458,6 +513,20 @@ void XPI::MarkBoardActive( bool active )
         }
     }
 
+// Returns true if the board answered its last EIRQ poll. The active flag of its
+// poll list entry is checked, as the list may not have been rearranged yet.
+//
+bool XPI::IsBoardActive( uint board ) const
+{
+    for ( int i = 0; i < maxboardc; i++ )
+    {
+        if ( ( poll_list[ i ] & 0x3F ) == board )
+            return ( poll_list[ i ] & 0x80 ) != 0;
+        }
+
+    return false;
+    }
+
 void XPI::RearrangePollList( void )
 {
     if ( ! rearrange_poll_list )
@@ -529,11 +598,56 @@ void XPI::RearrangePollList( void )
 
     // assert( k == N );
 
-    tracef( 2, "SC: Active boards %d+%d-%d\n", poll_active_cnt, 
-            new_active, new_passive );
+    if ( new_active || new_passive )
+    {
+        tracef( 2, "SC: Active boards %d+%d-%d\n", poll_active_cnt, 
+                new_active, new_passive );
+        }
     
     poll_active_cnt += new_active;
     poll_active_cnt -= new_passive;
+
+    SortPollList ();
+    }
+
+// Sorts active boards by descending EIRQ weight (insertion sort, stable,
+// as the list is mostly sorted already)
+//
+void XPI::SortPollList( void )
+{
+    for ( int i = 1; i < poll_active_cnt; i++ )
+    {
+        uchar board = poll_list[ i ];
+        uint weight = eirq_weight[ board & 0x3F ];
+
+        int pos = i;
+        for ( ; pos > 0 && eirq_weight[ poll_list[ pos - 1 ] & 0x3F ] < weight; pos-- )
+            poll_list[ pos ] = poll_list[ pos - 1 ];
+
+        poll_list[ pos ] = board;
+        }
+    }
+
+// Adds weight to the board's EIRQ hit count. While EIRQ is being polled, 
+// poll_cur indexes the poll list, so it is sorted again at the end of the poll;
+// otherwise (e.g. hint from an FC event) it is sorted right away, as pending
+// rearrangement is discarded when the next EIRQ poll starts.
+//
+void XPI::CountEirqHit( uint board, uint weight )
+{
+    uint w = eirq_weight[ board ] + weight;
+    eirq_weight[ board ] = w > 0xFFFF ? 0xFFFF : w;
+
+    if ( state == POLL_EIRQ || state == RECEIVE_CRX )
+        rearrange_poll_list = true;
+    else
+        SortPollList ();
+    }
+
+void XPI::DecayEirqWeights( void )
+{
+    for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+        eirq_weight[ i ] >>= 1;
     }
 
 void XPI::On_Timer( void )
@@ -561,6 +675,7 @@ void XPI::On_Timer( void )
         // No NAK() or MSG(): Mark board passive and continue polling next 
         // card position from the poll priority list.
         //
+        rttBoard = -1;
         MarkBoardActive( false );
         PollNextBoard ();
         }
@@ -594,10 +709,9 @@ void XPI::On_Timer( void )
         // Enable EIRQ interrupt
         //
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
-        FPGA_BegRead ();
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
         }
     else if ( state == WAIT_CTXE )
@@ -627,6 +741,7 @@ void XPI::On_Timer( void )
         tracef( 2, "SC: Timeout in WAIT_ACK\n" );
         taskEXIT_CRITICAL ();
 #endif        
+        TimeoutRtt( pRead[0] & 0x3F );
         ctx_status = 3; // CTX completion status = Error, timeout
         semaSent.Release( 1 );
         Goto( IDLE );
@@ -639,26 +754,183 @@ void XPI::On_Timer( void )
         }
     }
 
-void XPI::On_CTX( void )
+//---------------------------------------------------------------------------------------
+// Per-board round-trip time. StartRtt() is called when a frame expecting an ACK 
+// or a poll has been put into CTX, SampleRtt() when the board responds.
+//---------------------------------------------------------------------------------------
+void XPI::StartRtt( int board )
+{
+    rttBoard     = board;
+    rttStartLat  = LAT_Now ();
+    rttStartTick = dTimerTick;
+    }
+
+void XPI::SampleRtt( uint board )
+{
+    if ( rttBoard != int( board ) )
+        return;
+
+    rttBoard = -1;
+
+    // TC1 wraps every LAT_WRAP_US (~10.9 ms). dTimerTick counts whole ms, so
+    // the time is more than ticks - 1 and less than ticks + 1 ms; a wrap being
+    // longer than that window, the TC1 time is taken with as many wraps added
+    // as bring it into the window. No wrap is added while TC1 cannot have
+    // wrapped.
+    //
+    ulong ticks = dTimerTick - rttStartTick;
+    uint rtt = ( ( LAT_Now () - rttStartLat ) & 0xFFFF ) / LAT_TICKS_PER_US;
+
+    while ( rtt + 1000 < ticks * 1000 )
+        rtt += LAT_WRAP_US;
+
+    SC_RTT& r = scRtt[ board ];
+
+    if ( r.samples == 0 )
+    {
+        r.srtt8   = rtt << 3;
+        r.rttvar4 = rtt << 1;
+        }
+    else
+    {
+        int delta = int( rtt ) - int( r.srtt8 >> 3 );
+        r.srtt8 += delta;
+
+        if ( delta < 0 )
+            delta = -delta;
+        r.rttvar4 += delta - int( r.rttvar4 >> 2 );
+        }
+
+    if ( r.samples < 0xFFFF )
+        ++r.samples;
+
+    r.backoff = 0;
+    }
+
+void XPI::TimeoutRtt( uint board )
+{
+    rttBoard = -1;
+
+    if ( scRtt[ board ].backoff < SC_BACKOFF_MAX )
+        ++scRtt[ board ].backoff;
+    }
+
+// Returns the ACK or poll timeout for the board in ms: smoothed RTT plus four
+// deviations, rounded up, plus a tick. Only ACK timeouts are backed off.
+// Boards without samples get the default as is.
+//
+long XPI::BoardTimeout( uint board, long defaultTimeout, bool isAck ) const
+{
+    const SC_RTT& r = scRtt[ board ];
+
+    if ( r.samples == 0 )
+        return defaultTimeout;
+
+    uint rttvar4 = r.rttvar4 > SC_RTTVAR_MIN ? r.rttvar4 : SC_RTTVAR_MIN;
+    long timeout = ( ( r.srtt8 >> 3 ) + rttvar4 + 999 ) / 1000 + 1;
+
+    if ( isAck )
+        timeout <<= r.backoff;
+
+    return timeout < SC_TIMEOUT_MIN ? SC_TIMEOUT_MIN
+         : timeout > SC_TIMEOUT_MAX ? SC_TIMEOUT_MAX : timeout;
+    }
+
+// Fills XPI_IMSG_SC_RTT records, at most maxLen octets; returns the length.
+// If data is NULL, returns the length of all records. Boards never lose their 
+// samples, so the length does not decrease between the calls.
+//
+uint XPI::GetRtt( uchar* data, uint maxLen ) const
+{
+    uint len = 0;
+
+    for ( uint i = 0; i < MAX_BOARD_COUNT; i++ )
+    {
+        const SC_RTT& r = scRtt[ i ];
+
+        if ( r.samples == 0 )
+            continue;
+
+        if ( data == NULL )
+        {
+            len += XPI_SC_RTT_RECORD_LEN;
+            continue;
+            }
+
+        if ( len + XPI_SC_RTT_RECORD_LEN > maxLen )
+            break;
+
+        uint srtt   = r.srtt8 >> 3;
+        uint rttvar = r.rttvar4 >> 2;
+
+        uchar* p = data + len;
+        p[ 0 ] = i;
+        p[ 1 ] = srtt > 0xFFFF ? 0xFF : srtt >> 8;
+        p[ 2 ] = srtt > 0xFFFF ? 0xFF : srtt;
+        p[ 3 ] = rttvar > 0xFFFF ? 0xFF : rttvar >> 8;
+        p[ 4 ] = rttvar > 0xFFFF ? 0xFF : rttvar;
+        p[ 5 ] = BoardTimeout( i, RECEIVE_TIMEOUT, true );
+        p[ 6 ] = r.samples >> 8;
+        p[ 7 ] = r.samples;
+
+        len += XPI_SC_RTT_RECORD_LEN;
+        }
+
+    return len;
+    }
+
+//---------------------------------------------------------------------------------------
+// Drains the CTX or CRX FIFO in one page 0 session; returns the octet count
+//---------------------------------------------------------------------------------------
+uint XPI::ReadFifo( uint addr, uint irq, uchar* data, uint& irq_list )
 {
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_BegRead ();
-    uint octet = FPGA_Read( XPI_R_P0_SC_CTX );
+    FPGA_BusPage( 0 );
+    uint len = FPGA_ReadFifo( addr, irq, data, FIFO_BURST_MAX, irq_list );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
+    ++fifo_bursts;
+    fifo_octets += len;
+    if ( len > fifo_burst_max )
+        fifo_burst_max = len;
+
+    return len;
+    }
+
+void XPI::On_CTX( uint& irq_list )
+{
+    uchar octets[ FIFO_BURST_MAX ];
+
+    uint len = ReadFifo( XPI_R_P0_SC_CTX, XPI_IRQ_CTX, octets, irq_list );
+
+    for ( uint i = 0; i < len; i++ )
+        AssembleCTX( octets[ i ] );
+    }
+
+void XPI::On_CRX( uint& irq_list )
+{
+    uchar octets[ FIFO_BURST_MAX ];
+
+    uint len = ReadFifo( XPI_R_P0_SC_CRX, XPI_IRQ_CRX, octets, irq_list );
+
+    for ( uint i = 0; i < len; i++ )
+        AssembleCRX( octets[ i ] );
+    }
+
+void XPI::AssembleCTX( uint octet )
+{
     if ( isMCPU )
     {
         if ( state == IDLE || state == WAIT_ACK  
           || state == WAIT_CTXE || state == WAIT_SENT || state == BLOCKED_SEND )
         {
             if ( ctxLen == 0 )
-                sCTX.timeStamp = dTimerTick;
+                ctxTimeStamp = dTimerTick;
 
-            sCTX.data[ ctxLen ] = octet;
+            ctxData[ ctxLen ] = octet;
 
-            ctxCkSum ^= sCTX.data[ ctxLen ];
+            ctxCkSum ^= ctxData[ ctxLen ];
             ctxCkSum <<= 1;
             if ( ctxCkSum & 0x100 )
             {
@@ -668,44 +940,42 @@ void XPI::On_CTX( void )
 
             ++ctxLen;
 
-            if ( sCTX.data[0] == 0xC0  // Poll octet
-               || ( sCTX.data[0] & 0xC0 ) == 0x00  // NACK or poll octet
+            if ( ctxData[0] == 0xC0  // Poll octet
+               || ( ctxData[0] & 0xC0 ) == 0x00  // NACK or poll octet
                )
             {
                 if ( traceMask & DBG_EIRQ )
                 {
-                    sCTX.subtype = 0;
-                    usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+                    PutFrame( XPI_IMSG_TRACE_CTX, 0, ctxTimeStamp, ctxData, ctxLen, 1000 );
                     }
 
                 ctxLen = 0;
                 ctxCkSum = 0xFF;
                 }
-            else if ( ( sCTX.data[0] & 0xC0 ) == 0x40 ) // ACK octet; len == 1 
+            else if ( ( ctxData[0] & 0xC0 ) == 0x40 ) // ACK octet; len == 1 
             {
                 if ( traceMask & DBG_ACK )
                 {
-                    sCTX.subtype = 0;
-                    usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+                    PutFrame( XPI_IMSG_TRACE_CTX, 0, ctxTimeStamp, ctxData, ctxLen, 1000 );
                     }
 
                 ctxLen = 0;
                 ctxCkSum = 0xFF;
                 }
-            else if ( ctxLen >= 2 && ctxLen == 3 + ( sCTX.data[ 1 ] & 0x0F )) // Got Frame
+            else if ( ctxLen >= 2 && ctxLen == 3 + ( ctxData[ 1 ] & 0x0F )) // Got Frame
             {
-                sCTX.subtype = ctxCkSum ? 1 : 0;
+                uchar subtype = ctxCkSum ? 1 : 0;
 
                 if ( traceMask & DBG_CTX )
                 {
                     if ( traceMask & DBG_CTX_E0_PKT )
                     {
-                        usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+                        PutFrame( XPI_IMSG_TRACE_CTX, subtype, ctxTimeStamp, ctxData, ctxLen, 1000 );
                         }
                     else
                     {
-                        if ( sCTX.subtype || ( sCTX.data[0] & 0xE0 ) != 0xE0 )
-                            usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+                        if ( subtype || ( ctxData[0] & 0xE0 ) != 0xE0 )
+                            PutFrame( XPI_IMSG_TRACE_CTX, subtype, ctxTimeStamp, ctxData, ctxLen, 1000 );
                         }
                     }
 
@@ -714,8 +984,7 @@ void XPI::On_CTX( void )
                 }
             else if ( ctxLen > 18 ) // Overflow
             {
-                sCTX.subtype = 2;
-                usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+                PutFrame( XPI_IMSG_TRACE_CTX, 2, ctxTimeStamp, ctxData, ctxLen, 1000 );
                 ctxLen = 0; 
                 ctxCkSum = 0xFF;
                 }
@@ -724,21 +993,23 @@ void XPI::On_CTX( void )
         {
             if ( traceMask & DBG_EIRQ )
             {
-                sMsg.timeStamp = dTimerTick;
-                sMsg.type      = XPI_IMSG_TRACE_CTX;
-                sMsg.subtype   = 0;
-                sMsg.data[0]   = octet;
-                usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 1, 1 );
+                XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CTX, 0, 1, 1 );
+                if ( pMsg )
+                {
+                    pMsg->data[0] = octet;
+                    usbOut.Commit( pMsg );
+                    }
                 }
             }
         else // Ignore octet
         {
-            sMsg.timeStamp = dTimerTick;
-            sMsg.type      = XPI_IMSG_TRACE_CTX;
-            sMsg.subtype   = 3;
-            sMsg.data[0]   = octet;
-            sMsg.data[1]   = state;
-            usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
+            XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CTX, 3, 2, 1 );
+            if ( pMsg )
+            {
+                pMsg->data[0] = octet;
+                pMsg->data[1] = state;
+                usbOut.Commit( pMsg );
+                }
             }
         return;
         }
@@ -747,16 +1018,16 @@ void XPI::On_CTX( void )
     {
         if ( state == IDLE )
         {
-            sCTX.timeStamp = dTimerTick;
+            ctxTimeStamp = dTimerTick;
             ctxLen = 0; // Begin frame
             ctxCkSum = 0xFF;
             }
 
         Goto( RECEIVE_CTX, RECEIVE_TIMEOUT );
 
-        sCTX.data[ ctxLen ] = octet;
+        ctxData[ ctxLen ] = octet;
 
-        ctxCkSum ^= sCTX.data[ ctxLen ];
+        ctxCkSum ^= ctxData[ ctxLen ];
         ctxCkSum <<= 1;
         if ( ctxCkSum & 0x100 )
         {
@@ -766,24 +1037,21 @@ void XPI::On_CTX( void )
 
         ++ctxLen;
 
-        if ( isEIRQ && sCTX.data[0] == 0xC0 ) // Poll EIRQ; len == 1 
+        if ( isEIRQ && ctxData[0] == 0xC0 ) // Poll EIRQ; len == 1 
         {
-            sCTX.subtype = 0;
-            usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+            PutFrame( XPI_IMSG_TRACE_CTX, 0, ctxTimeStamp, ctxData, ctxLen, 1000 );
             ctxLen = 0;
             Goto( POLL_EIRQ, 100 );
             }
-        if ( ( sCTX.data[0] & 0xC0 ) == 0x40 ) // Acknowledge; len == 1
+        if ( ( ctxData[0] & 0xC0 ) == 0x40 ) // Acknowledge; len == 1
         {
-            sCTX.subtype = 0;
-            usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+            PutFrame( XPI_IMSG_TRACE_CTX, 0, ctxTimeStamp, ctxData, ctxLen, 1000 );
             ctxLen = 0;
             Goto( IDLE );
             }
-        else if ( ctxLen >= 2 && ctxLen == 3 + ( sCTX.data[ 1 ] & 0x0F )) // Got Frame
+        else if ( ctxLen >= 2 && ctxLen == 3 + ( ctxData[ 1 ] & 0x0F )) // Got Frame
         {
-            sCTX.subtype = ctxCkSum ? 1 : 0;
-            usbOut.Put( &sCTX, sizeof( XPI_IMSG_HEADER ) + ctxLen, 1000 );
+            PutFrame( XPI_IMSG_TRACE_CTX, ctxCkSum ? 1 : 0, ctxTimeStamp, ctxData, ctxLen, 1000 );
             ctxLen = 0; 
             ctxCkSum = 0xFF;
             Goto( IDLE );
@@ -791,49 +1059,48 @@ void XPI::On_CTX( void )
         }
     else if ( state == POLL_EIRQ  )
     {
-        sMsg.timeStamp = dTimerTick;
-        sMsg.type      = XPI_IMSG_TRACE_CTX;
-        sMsg.subtype   = 0;
-        sMsg.data[0]   = octet;
-        usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 1, 1 );
+        XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CTX, 0, 1, 1 );
+        if ( pMsg )
+        {
+            pMsg->data[0] = octet;
+            usbOut.Commit( pMsg );
+            }
         }
     else // Ignore octet
     {
-        sMsg.timeStamp = dTimerTick;
-        sMsg.type      = XPI_IMSG_TRACE_CTX;
-        sMsg.subtype   = 3;
-        sMsg.data[0]   = octet;
-        sMsg.data[1]   = state;
-        usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
+        XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CTX, 3, 2, 1 );
+        if ( pMsg )
+        {
+            pMsg->data[0] = octet;
+            pMsg->data[1] = state;
+            usbOut.Commit( pMsg );
+            }
         }
     }
 
-void XPI::On_CRX( void )
+void XPI::AssembleCRX( uint octet )
 {
-    taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_BegRead ();
-    uint octet = FPGA_Read( XPI_R_P0_SC_CRX );
-    taskEXIT_CRITICAL ();
-
     if ( isMCPU )
     {
         if ( state == WAIT_ACK )
         {
             uint ackid = 0x40 | ( pRead[0] & 0x3F );
             if ( octet == ackid )
+            {
+                SampleRtt( pRead[0] & 0x3F );
                 ctx_status = 0; // CTX completion status = OK
+                }
             else
                 ctx_status = 0x80 | pRead[0]; // CTX completion status = Error, negative ack
 
             if ( traceMask & DBG_ACK )
             {
-                sMsg.timeStamp = dTimerTick;
-                sMsg.type      = XPI_IMSG_TRACE_CRX;
-                sMsg.subtype   = ctx_status ? 4 : 0;
-                sMsg.data[0]   = octet;
-                usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 1, 1 );
+                XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CRX, ctx_status ? 4 : 0, 1, 1 );
+                if ( pMsg )
+                {
+                    pMsg->data[0] = octet;
+                    usbOut.Commit( pMsg );
+                    }
                 }
                 
             semaSent.Release( 1 );
@@ -865,7 +1132,10 @@ void XPI::On_CRX( void )
                     PollNextBoard ();
                     return;
                     }
-                else if ( ( octet & 0xC0 ) == 0x00 )
+                
+                SampleRtt( octet & 0x3F );
+
+                if ( ( octet & 0xC0 ) == 0x00 )
                 {
                     // Got NACK(): mark board active and continue polling next board
                     //
@@ -884,28 +1154,28 @@ void XPI::On_CRX( void )
                 //
                 //
                 MarkBoardActive( true );
+                CountEirqHit( octet & 0x3F, EIRQ_HIT_WEIGHT );
                 
                 // Begin CRX frame
                 //
-                sCRX.timeStamp = dTimerTick;
+                crxTimeStamp = dTimerTick;
                 crxLen = 0;
                 crxCkSum = 0xFF;
 
                 // Enable EIRQ interrupt
                 //
                 taskENTER_CRITICAL ();
-                FPGA_BegWrite ();
-                FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-                FPGA_Write( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
-                FPGA_BegRead ();
+                FPGA_BusPage( 0 );
+                FPGA_BusWrite( XPI_W_P0_IRQ_ENABLE, XPI_IRQ_EIRQ );
+                FPGA_BusEnd ();
                 taskEXIT_CRITICAL ();
                 }
 
             // Collect CRX data
             
-            sCRX.data[ crxLen ] = octet;
+            crxData[ crxLen ] = octet;
 
-            crxCkSum ^= sCRX.data[ crxLen ];
+            crxCkSum ^= crxData[ crxLen ];
             crxCkSum <<= 1;
             if ( crxCkSum & 0x100 )
             {
@@ -915,7 +1185,7 @@ void XPI::On_CRX( void )
 
             ++crxLen;
 
-            if ( crxLen < 2 || crxLen != 3 + ( sCRX.data[ 1 ] & 0x0F ) )
+            if ( crxLen < 2 || crxLen != 3 + ( crxData[ 1 ] & 0x0F ) )
             {
                 // Wait more data
                 //
@@ -925,8 +1195,7 @@ void XPI::On_CRX( void )
             {
                 // We have complete frame
                 //
-                sCRX.subtype = crxCkSum ? 1 : 0;
-                usbOut.Put( &sCRX, sizeof( XPI_IMSG_HEADER ) + crxLen, 1000 );
+                PutFrame( XPI_IMSG_TRACE_CRX, crxCkSum ? 1 : 0, crxTimeStamp, crxData, crxLen, 1000 );
                 crxLen = 0; 
                 crxCkSum = 0xFF;
 
@@ -943,15 +1212,14 @@ void XPI::On_CRX( void )
                 {
                     // Put acknowledge to CTX
                     //
-                    int ackid = 0x40 | ( sCRX.data[ 0 ] & 0x3F );
+                    int ackid = 0x40 | ( crxData[ 0 ] & 0x3F );
 
                     isCTXE = false;
                     taskENTER_CRITICAL ();
-                    FPGA_BegWrite ();
-                    FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-                    FPGA_Write( XPI_W_P1_SC_CTX_DATA, ackid );
-                    FPGA_Write( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
-                    FPGA_BegRead ();
+                    FPGA_BusPage( 1 );
+                    FPGA_BusWrite( XPI_W_P1_SC_CTX_DATA, ackid );
+                    FPGA_BusWrite( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
+                    FPGA_BusEnd ();
                     taskEXIT_CRITICAL ();
                     }
 
@@ -966,12 +1234,13 @@ void XPI::On_CRX( void )
             }
         else // Unsolicited CRX octet
         {
-            sMsg.timeStamp = dTimerTick;
-            sMsg.type      = XPI_IMSG_TRACE_CRX;
-            sMsg.subtype   = 3;
-            sMsg.data[0]   = octet;
-            sMsg.data[1]   = state;
-            usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
+            XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CRX, 3, 2, 1 );
+            if ( pMsg )
+            {
+                pMsg->data[0] = octet;
+                pMsg->data[1] = state;
+                usbOut.Commit( pMsg );
+                }
             }
         return;
         }
@@ -986,9 +1255,9 @@ void XPI::On_CRX( void )
 
         Goto( RECEIVE_CRX, RECEIVE_TIMEOUT );
 
-        sCRX.data[ crxLen ] = octet;
+        crxData[ crxLen ] = octet;
 
-        crxCkSum ^= sCRX.data[ crxLen ];
+        crxCkSum ^= crxData[ crxLen ];
         crxCkSum <<= 1;
         if ( crxCkSum & 0x100 )
         {
@@ -998,17 +1267,15 @@ void XPI::On_CRX( void )
 
         ++crxLen;
 
-        if ( ( sCRX.data[0] & 0xC0 ) == 0x40 ) // Acknowledge; len == 1
+        if ( ( crxData[0] & 0xC0 ) == 0x40 ) // Acknowledge; len == 1
         {
-            sCRX.subtype = 0;
-            usbOut.Put( &sCRX, sizeof( XPI_IMSG_HEADER ) + crxLen, 1000 );
+            PutFrame( XPI_IMSG_TRACE_CRX, 0, crxTimeStamp, crxData, crxLen, 1000 );
             crxLen = 0;
             Goto( IDLE );
             }
-        else if ( crxLen >= 2 && crxLen == 3 + ( sCRX.data[ 1 ] & 0x0F ) ) // Got Frame
+        else if ( crxLen >= 2 && crxLen == 3 + ( crxData[ 1 ] & 0x0F ) ) // Got Frame
         {
-            sCRX.subtype = crxCkSum ? 1 : 0;
-            usbOut.Put( &sCRX, sizeof( XPI_IMSG_HEADER ) + crxLen, 1000 );
+            PutFrame( XPI_IMSG_TRACE_CRX, crxCkSum ? 1 : 0, crxTimeStamp, crxData, crxLen, 1000 );
             crxLen = 0; 
             crxCkSum = 0xFF;
             Goto( IDLE );
@@ -1016,99 +1283,250 @@ void XPI::On_CRX( void )
         }
     else // Ignore octet
     {
-        sMsg.timeStamp = dTimerTick;
-        sMsg.type      = XPI_IMSG_TRACE_CRX;
-        sMsg.subtype   = 3;
-        sMsg.data[0]   = octet;
-        sMsg.data[1]   = state;
-        usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
+        XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_TRACE_CRX, 3, 2, 1 );
+        if ( pMsg )
+        {
+            pMsg->data[0] = octet;
+            pMsg->data[1] = state;
+            usbOut.Commit( pMsg );
+            }
         }
     }
 
 bool XPI::Put( void* data, uint len, portTickType xTicksToWait )
 {
-    // Wait enough space to fit 2-byte length + data
+    // Frame must carry at least the destination address after the requestID
+    //
+    if ( len < 3 || len > XPI_SC_FRAME_MAX )
+        return false;
+
+    // Wait for a free frame slot and enough space to fit 2-byte length + data
     //
-    if ( ! semaFull.Wait( len + 2, xTicksToWait ) )
+    bool hasSlot = semaSlots.Wait( 1, xTicksToWait );
+
+    if ( ! hasSlot || ! semaFull.Wait( len + 2, xTicksToWait ) )
     {
-        if ( xTicksToWait != 0 )
-        {
-            // Report buffer full
-            //
-            uchar* pReqId = (uchar*) data;
-            sMsg.timeStamp = dTimerTick;
-            sMsg.type      = XPI_IMSG_FLOW_CTRL;
-            sMsg.subtype   = 0x77;
-            sMsg.data[0]   = pReqId[0]; // request ID
-            sMsg.data[1]   = pReqId[1];
-            usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
-            }
+        if ( hasSlot )
+            semaSlots.Release( 1 );
+
+        Reject( (uchar*) data );
         return false;
         }
 
-    // Lock pWrite mutex
+    // Lock producer mutex
     //
     LockWrite ();
 
-    // Put 2-byte length (MSB first) and SC data into circular buffer.
-    // Note that because SC message is limited in size and circular buffer
-    // has special area at the end to fit overflow, SC message will be copied
-    // as linear with pWrite going circular only at the end.
+    QueueFrame( (uchar*) data, len );
+
+    taskENTER_CRITICAL ();
+    queuedBytes += len + 2;
+    queuedFrames++;
+    taskEXIT_CRITICAL ();
+
+    // Notify XPI::Transmitter()
     //
-    *pWrite++ = ( len >> 8 ) & 0xFF;
-    *pWrite++ = len & 0xFF;
+    semaEmpty.Release( 1 );
 
-    // Put data into circular buffer.
+    // Unlock producer mutex
     //
-    memcpy( pWrite, data, len );
-    
-    // Advance pWrite (circular)
+    UnlockWrite ();
+
+    usbNotify.Watermark( XPI_SERIAL_STATE_SC_FULL, bufSize - semaFull.GetCount (), bufSize );
+
+    return true;
+    }
+
+// Queues count SC frames, each one prefixed by 1-byte length, with a single
+// semaphore operation and a single lock of the producer mutex.
+//
+bool XPI::PutBatch( const uchar* data, uint len, uint count, portTickType xTicksToWait )
+{
+    // Validate the batch and get its size in the circular buffer
+    //
+    const uchar* pEnd = data + len;
+    const uchar* p = data;
+    uint total = 0;
+
+    for ( uint i = 0; i < count; i++ )
+    {
+        if ( p >= pEnd )
+            return false;
+
+        uint frameLen = *p++;
+
+        if ( frameLen < 3 || frameLen > XPI_SC_FRAME_MAX || p + frameLen > pEnd )
+            return false;
+
+        total += frameLen + 2;
+        p += frameLen;
+        }
+
+    if ( count == 0 )
+        return true;
+
+    // Wait for free frame slots and space for all frames
+    //
+    bool hasSlots = count <= XPI_XMTR_SLOTS && total <= bufSize
+        && semaSlots.Wait( count, xTicksToWait );
+
+    if ( ! hasSlots || ! semaFull.Wait( total, xTicksToWait ) )
+    {
+        if ( hasSlots )
+            semaSlots.Release( count );
+
+        for ( p = data; count > 0; count-- )
+        {
+            Reject( p + 1 );
+            p += 1 + *p;
+            }
+        return false;
+        }
+
+    // Lock producer mutex
     //
-    pWrite += len;
-    if ( pWrite >= pMax )
-        pWrite -= bufSize;
+    LockWrite ();
+
+    p = data;
+    for ( uint i = 0; i < count; i++ )
+    {
+        uint frameLen = *p++;
+        QueueFrame( p, frameLen );
+        p += frameLen;
+        }
+
+    taskENTER_CRITICAL ();
+    queuedBytes += total;
+    queuedFrames += count;
+    taskEXIT_CRITICAL ();
 
     // Notify XPI::Transmitter()
     //
-    semaEmpty.Release( len + 2 );
+    semaEmpty.Release( count );
 
-    // Unlock pWrite mutex
+    // Unlock producer mutex
     //
     UnlockWrite ();
 
+    usbNotify.Watermark( XPI_SERIAL_STATE_SC_FULL, bufSize - semaFull.GetCount (), bufSize );
+
     return true;
     }
 
-void XPI:: Transmitter( void )
+// Reports that the SC frame with the requestID at pReqId has been rejected
+// because the transmit buffer is full
+//
+void XPI::Reject( const uchar* pReqId )
 {
-    // Wait 2-byte header
-    //
-    do ; while( ! semaEmpty.Wait( 2, 1000 ) );
+    usbNotify.SetState( XPI_SERIAL_STATE_SC_FULL, true );
+    usbNotify.Event( XPI_IMSG_FLOW_CTRL, 0x77, pReqId, 2 );
 
-    // Retrieve data length (MSG first) from packet header
-    //
-    uint len = *pRead++;
-    len = ( len << 8 ) | *pRead++;
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FLOW_CTRL, 0x77, 2, 1 );
+    if ( pMsg )
+    {
+        pMsg->data[0] = pReqId[0]; // request ID
+        pMsg->data[1] = pReqId[1];
+        usbOut.Commit( pMsg );
+        }
+    }
+
+//---------------------------------------------------------------------------------------
+// SC transmit queues. Slots are taken and linked with the producer mutex held
+// (and a slot reserved from semaSlots); the transmitter side takes them off.
+//---------------------------------------------------------------------------------------
+void XPI::QueueFrame( const uchar* data, uint len )
+{
+    SC_QUEUE& q = scQueue[ data[ 2 ] & 0x3F ];
+
+    taskENTER_CRITICAL ();
+
+    uint slot = freeSlot;
+    freeSlot = slots[ slot ].next;
+
+    SC_SLOT& s = slots[ slot ];
+    s.next = SC_SLOT_NONE;
+    s.len  = len;
+    memcpy( s.data, data, len );
+
+    if ( q.tail == SC_SLOT_NONE )
+        q.head = slot;
+    else
+        slots[ q.tail ].next = slot;
+    q.tail = slot;
+
+    taskEXIT_CRITICAL ();
+    }
+
+// Takes the first frame of the next board round-robin, skipping boards held
+// off unless there are no other frames; returns the slot.
+//
+uint XPI::NextSlot( uint& board )
+{
+    taskENTER_CRITICAL ();
+
+    int held = -1;
+    int found = -1;
 
-    // Wait the rest of data
+    for ( uint i = 0; i < MAX_BOARD_COUNT && found < 0; i++ )
+    {
+        uint b = ( scNext + i ) % MAX_BOARD_COUNT;
+        SC_QUEUE& q = scQueue[ b ];
+
+        if ( q.head == SC_SLOT_NONE )
+            continue;
+
+        if ( q.holdoff && int( q.holdoff - dTimerTick ) > 0 )
+        {
+            if ( held < 0 )
+                held = b;
+            continue;
+            }
+
+        q.holdoff = 0;
+        found = b;
+        }
+
+    board = found >= 0 ? found : held;
+
+    SC_QUEUE& q = scQueue[ board ];
+    uint slot = q.head;
+
+    q.head = slots[ slot ].next;
+    if ( q.head == SC_SLOT_NONE )
+        q.tail = SC_SLOT_NONE;
+
+    scNext = ( board + 1 ) % MAX_BOARD_COUNT;
+
+    taskEXIT_CRITICAL ();
+
+    return slot;
+    }
+
+void XPI:: Transmitter( void )
+{
+    // Wait for a frame
     //
-    do ; while( ! semaEmpty.Wait( len, 1000 ) );
+    do ; while( ! semaEmpty.Wait( 1, 1000 ) );
+
+    uint board;
+    uint slot = NextSlot( board );
 
-    // Next two octets contains requestID (MSB first).
+    // First two octets contain requestID (MSB first)
     //
-    requestID = *pRead++;
-    requestID = ( requestID << 8 ) | *pRead++;
-    len -= 2;
+    SC_SLOT& s = slots[ slot ];
+    requestID = ( s.data[ 0 ] << 8 ) | s.data[ 1 ];
+    pRead = s.data + 2;
+    uint len = s.len - 2;
 
 #if 0
     taskENTER_CRITICAL ();
-    tracef( 2, "SC: Transmitter %04x %d, L=%d\n", requestID, pRead-buf, len );
+    tracef( 2, "SC: Transmitter %04x #%02x, L=%d\n", requestID, board, len );
     taskEXIT_CRITICAL ();
 #endif
 
     // Send data and wait completion, depending on mode.
     //
-    if ( isMCPU )
+    if ( isMCPU && len > 0 )
     {
         for ( int retry = 0; retry < 2; retry++ )
         {
@@ -1116,6 +1534,7 @@ void XPI:: Transmitter( void )
             // ctx_count, which is 0 if outbound transmission buffer is empty).
             //
             ctx_status = -1; // unspecified error
+            isCtxRetry = retry > 0;
             pCtx       = pRead;
             ctx_count  = len;
     
@@ -1167,25 +1586,120 @@ void XPI:: Transmitter( void )
 
         if ( ctx_status != 0 )
         {
-            sMsg.timeStamp = dTimerTick;
-            sMsg.type      = XPI_IMSG_FLOW_CTRL;
-            sMsg.subtype   = ctx_status;
-            sMsg.data[0]   = ( requestID >> 8 ) & 0xFF;
-            sMsg.data[1]   = requestID & 0xFF;
-            usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 2, 1 );
+            // Let the other boards go first for a while
+            //
+            taskENTER_CRITICAL ();
+            scQueue[ board ].holdoff = ( dTimerTick + SC_HOLDOFF ) | 1;
+            taskEXIT_CRITICAL ();
+
+            uchar reqId[ 2 ] = { uchar( requestID >> 8 ), uchar( requestID ) };
+            usbNotify.Event( XPI_IMSG_FLOW_CTRL, ctx_status, reqId, 2 );
+
+            XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FLOW_CTRL, ctx_status, 2, 1 );
+            if ( pMsg )
+            {
+                pMsg->data[0] = ( requestID >> 8 ) & 0xFF;
+                pMsg->data[1] = requestID & 0xFF;
+                usbOut.Commit( pMsg );
+                }
             }
         }
 
-    // Advance (circular) pRead
+    // Free the slot and account freed space for credit reports
     //
-    pRead += len;
-    if ( pRead >= pMax )
-        pRead -= bufSize;
+    taskENTER_CRITICAL ();
+    s.next = freeSlot;
+    freeSlot = slot;
+    queuedBytes -= len + 4;
+    queuedFrames--;
+    freedBytes += len + 4;
+    freedFrames++;
+    taskEXIT_CRITICAL ();
 
-    // Release space back to circular buffer and unblock some USBXMTR::Put
+    // Release space back to transmit buffer and unblock some XPI::Put
     // waiting for more space. 
     //
     semaFull.Release( len + 4 );
+    semaSlots.Release( 1 );
+
+    usbNotify.Watermark( XPI_SERIAL_STATE_SC_FULL, bufSize - semaFull.GetCount (), bufSize );
+
+    ReportCredits( false );
+    }
+
+//---------------------------------------------------------------------------------------
+// Credit based flow control. Called from the USB receiver task, like Put(), so 
+// nothing is being put meanwhile.
+//---------------------------------------------------------------------------------------
+void XPI::SetCreditMode( bool enable )
+{
+    taskENTER_CRITICAL ();
+
+    isCredit       = enable;
+    baseBytes      = bufSize - queuedBytes;
+    baseFrames     = XPI_XMTR_SLOTS - queuedFrames;
+    freedBytes     = 0;
+    freedFrames    = 0;
+    reportedBytes  = 0;
+    reportedFrames = 0;
+
+    taskEXIT_CRITICAL ();
+
+    ReportCredits( true );
+    }
+
+// Sends XPI_IMSG_CREDIT if forced, if a quarter of the buffer (octets or 
+// slots) has been freed since the last report, or if the buffer is empty.
+//
+void XPI::ReportCredits( bool force )
+{
+    taskENTER_CRITICAL ();
+
+    bool isDue = isCredit 
+        && ( force 
+            || freedBytes - reportedBytes >= bufSize / 4
+            || ushort( freedFrames - reportedFrames ) >= XPI_XMTR_SLOTS / 4
+            || ( queuedFrames == 0 && freedFrames != reportedFrames ) 
+            );
+
+    ulong  bytes  = freedBytes;
+    ushort frames = freedFrames;
+
+    if ( isDue )
+    {
+        reportedBytes  = bytes;
+        reportedFrames = frames;
+        }
+
+    taskEXIT_CRITICAL ();
+
+    if ( ! isDue )
+        return;
+
+    uchar data[ 10 ] = 
+    {
+        uchar( bytes >> 24 ), uchar( bytes >> 16 ), uchar( bytes >> 8 ), uchar( bytes ),
+        uchar( frames >> 8 ), uchar( frames ),
+        uchar( baseBytes >> 8 ), uchar( baseBytes ),
+        uchar( baseFrames >> 8 ), uchar( baseFrames )
+        };
+
+    usbNotify.Event( XPI_IMSG_CREDIT, 0, data, 6 );
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_CREDIT, 0, sizeof( data ), 10 );
+    if ( pMsg )
+    {
+        memcpy( pMsg->data, data, sizeof( data ) );
+        usbOut.Commit( pMsg );
+        }
+    }
+
+// Returns the cumulative credits; callable from the USB interrupt
+//
+void XPI::GetCredits( ulong& bytes, ushort& frames ) const
+{
+    bytes  = isCredit ? freedBytes : 0;
+    frames = isCredit ? freedFrames : 0;
     }
 
 void XPI::StartTransmissionIfIdle( void )
@@ -1198,10 +1712,9 @@ void XPI::StartTransmissionIfIdle( void )
     // Clear yellow LED
     //
     taskENTER_CRITICAL ();
-    FPGA_BegWrite ();
-    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-    FPGA_Write( XPI_W_P0_LED_CLEAR, XPI_LED_Y );
-    FPGA_BegRead ();
+    FPGA_BusPage( 0 );
+    FPGA_BusWrite( XPI_W_P0_LED_CLEAR, XPI_LED_Y );
+    FPGA_BusEnd ();
     taskEXIT_CRITICAL ();
 
     if ( isEIRQ )
@@ -1214,52 +1727,48 @@ void XPI::StartTransmissionIfIdle( void )
         rearrange_poll_list = false;
         ++eirq_count;
 
+        if ( eirq_count % EIRQ_DECAY_PERIOD == 0 )
+            DecayEirqWeights ();
+
         // Put 0xC0 and then first board id to CTX (start eirq polling)
-        // and enable CTXE IRQ
+        // and enable CTXE IRQ; set yellow LED in the same transaction
         //
         isCTXE = false;
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-        FPGA_Write( XPI_W_P1_SC_CTX_DATA, 
+        FPGA_BusPage( 1 );
+        FPGA_BusWrite( XPI_W_P1_SC_CTX_DATA, 
             poll_cur < 0 ? 0xC0 : poll_list[ poll_cur ] & 0x3F
             );
-        FPGA_Write( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
-        FPGA_BegRead ();
+        FPGA_BusWrite( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_Y );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
 
         Goto( POLL_EIRQ, EIRQ_POLL_DELAY );
-        
-        // Set yellow LED
-        //
-        taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_LED_SET, XPI_LED_Y );
-        FPGA_BegRead ();
-        taskEXIT_CRITICAL ();
         }
     else if ( ctx_count > 0 )
     {
 #if 0
         taskENTER_CRITICAL ();
-        tracef( 2, "SC: Start Xmis %04x %d, L=%d\n", requestID, pCtx - buf, ctx_count );
+        tracef( 2, "SC: Start Xmis %04x %d, L=%d\n", requestID, pCtx - pRead, ctx_count );
         taskEXIT_CRITICAL ();
 #endif
-        // Send current CTX data and enable CTXE.
-        // Note that each write to CTX FIFO should be followed by 
+        // Send current CTX data and enable CTXE; set yellow LED in the same
+        // transaction. Note that each write to CTX FIFO should be followed by 
         // CTXE IRQ enable, which increases FIFO write pointer.
         //
         isCTXE = false;
         taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 0
+        FPGA_BusPage( 1 );
         for( uint i = 0; i < ctx_count; i++ )
         {
-            FPGA_Write( XPI_W_P1_SC_CTX_DATA, *pCtx++ );
-            FPGA_Write( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
+            FPGA_BusWrite( XPI_W_P1_SC_CTX_DATA, *pCtx++ );
+            FPGA_BusWrite( XPI_W_P1_SC_CTX_INCFIFO, 0x00 );
             }
-        FPGA_BegRead ();
+        FPGA_BusPage( 0 );
+        FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_Y );
+        FPGA_BusEnd ();
         taskEXIT_CRITICAL ();
         
         // Make current CTXO buffer emtpy
@@ -1270,20 +1779,12 @@ void XPI::StartTransmissionIfIdle( void )
         //
         if ( ( pRead[0] & 0xC0 ) == 0x80 ) // Should wait ACK
         {
-            Goto( WAIT_ACK, RECEIVE_TIMEOUT );
+            StartRtt( isCtxRetry ? -1 : pRead[0] & 0x3F );
+            Goto( WAIT_ACK, BoardTimeout( pRead[0] & 0x3F, RECEIVE_TIMEOUT, true ) );
             }
         else
         {
             Goto( WAIT_SENT, CTXE_TIMEOUT );
             }
-
-        // Set yellow LED
-        //
-        taskENTER_CRITICAL ();
-        FPGA_BegWrite ();
-        FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-        FPGA_Write( XPI_W_P0_LED_SET, XPI_LED_Y );
-        FPGA_BegRead ();
-        taskEXIT_CRITICAL ();
         }
     }
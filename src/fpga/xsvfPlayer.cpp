@@ -95,7 +95,7 @@ struct OctetArray
 {
     enum 
     { 
-        MAX_LEN = 128    // MAX_LEN = ceil( max( XSDRSIZE ) / 8 )
+        MAX_LEN = XSVF_SHIFT_MAX    // MAX_LEN = ceil( max( XSDRSIZE ) / 8 )
         //-------------------------------------------------------------------------------
         // This MAX_LEN defines the maximum length (in bytes) of predefined
         // buffers in which the XSVF player stores the current shift data.
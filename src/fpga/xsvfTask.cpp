@@ -6,6 +6,8 @@
 #include "sam7xpud.hpp"
 #include "xsvfPort.hpp" // SetTCK()
 
+#include <string.h> // memcpy
+
 //---------------------------------------------------------------------------------------
 //      Exported Symbols
 //---------------------------------------------------------------------------------------
@@ -44,8 +46,11 @@ void XSVF_Player::MainLoop( void )
     // Note that xXsvfFirstByte byte will be later reused by the ReadXSVF()
     // when ReadXSVF() is called by xsvfExecute().
     //
+    // Data queued by Put() just when the previous XSVF ended is dropped
+    // until the player is enabled.
+    //
     do firstByte = getc ();
-        while( firstByte < 0 );
+        while( firstByte < 0 || ! enabled );
 
 #ifdef TR_INFO        
     taskENTER_CRITICAL ();
@@ -54,10 +59,12 @@ void XSVF_Player::MainLoop( void )
     taskEXIT_CRITICAL ();
 #endif
 
-    // Reset CRC and byte count
+    // Reset CRC, byte count and wait times
     //
     crc = 0;
     byteCount = 0;
+    dWaitData = 0;
+    dWaitBuf = 0;
 
     // Elapsed time
     ulong dTimerStart = dTimerTick;
@@ -74,49 +81,151 @@ void XSVF_Player::MainLoop( void )
 
     // Signal that we have ended
     //
-    sMsg.timeStamp = dTimerTick;
-    sMsg.magicMSB  = XPI_MSG_MAGIC_MSB;
-    sMsg.magicLSB  = XPI_MSG_MAGIC_LSB;
-    sMsg.type      = XPI_IMSG_XSVF_END;
-    sMsg.subtype   = 0;
-    sMsg.data[0]   = xsvfRC;
-    sMsg.data[1]   = ( crc >> 8 ) & 0xFF;
-    sMsg.data[2]   = crc & 0xFF;
-    sMsg.data[3]   = ( byteCount >>  24 ) & 0xFF;
-    sMsg.data[4]   = ( byteCount >>  16 ) & 0xFF;
-    sMsg.data[5]   = ( byteCount >>   8 ) & 0xFF;
-    sMsg.data[6]   = ( byteCount >>   0 ) & 0xFF;
-    sMsg.data[7]   = ( dElapsed >>  24 ) & 0xFF;
-    sMsg.data[8]   = ( dElapsed >>  16 ) & 0xFF;
-    sMsg.data[9]   = ( dElapsed >>   8 ) & 0xFF;
-    sMsg.data[10]  = ( dElapsed >>   0 ) & 0xFF;
-
-    usbOut.Put( NULL, 0, 1000 ); // Terminate previous message
-    usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER ) + 11, 1000 ); // Send this message
+    usbOut.Put( NULL, 0, 1000, USB_LANE_CTRL ); // Terminate previous message
+
+    // XPI_IMSG_XSVF_END data: rc, crc16, byte count, elapsed ms, then ms the
+    // player waited for data (download bound) and ms the receiver waited for 
+    // a free buffer (JTAG bound); all MSB first.
+    //
+    ulong dWaitD = dWaitData;
+    ulong dWaitB = dWaitBuf;
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_XSVF_END, 0, 19, 1000 );
+    if ( pMsg )
+    {
+        pMsg->data[0]   = xsvfRC;
+        pMsg->data[1]   = ( crc >> 8 ) & 0xFF;
+        pMsg->data[2]   = crc & 0xFF;
+        pMsg->data[3]   = ( byteCount >>  24 ) & 0xFF;
+        pMsg->data[4]   = ( byteCount >>  16 ) & 0xFF;
+        pMsg->data[5]   = ( byteCount >>   8 ) & 0xFF;
+        pMsg->data[6]   = ( byteCount >>   0 ) & 0xFF;
+        pMsg->data[7]   = ( dElapsed >>  24 ) & 0xFF;
+        pMsg->data[8]   = ( dElapsed >>  16 ) & 0xFF;
+        pMsg->data[9]   = ( dElapsed >>   8 ) & 0xFF;
+        pMsg->data[10]  = ( dElapsed >>   0 ) & 0xFF;
+        pMsg->data[11]  = ( dWaitD >>  24 ) & 0xFF;
+        pMsg->data[12]  = ( dWaitD >>  16 ) & 0xFF;
+        pMsg->data[13]  = ( dWaitD >>   8 ) & 0xFF;
+        pMsg->data[14]  = ( dWaitD >>   0 ) & 0xFF;
+        pMsg->data[15]  = ( dWaitB >>  24 ) & 0xFF;
+        pMsg->data[16]  = ( dWaitB >>  16 ) & 0xFF;
+        pMsg->data[17]  = ( dWaitB >>   8 ) & 0xFF;
+        pMsg->data[18]  = ( dWaitB >>   0 ) & 0xFF;
+        usbOut.Commit( pMsg ); // Send this message
+        }
 
 #ifdef TR_INFO        
     taskENTER_CRITICAL ();
-    TRACE_INFO( "XSVF completed; Bytes = %u, CRC16 = 0x%04X, Elapsed = %ld\n", 
-                byteCount, crc, dElapsed );
+    TRACE_INFO( "XSVF completed; Bytes = %u, CRC16 = 0x%04X, Elapsed = %ld, "
+                "Wait data = %lu, Wait buffer = %lu\n", 
+                byteCount, crc, dElapsed, dWaitD, dWaitB );
     taskEXIT_CRITICAL ();
 #endif
 
     // CLEANUP:
 
-    // Make xXsvfQueue empty
+    // Mark player disabled; Put() drops data from now on
     //
-    if ( datac != 0 )
+    enabled = false;
+
+    // Return remaining XSVF data to the pool
+    //
+    FlushBuffers ();
+
+    firstByte = -1;
+    }
+
+//---------------------------------------------------------------------------------------
+// Returns the buffer played so far to the pool and takes the next one.
+// Returns false on timeout (end of XSVF stream).
+//---------------------------------------------------------------------------------------
+bool XSVF_Player::NextBuffer( void )
+{
+    if ( isHolding )
+    {
+        isHolding = false;
+        poolHead = ( poolHead + 1 ) % XSVF_POOL_BUFS;
+        semaFree.Release( 1 );
+        }
+
+    ulong dStart = dTimerTick;
+
+    if ( ! semaFull.Wait( 1, 2000 ) )
+        return false;
+
+    dWaitData += dTimerTick - dStart;
+
+    isHolding = true;
+    datap = pool[ poolHead ].data;
+    datac = pool[ poolHead ].len;
+
+    return datac > 0;
+    }
+
+//---------------------------------------------------------------------------------------
+// Returns all buffers to the pool
+//---------------------------------------------------------------------------------------
+void XSVF_Player::FlushBuffers( void )
+{
+    datac = 0;
+
+    if ( isHolding )
+    {
+        isHolding = false;
+        poolHead = ( poolHead + 1 ) % XSVF_POOL_BUFS;
+        semaFree.Release( 1 );
+        }
+
+    while ( semaFull.Wait( 1, 0 ) )
     {
-        datac = 0;
-        semaEmpty.Release( 1 );
+        poolHead = ( poolHead + 1 ) % XSVF_POOL_BUFS;
+        semaFree.Release( 1 );
         }
 
     datap = NULL;
-    firstByte = -1;
-    
-    // Mark player disabled
-    //
-    enabled = false;
+    }
+
+//---------------------------------------------------------------------------------------
+// Queue XSVF data to the player (called by USBRCVR)
+//---------------------------------------------------------------------------------------
+void XSVF_Player::Put( const uchar* data, uint len )
+{
+    while ( len > 0 && enabled )
+    {
+        // Wait for a free buffer; this is the flow control to the host
+        //
+        ulong dStart = dTimerTick;
+
+        bool isFree;
+        do isFree = semaFree.Wait( 1, 100 );
+            while( ! isFree && enabled );
+
+        if ( ! isFree )
+            return;
+
+        dWaitBuf += dTimerTick - dStart;
+
+        uint n = len < XSVF_POOL_BUF_SIZE ? len : XSVF_POOL_BUF_SIZE;
+
+        BUF& buf = pool[ poolTail ];
+        memcpy( buf.data, data, n );
+        buf.len = n;
+
+        // Queue the buffer unless the player has ended meanwhile
+        //
+        if ( ! enabled )
+        {
+            semaFree.Release( 1 );
+            return;
+            }
+
+        poolTail = ( poolTail + 1 ) % XSVF_POOL_BUFS;
+        semaFull.Release( 1 );
+
+        data += n;
+        len  -= n;
+        }
     }
 
 //---------------------------------------------------------------------------------------
@@ -138,7 +247,7 @@ void XSVF_Player::Enable( int trace_level, bool parse_only )
     
     // Send end-of-transfer packet (flush usbOut)
     //
-    usbOut.Put( NULL, 0, 1000 );
+    usbOut.Put( NULL, 0, 1000, USB_LANE_CTRL );
 
     // Start player
     //
@@ -39,7 +39,13 @@ typedef enum { false = 0, true = 1 } bool;
 typedef unsigned char uchar;
 typedef unsigned int uint;
 typedef unsigned short ushort;
+// ulong is 32 bits wide, as on ARM, in host (unit test) builds, so messages
+// keep their layout
+#ifdef __LP64__
+typedef unsigned int ulong;
+#else
 typedef unsigned long ulong;
+#endif
 
 // \brief  Generic callback function type
 // Since ARM Procedure Call standard allow for 4 parameters to be stored in r0-r3 
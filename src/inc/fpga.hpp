@@ -111,6 +111,37 @@ enum // FPGA Register Bitmap
 //------------------------------------------------------------------------------
 // FPGA I/O methods
 
+#ifdef FPGA_HOST_MOCK
+
+// Host (unit test) builds: bus cycles go to a model of the FPGA provided by
+// the test harness
+//
+extern void FPGA_MockDirection( bool isWrite );
+extern void FPGA_MockWrite( uint addr, uint data );
+extern uint FPGA_MockRead( uint addr );
+
+static inline void FPGA_BegWrite( void )
+{
+    FPGA_MockDirection( true );
+    }
+
+static inline void FPGA_BegRead( void )
+{
+    FPGA_MockDirection( false );
+    }
+
+static inline void FPGA_Write( uint addr, uint data )
+{
+    FPGA_MockWrite( addr & 0x7, data & 0xFF );
+    }
+
+static inline uint FPGA_Read( uint addr )
+{
+    return FPGA_MockRead( addr & 0x7 ) & 0xFF;
+    }
+
+#else // FPGA_HOST_MOCK
+
 static inline void FPGA_BegWrite( void )
 {
     AT91F_PIO_OutputEnable( AT91C_BASE_PIOA, FPGA_DATA );
@@ -147,8 +178,105 @@ static inline uint FPGA_Read( uint addr )
     return data;
     }
 
+#endif // FPGA_HOST_MOCK
+
+//------------------------------------------------------------------------------
+// FPGA bus transactions
+//
+// FPGA_Bus* methods shadow the page register and the data bus direction, so
+// that redundant page writes and direction switches are skipped. They should
+// be called from a critical section, which should be closed by FPGA_BusEnd()
+// that leaves the bus in read mode (the idle state between transactions).
+// The page shadow is invalidated on FPGA reset.
+
+enum
+{
+    FPGA_PAGE_UNKNOWN   = 0xFF
+    };
+
+extern uint  fpgaBusPage;
+extern bool  isFpgaBusWrite;
+extern ulong fpgaPageWrites;
+extern ulong fpgaPageSkips;
+
+static inline void FPGA_BusInvalidate( void )
+{
+    fpgaBusPage = FPGA_PAGE_UNKNOWN;
+    }
+
+static inline void FPGA_BusWrite( uint addr, uint data )
+{
+    if ( ! isFpgaBusWrite )
+    {
+        FPGA_BegWrite ();
+        isFpgaBusWrite = true;
+        }
+
+    FPGA_Write( addr, data );
+    }
+
+static inline uint FPGA_BusRead( uint addr )
+{
+    if ( isFpgaBusWrite )
+    {
+        FPGA_BegRead ();
+        isFpgaBusWrite = false;
+        }
+
+    return FPGA_Read( addr );
+    }
+
+static inline void FPGA_BusPage( uint page )
+{
+    if ( page == fpgaBusPage )
+    {
+        ++fpgaPageSkips;
+        return;
+        }
+
+    FPGA_BusWrite( XPI_W_PAGE_ADDR, page );
+    fpgaBusPage = page;
+    ++fpgaPageWrites;
+    }
+
+static inline void FPGA_BusEnd( void )
+{
+    if ( isFpgaBusWrite )
+    {
+        FPGA_BegRead ();
+        isFpgaBusWrite = false;
+        }
+    }
+
+// Reads FIFO data register 'addr' while the 'irq' request bit stays set, up to
+// maxLen octets (at least one); returns the octet count. Reads accumulate in
+// irq_list the request bits seen during the burst. Expects page 0.
+//
+static inline uint FPGA_ReadFifo( uint addr, uint irq, uchar* data, uint maxLen, uint& irq_list )
+{
+    uint len = 0;
+
+    for(;;)
+    {
+        data[ len++ ] = FPGA_BusRead( addr );
+
+        if ( len >= maxLen )
+            break;
+
+        uint irq_now = FPGA_BusRead( XPI_R_INT_REQUEST );
+        irq_list |= irq_now;
+
+        if ( ! ( irq_now & irq ) )
+            break;
+        }
+
+    return len;
+    }
+
 static inline void FPGA_SetReset( bool reset = true )
 {
+    FPGA_BusInvalidate ();
+
     if ( reset )
         AT91F_PIO_SetOutput( AT91C_BASE_PIOA, FPGA_RESET );
     else
@@ -162,6 +290,8 @@ static inline bool FPGA_IsReset( void )
 
 static inline void FPGA_PulseReset( void )
 {
+    FPGA_BusInvalidate ();
+
     AT91F_PIO_SetOutput( AT91C_BASE_PIOA, FPGA_RESET );
     
     asm volatile( "NOP" );
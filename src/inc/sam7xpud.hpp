@@ -47,6 +47,7 @@ extern "C" unsigned int vPortGetMaxHeap( void );
 extern volatile portBASE_TYPE isTaskWokenByPostInUsbIrq;
 
 extern void sysDumpStatus( void );
+extern uint sysGetCapabilities( uchar* data );
 extern int xsvfExecute( int dbgLevel, bool parseOnly );
 
 extern void us1_putc( int ch );
@@ -55,26 +56,204 @@ extern void null_putc( int ch );
 
 extern volatile ulong dTimerTick;
 
+//---------------------------------------------------------------------------------------
+//      USB interrupt handling
+//---------------------------------------------------------------------------------------
+
+// Default: sSer.EventHandler() runs in ISR_USB, so FPGA and timer interrupts
+// wait until the whole USB event processing is done.
+//
+// USB_ISR_DEFERRED: ISR_USB only masks the UDP interrupt in the AIC and wakes
+// up USB_ServiceTask, which runs sSer.EventHandler() with interrupts enabled and
+// the scheduler suspended. Driver callbacks then run in a task, so the FromISR
+// calls they do must be guarded with USB_CALLBACK_ENTER/EXIT.
+//
+#ifdef USB_ISR_DEFERRED
+    #define USB_CALLBACK_ENTER()    taskENTER_CRITICAL ()
+    #define USB_CALLBACK_EXIT()     taskEXIT_CRITICAL ()
+#else
+    #define USB_CALLBACK_ENTER()
+    #define USB_CALLBACK_EXIT()
+#endif
+
+#ifdef USB_ISR_DEFERRED
+// Called from ISR_VBus; defers CUsbDriver::Attach() to USB_ServiceTask
+//
+extern void USB_DeferVBusFromISR( void );
+#endif
+
+// Called from CCallbacks::OnStartOfFrame(); synchronizes usbClock to the SOF
+//
+extern void USB_StartOfFrame( void );
+
+//---------------------------------------------------------------------------------------
+//      Interrupt latency statistics
+//---------------------------------------------------------------------------------------
+
+// TC1 runs free at MCK/8 and wraps every 65536 ticks (~10.9 ms), which bounds
+// the intervals that can be measured.
+//
+enum
+{
+    LAT_TICKS_PER_US = AT91C_MASTER_CLOCK / 8 / 1000000,
+    LAT_WRAP_US      = 0x10000 / LAT_TICKS_PER_US
+    };
+
+#ifdef LAT_HOST_MOCK
+
+// Host (unit test) builds: the counter value is provided by the test harness
+//
+extern uint LAT_MockNow( void );
+
+inline uint LAT_Now( void )
+{
+    return LAT_MockNow ();
+    }
+
+#else // LAT_HOST_MOCK
+
+inline uint LAT_Now( void )
+{
+    return AT91C_BASE_TC1->TC_CV;
+    }
+
+#endif // LAT_HOST_MOCK
+
+struct LATENCY
+{
+    volatile uint dMax;
+    volatile uint dSum;
+    volatile uint dCount;
+
+    // Accounts the time elapsed since dStart (taken with LAT_Now()).
+    // Must be called with interrupts disabled or from a single context.
+    //
+    void Add( uint dStart )
+    {
+        uint t = ( LAT_Now () - dStart ) & 0xFFFF;
+
+        if ( t > dMax )
+            dMax = t;
+
+        dSum += t;
+        ++dCount;
+        }
+
+    uint MaxUs( void ) const
+    {
+        return dMax / LAT_TICKS_PER_US;
+        }
+
+    uint AvgUs( void ) const
+    {
+        return dCount ? dSum / dCount / LAT_TICKS_PER_US : 0;
+        }
+
+    void Reset( void )
+    {
+        dMax = dSum = dCount = 0;
+        }
+    };
+
+extern LATENCY latUsbIsr;    // Time spent in ISR_USB; ISR_FPGA is held off meanwhile
+extern LATENCY latFpgaWake;  // From ISR_FPGA until FPGA_IrqTasklet runs
+
 extern "C" const int verMajor, verMinor, verBuild;
 
 //---------------------------------------------------------------------------------------
-//      USB TRANSMITTER Class
+//      USB TRANSMITTER and RECEIVER buffers
 //---------------------------------------------------------------------------------------
 
 enum 
 { 
-    USB_XMTR_BUF_SIZE = 4096 + 256, 
-    USB_RCVR_BUF_SIZE = 4096, 
+    USB_RCVR_BUF_SIZE = 4096, // Max transfer (message) length
+    USB_RCVR_RING_SIZE = 2 * USB_RCVR_BUF_SIZE,
+    USB_RCVR_SLOTS = 8,       // Max completed transfers queued to Receiver()
+    USB_RCVR_PACKET_SIZE = 64,
+    USB_XMTR_RESERVE_MAX = sizeof( XPI_IMSG_HEADER ) + 128 + 2, // Log line + seq
     };
 
-class USBXMTR
+// USBXMTR priority lanes. Lanes are drained in strict priority order (lower 
+// index first); each lane has its own circular buffer, so a lane filled up
+// with trace cannot hold back the messages of the other lane.
+//
+enum USB_XMTR_LANE
 {
+    USB_LANE_CTRL      = 0,  // Status, flow control, SC data, XSVF end, FC events
+    USB_LANE_BULK      = 1,  // Log, trace and loopback data
+    USB_XMTR_LANES     = 2,
+
+    // The bulk lane carries the loopback of a max-length received message,
+    // plus room for log and trace messages queued behind it
+    //
+    USB_LANE_CTRL_SIZE = 512,
+    USB_LANE_BULK_SIZE = USB_RCVR_BUF_SIZE + 2 + 256,
+    USB_XMTR_BUF_SIZE  = USB_LANE_CTRL_SIZE + USB_LANE_BULK_SIZE,
+
+    USB_XMTR_COALESCE_MAX = USB_LANE_BULK_SIZE / 2,
+
+    USB_XMTR_INFLIGHT  = 2,  // USB IN transfers queued to the driver when streaming
+
+    USB_XMTR_TYPES     = 16, // Number of XPI_IMSG types with drop accounting;
+                             // drops of higher types are counted as XPI_IMSG_NULL
+    };
+
+// Compile-time check: a message of USB_RCVR_BUF_SIZE octets looped back to host
+// fits in the bulk lane (with its 2-byte length), otherwise Put() never succeeds
+//
+typedef char USB_LANE_BULK_SIZE_TOO_SMALL[ USB_LANE_BULK_SIZE >= USB_RCVR_BUF_SIZE + 2 ? 1 : -1 ];
+
+// USBXMTR circular buffer backends:
+//
+// Default (semaphore based): producers serialize on semaMutex and account free
+// and used space with counting semaphores semaFull and semaEmpty.
+//
+// USB_XMTR_LOCKFREE: producers reserve space by advancing pWrite in a short 
+// critical section (no mutex, no scheduler suspension) and may also enqueue from
+// ISRs. Reserved packets carry USB_XMTR_PENDING in len_MSB until committed.
+// semaFull is used only as a doorbell on the slow path, i.e. when a producer 
+// finds the buffer full.
+//
+// In both backends Transmitter() is woken up through USBXMTR::semaReady only 
+// when it waits for data.
+//
+#ifdef USB_XMTR_LOCKFREE
+enum
+{
+    USB_XMTR_PENDING  = 0x80,   // len_MSB flag: packet reserved, not committed
+    USB_XMTR_SKIP_MSB = 0x7F,   // Header of the padding up to pMax
+    USB_XMTR_SKIP_LSB = 0xFF,
+    };
+#endif
+
+class USBXMTR;
+
+//---------------------------------------------------------------------------------------
+//      USB TRANSMITTER Lane (circular buffer) Class
+//---------------------------------------------------------------------------------------
+
+class USBXMTR_LANE
+{
+    friend class USBXMTR;
+
+    USBXMTR* pOwner;
+
+#ifndef USB_XMTR_LOCKFREE
     xMUTEX semaMutex;
-    xSEMA semaFull;
     xSEMA semaEmpty;
-    xSEMA semaSent;
+#endif
+    xSEMA semaFull;
 
     // Circular buffer of MSGBUF packets.
+#ifdef USB_XMTR_LOCKFREE
+    // Packets are always linear. A packet that does not fit below pMax is put 
+    // at the beginning of the buffer and the rest of buffer is padded with 
+    // a skip header (or a single byte when there is no room for the header).
+#else
+    // Packets reserved with Reserve() are built linearly and may run over pMax
+    // into the overflow area; Commit() folds the overflow back to the beginning
+    // of the circular buffer.
+#endif
     //
     // MSGBUF Packet format:
     //    Header:
@@ -83,74 +262,355 @@ class USBXMTR
     //    Body:
     //       uint8 data[len]
     //
-    uchar  buf[ USB_XMTR_BUF_SIZE ];
+    uchar* buf;
     uint   bufSize;
  
     uchar* pRead;
-    uchar* pWrite;
+    uchar* volatile pWrite;
     uchar* pMax;
 
+#ifdef USB_XMTR_LOCKFREE
+    // Octets reserved by producers and not yet released by Transmitter()
+    //
+    volatile uint used;
+
+    // Number of producers waiting for space
+    //
+    volatile uint spaceWaiters;
+
+    // Octets taken or skipped by Transmitter() and not yet freed, and octets
+    // skipped since the last FreeLength()
+    //
+    volatile uint held;
+    uint skipped;
+
+    uchar* TryReserve( uint len, bool fromISR, bool countWaiter, ushort* pSeq );
+    uchar* Acquire( uint len, portTickType xTicksToWait, ushort* pSeq );
+#else
+    // Length of the packet reserved by Reserve() and not yet committed
+    //
+    uint reservedLen;
+#endif
+
+    // Transmitter() side of the circular buffer
+    //
+    enum { EMPTY = 0, READY = 1, SKIP = 2 };
+
+    int  Poll( void );
+    void Skip( void );
+    uint PeekLength( void ) const;
+
+    uchar* Next( uchar* p ) const
+    {
+        return ++p >= pMax ? buf : p;
+        }
+
+    void Take( uint len );
+    uint FreeLength( uint len );
+    void FreeSpace( uint len );
+    signed portBASE_TYPE FreeSpaceFromISR( uint len, signed portBASE_TYPE xTaskPreviouslyWoken );
+
+    void LockWrite( void )
+    {
+#ifndef USB_XMTR_LOCKFREE
+        // Lock pWrite mutex
+        //
+        do ; while( ! semaMutex.Lock( 100 ) );
+#endif
+        }
+
+    void UnlockWrite( void )
+    {
+#ifndef USB_XMTR_LOCKFREE
+        // Unlock pWrite mutex
+        //
+        semaMutex.Unlock ();
+#endif
+        }
+
+protected:
+
+    USBXMTR_LANE( uchar* storage, uint size )
+#ifdef USB_XMTR_LOCKFREE
+        : semaFull( 0 )
+#else
+        : semaEmpty( 0 )
+        , semaFull( size )
+#endif
+    {
+        pOwner  = NULL;
+        buf     = storage;
+        bufSize = size;
+        pRead   = buf;
+        pWrite  = buf;
+        pMax    = buf + bufSize;
+
+#ifdef USB_XMTR_LOCKFREE
+        used         = 0;
+        spaceWaiters = 0;
+        held         = 0;
+        skipped      = 0;
+#else
+        reservedLen  = 0;
+#endif
+        }
+
+public:
+
+    uint GetSize( void ) const
+    {
+        return bufSize;
+        }
+
+    bool Put( void* data, uint len, portTickType xTicksToWait );
+
+    // Reserves a linear region of len octets inside the circular buffer and
+    // returns the pointer to it, or NULL on timeout. The region must be filled
+    // without blocking and then passed to Commit(). If pSeq is given, the next
+    // XPI_IMSG sequence number is taken together with the region, so numbers
+    // are in the order of packets in the lane.
+    //
+    uchar* Reserve( uint len, portTickType xTicksToWait, ushort* pSeq = NULL );
+    void Commit( void* data );
+
+#ifdef USB_XMTR_LOCKFREE
+    // ISR variants of Reserve() and Commit(). ReserveFromISR() never blocks and
+    // returns NULL if the circular buffer is full.
+    //
+    uchar* ReserveFromISR( uint len )
+    {
+        return len > USB_XMTR_RESERVE_MAX ? NULL : TryReserve( len, true, false, NULL );
+        }
+
+    signed portBASE_TYPE CommitFromISR( void* data, signed portBASE_TYPE xTaskPreviouslyWoken );
+#endif
+    };
+
+template< uint SIZE >
+class USBXMTR_LANE_BUF : public USBXMTR_LANE
+{
+    uchar storage[ SIZE + 2 + USB_XMTR_RESERVE_MAX ];
+
+public:
+
+    USBXMTR_LANE_BUF( void )
+        : USBXMTR_LANE( storage, SIZE )
+    {
+        }
+    };
+
+//---------------------------------------------------------------------------------------
+//      USB TRANSMITTER Class
+//---------------------------------------------------------------------------------------
+
+class USBXMTR
+{
+    friend class USBXMTR_LANE;
+
+    xSEMA semaReady;
+    xSEMA semaSent;   // Released on every completed USB IN transfer
+
+    USBXMTR_LANE_BUF< USB_LANE_CTRL_SIZE > ctrlLane;
+    USBXMTR_LANE_BUF< USB_LANE_BULK_SIZE > bulkLane;
+
+    USBXMTR_LANE* lane[ USB_XMTR_LANES ];
+
+    // Set by Transmitter() when it waits on semaReady for data
+    //
+    volatile bool dataWaiter;
+
+    // Coalescing parameters. When coalesceMax is non-zero, complete MSGBUF packets
+    // (including their 2-byte length headers) are sent together in a single USB IN
+    // transfer of at most coalesceMax bytes. The batch is flushed as soon as the
+    // lane is idle after its first packet; once more packets keep arriving, it is
+    // held for at most coalesceDelay ticks since the first one.
+    //
+    volatile uint coalesceMax;
+    volatile portTickType coalesceDelay;
+
+    // Messages dropped because their lane was full, per XPI_IMSG type: 
+    // total, and not yet reported to host with XPI_IMSG_LOST.
+    //
+    volatile ulong dropTotal[ USB_XMTR_TYPES ];
+    volatile ushort dropPending[ USB_XMTR_TYPES ];
+    volatile bool isDropPending;
+
+    // Sequence number of the next XPI_IMSG message (counts dropped ones, too,
+    // except XPI_IMSG_LOST). Taken by the lanes in critical sections.
+    //
+    volatile ushort seqNo;
+    volatile bool isSeqEnabled;
+
+    // Streaming mode: up to USB_XMTR_INFLIGHT transfers are handed to the USB
+    // driver, so the next transfer is armed while the current one is being sent.
+    // Otherwise Transmitter() waits for every transfer to complete.
+    //
+    volatile bool isStreaming;
+
+    // Compact v2 framing of XPI_IMSG messages (see XPI_USB_CFG_FRAMING)
+    //
+    volatile bool isCompact;
+
+    // Transfers handed to the USB driver and not yet completed, oldest first,
+    // with the lane and number of octets to be freed on completion.
+    //
+    struct SENT
+    {
+        USBXMTR_LANE* pLane;
+        uint len;
+        } sent[ USB_XMTR_INFLIGHT ];
+
+    uint sentHead;
+    volatile uint sentCount;
+
     // CCDC::Write callback status
     volatile int bStatus;
     volatile uint dBytesTransferred;
     volatile uint dBytesRemaining;
 
+    // Completion callback: returns the space of the oldest transfer
+    // back to its lane
+    //
     static void OnSendCompleted
     (
         USBXMTR* pThis,
         uchar bStatus,
         uint dBytesTransferred,
         uint dBytesRemaining
-        )
+        );
+
+    // Called by lanes after a packet has been committed; returns true if 
+    // Transmitter() should be woken up.
+    //
+    bool OnCommit( void )
     {
-        pThis->bStatus = bStatus;
-        pThis->dBytesTransferred = dBytesTransferred;
-        pThis->dBytesRemaining = dBytesRemaining;
+        bool wake = dataWaiter;
+        dataWaiter = false;
+        return wake;
+        }
 
-        if ( pThis->semaSent.ReleaseFromISR( 1, isTaskWokenByPostInUsbIrq ) )
-        {
-            isTaskWokenByPostInUsbIrq = pdTRUE;
-            }
+    void Notify( void )
+    {
+        taskENTER_CRITICAL ();
+        bool wake = OnCommit ();
+        taskEXIT_CRITICAL ();
+
+        if ( wake )
+            semaReady.Release( 1 );
         }
 
+    void OnDrop( uchar type );
+    void ReportDrops( void );
+
+    USBXMTR_LANE* WaitLane( portTickType xTicksToWait, USBXMTR_LANE* pCurrent );
+    uint Compact( USBXMTR_LANE* pLane, uchar* pStart, uint span );
+    bool Send( USBXMTR_LANE* pLane, uchar* data, uint len, uint freeLen );
+    void WaitSent( uint maxInFlight );
+
 public:
     
     USBXMTR( void )
-        : semaFull( USB_XMTR_BUF_SIZE )
-        , semaEmpty( 0 )
+        : semaReady( 0 )
         , semaSent( 0 )
     {
-        bufSize = USB_XMTR_BUF_SIZE;
-        pRead   = buf;
-        pWrite  = buf;
-        pMax    = buf + bufSize;
+        lane[ USB_LANE_CTRL ] = &ctrlLane;
+        lane[ USB_LANE_BULK ] = &bulkLane;
+
+        for ( int i = 0; i < USB_XMTR_LANES; i++ )
+            lane[ i ]->pOwner = this;
+
+        dataWaiter    = false;
+
+        coalesceMax   = 0;
+        coalesceDelay = 0;
+
+        for ( int i = 0; i < USB_XMTR_TYPES; i++ )
+        {
+            dropTotal[ i ]   = 0;
+            dropPending[ i ] = 0;
+            }
+        isDropPending = false;
+
+        seqNo         = 0;
+        isSeqEnabled  = false;
+
+        isStreaming   = false;
+        isCompact     = false;
+        sentHead      = 0;
+        sentCount     = 0;
         }
 
     void Initialize( void )
     {
 #ifdef TR_INFO        
         taskENTER_CRITICAL ();
-        TRACE_INFO( "USBXMTR: Initialize(): Size=%u\n", bufSize );
+        TRACE_INFO( "USBXMTR: Initialize(): Size=%u+%u\n", 
+                ctrlLane.GetSize (), bulkLane.GetSize () );
         taskEXIT_CRITICAL ();
 #endif
         }
 
-    void LockWrite( void )
+    void SetCoalescing( uint maxBytes, portTickType maxDelay )
     {
-        // Lock pWrite mutex
-        //
-        do ; while( ! semaMutex.Lock( 100 ) );
+        if ( maxBytes > USB_XMTR_COALESCE_MAX )
+            maxBytes = USB_XMTR_COALESCE_MAX;
+
+        coalesceDelay = maxDelay;
+        coalesceMax   = maxBytes;
         }
 
-    void UnlockWrite( void )
+    void SetSequencing( bool enable )
     {
-        // Unlock pWrite mutex
-        //
-        semaMutex.Unlock ();
+        isSeqEnabled = enable;
+        }
+
+    void SetStreaming( bool enable )
+    {
+        isStreaming = enable;
+        }
+
+    void SetCompact( bool enable )
+    {
+        isCompact = enable;
+        }
+
+    static USB_XMTR_LANE LaneOf( uchar type )
+    {
+        switch( type )
+        {
+            case XPI_IMSG_LOOP:
+            case XPI_IMSG_LOG:
+            case XPI_IMSG_TRACE_CTX:
+            case XPI_IMSG_TRACE_CRX:
+            case XPI_IMSG_TRACE_EIRQ:
+            case XPI_IMSG_TRACE_HSSC:
+                return USB_LANE_BULK;
+            }
+
+        return USB_LANE_CTRL;
+        }
+
+    USBXMTR_LANE& Lane( int i )
+    {
+        return *lane[ i ];
+        }
+
+    bool Put( void* data, uint len, portTickType xTicksToWait, int i = USB_LANE_BULK );
+
+    // Reserves XPI_IMSG with dataLen octets of data in the lane selected by
+    // the message type and fills in its header (and sequence number, if enabled).
+    //
+    XPI_IMSG* BeginMsg( uchar type, uchar subtype, uint dataLen, portTickType xTicksToWait );
+
+    // Commits message reserved by BeginMsg()
+    //
+    void Commit( XPI_IMSG* pMsg )
+    {
+        lane[ LaneOf( pMsg->type ) ]->Commit( pMsg );
         }
 
-    bool Put( void* data, uint len, portTickType xTicksToWait );
     void Transmitter( void );
+    void DumpStatus( void );
 
     static portTASK_FUNCTION( MainTask, pvParameters );
     };
@@ -163,30 +623,57 @@ class USBRCVR
 {
 private:
     
-    // Buffer for receiving data from the USB
+    // Receive ring. Each CCDC::Read() is posted at pWrite with bounds of the
+    // ring, so transfers may wrap around pMax. A wrapped transfer is made linear
+    // by Receiver(), which copies its tail over the overflow area at pMax before
+    // the message is processed.
+    //
+    // A new read is posted only when the ring has room for a complete transfer
+    // and a slot is free; otherwise the host is NAKed until Receiver() frees
+    // some space.
     //
-    uint bufSize;
-    union
+    // In framed mode (XPI_USB_CFG_OMSG_FRAMING) the transfers form a stream of 
+    // length-framed messages, which may span transfers. Consecutive transfers
+    // are contiguous in the ring and share a slot.
+    //
+    uchar  ring[ USB_RCVR_RING_SIZE + USB_RCVR_BUF_SIZE ];
+    uchar* pMax;
+    uchar* pWrite;
+    uint   used;
+    bool   isReading;
+    bool   isStalled;
+    bool   isWaiter;
+    volatile bool isFramed;
+
+    // Completed transfers in order of arrival
+    //
+    struct SLOT
     {
-        uchar buf[ USB_RCVR_BUF_SIZE ];
+        uchar* pData;
+        uint   len;
+        int    bStatus;
+        } slot[ USB_RCVR_SLOTS ];
 
-        struct : public XPI_OMSG_HEADER
-        {
-            uchar data[ 0 ];
-            } ATTR_PACKED sMsg ;
-        };
+    uint slotHead;
+    volatile uint slotCount;
+
+    // Statistics
+    //
+    uint maxSlots;
+    uint maxUsed;
+    uint stalls;
+    uint framingErrors;
 
-    // CCDC::Read callback status
-    volatile int bStatus;
-    volatile uint dBytesTransferred;
-    volatile uint dBytesRemaining;
-    
     // Queue used to pass message between the USB callback and the task
     //
     xSEMA semaReceived; 
 
-    // Forwards data receiving from the USB host through the USART
-    // This function operates asynchronously.
+    struct MSG : public XPI_OMSG_HEADER
+    {
+        uchar data[ 0 ];
+        } ATTR_PACKED;
+
+    // Completion callback: queues the transfer and posts the next read.
     //
     static void OnReceiveUSB
     (
@@ -194,105 +681,401 @@ private:
         uchar bStatus,
         uint dBytesTransferred,
         uint dBytesRemaining
-        )
-    {
-        pThis->bStatus = bStatus;
-        pThis->dBytesTransferred = dBytesTransferred;
-        pThis->dBytesRemaining = dBytesRemaining;
+        );
 
-        if ( bStatus == USB::USB_STATUS_IMMEDREAD )
-            return; // Must not call ReleaseFromISR() out of ISR
+    // Posts the next read into the ring if there is enough space.
+    // Must be called from the USB callback or with interrupts disabled.
+    //
+    void Arm( void );
 
-        if ( pThis->semaReceived.ReleaseFromISR( 1, isTaskWokenByPostInUsbIrq ) )
-        {
-            isTaskWokenByPostInUsbIrq = pdTRUE;
-            }
+    static bool IsOK( int bStatus )
+    {
+        return bStatus == USB::USB_STATUS_SUCCESS || bStatus == USB::USB_STATUS_IMMEDREAD;
         }
-    
+
+    uint Available( bool& isBroken ) const;
+    uint FrameLength( void ) const;
+    bool IsReady( void ) const;
+    void Release( uint len );
+    void Linearize( uchar* pData, uint len );
+
+    void ReceiveFrame( void );
+    void Dispatch( uchar* buf, uint dBytesTransferred, int tag = -1 );
+
 public:
     
     USBRCVR( void )
         : semaReceived( 0 )
     {
-        bufSize = USB_RCVR_BUF_SIZE;
+        pMax      = ring + USB_RCVR_RING_SIZE;
+        pWrite    = ring;
+        used      = 0;
+        isReading = false;
+        isStalled = false;
+        isWaiter  = false;
+        isFramed  = false;
+        slotHead  = 0;
+        slotCount = 0;
+        maxSlots  = 0;
+        maxUsed   = 0;
+        stalls    = 0;
+        framingErrors = 0;
         }
 
-    void Initialize( void )
+    void Initialize( void );
+
+    void Receiver( void );
+
+    // Octets received but not yet dispatched
+    //
+    uint GetUsed( void ) const
     {
-#ifdef TR_INFO        
-        taskENTER_CRITICAL ();
-        TRACE_INFO( "USBRCVR: Initialize(): Size=%u\n", bufSize );
-        taskEXIT_CRITICAL ();
-#endif
+        return used;
+        }
 
-        // Wait a bit for USB endpoint to be ready
-        vTaskDelay( 100 );
+    bool IsFramed( void ) const
+    {
+        return isFramed;
+        }
 
-        bStatus = USB::USB_STATUS_ABORTED;
-        
-        for( ;; ) 
-        {
-            taskENTER_CRITICAL ();
-            int rc = sSer.Read( buf, bufSize, Callback_f( OnReceiveUSB ), this );
-            taskEXIT_CRITICAL ();
-            
-            if ( rc == USB::USB_STATUS_SUCCESS )
-                break;
-            
-            // USB endopoint is not ready; wait and retry
-            vTaskDelay( 10 );
-            }
+    void DumpStatus( void );
 
-#ifdef TR_INFO
-        taskENTER_CRITICAL ();
-        TRACE_INFO( "USBRCVR: Posted initial CCDC::Read\n" );
-        taskEXIT_CRITICAL ();
-#endif
+    static portTASK_FUNCTION( MainTask, pvParameters );
+    };
+    
+//---------------------------------------------------------------------------------------
+//      USB NOTIFICATION Class
+//---------------------------------------------------------------------------------------
+
+enum
+{
+    USB_NOTIFY_QUEUE_LEN = 8,
+    USB_NOTIFY_DATA_MAX  = 8,  // Longer event data is truncated
+    };
+
+// Sends urgent events and SERIAL_STATE changes through the CDC notification
+// endpoint (XPI_USB_CFG_NOTIFY), so they do not wait behind the bulk IN data.
+// A pending SERIAL_STATE is sent before queued events; only its latest value
+// is sent.
+//
+class USBNOTIFY
+{
+    struct EVENT
+    {
+        USB::S_cdc_notification hdr;
+        uchar data[ USB_NOTIFY_DATA_MAX ];
+        } ATTR_PACKED;
+
+    // Circular queue; producers are tasks (in critical sections), the consumer
+    // is the USB callback
+    //
+    EVENT queue[ USB_NOTIFY_QUEUE_LEN ];
+    uint head;
+    volatile uint count;
+
+    EVENT serialState;
+    volatile ushort wState;
+
+    volatile bool enabled;
+    volatile bool isBusy;
+    volatile bool isSendingState;
+    volatile bool isStatePending;
+
+    uint sent;
+    uint lost;
+
+    void Start( void );
+
+    static void OnSent
+    ( 
+        USBNOTIFY* pThis, uchar bStatus, 
+        uint dBytesTransferred, uint dBytesRemaining 
+        );
+
+public:
+
+    USBNOTIFY( void )
+    {
+        head = count = 0;
+        wState = 0;
+        enabled = false;
+        isBusy = false;
+        isSendingState = false;
+        isStatePending = false;
+        sent = lost = 0;
         }
 
-    void ReadMoreData( void )
+    void Enable( bool enable );
+
+    // Queues XPI_NOTIFY_EVENT with XPI_IMSG type, subtype and data
+    //
+    void Event( uchar type, uchar subtype, const uchar* data, uint len );
+
+    // Sets or clears XPI_SERIAL_STATE bits; SERIAL_STATE is sent on change
+    //
+    void SetState( ushort mask, bool set );
+
+    // Sets bit when a buffer gets 3/4 full and clears it when it gets half empty
+    //
+    void Watermark( ushort bit, uint used, uint size );
+
+    void DumpStatus( void );
+    };
+
+//---------------------------------------------------------------------------------------
+//      USB SOF Clock Synchronization Class
+//---------------------------------------------------------------------------------------
+
+enum
+{
+    USB_CLOCK_WINDOW = 1024,  // Frames between updates of the clock model
+    USB_CLOCK_MODEL_LEN = 14  // Octets of XPI_IMSG_CLOCK_SYNC data
+    };
+
+// Relates device time (dTimerTick refined by TC0 to microseconds) to the USB
+// frame time of the host (XPI_USB_CFG_CLOCK_SYNC).
+//
+// ISR_USB latches the device time of a pending SOF as early as possible;
+// OnStartOfFrame() then extends the 11-bit frame number and compares the
+// sample with the time predicted by the model. The least delayed sample of
+// every window becomes the new reference point, and the drift is estimated
+// from consecutive reference points.
+//
+class USBCLOCK
+{
+    volatile bool enabled;
+
+    // Latched by Capture() in ISR_USB
+    //
+    volatile bool isLatched;
+    uint  latchFrame;
+    ulong latchTick;
+    uint  latchCV;
+
+    // Model: device time refTick ms + refUs us at SOF of refFrame; device 
+    // clock runs drift ppb faster than the frame clock
+    //
+    bool  isValid;
+    uint  lastFrame;
+    ulong frame;
+    ulong refFrame;
+    ulong refTick;
+    uint  refUs;
+    long  drift;
+    bool  isDriftValid;
+
+    // Current window
+    //
+    ulong winStart;
+    long  minRes;
+    ulong minFrame;
+    ulong minTick;
+    uint  minUs;
+
+    volatile bool isReportDue;
+    uint updates;
+
+public:
+
+    USBCLOCK( void )
     {
-        bStatus = USB::USB_STATUS_ABORTED;
-        
-        for( ;; ) 
+        enabled = false;
+        isLatched = false;
+        isValid = false;
+        isReportDue = false;
+        drift = 0;
+        isDriftValid = false;
+        updates = 0;
+        }
+
+    bool IsEnabled( void ) const
+    {
+        return enabled;
+        }
+
+    void Enable( bool enable );
+
+    // Called at the entry of ISR_USB
+    //
+    void Capture( void )
+    {
+        if ( enabled && ! isLatched 
+            && ( AT91C_BASE_UDP->UDP_ISR & AT91C_UDP_SOFINT ) )
         {
-            taskENTER_CRITICAL ();
-            int rc = sSer.Read( buf, bufSize, Callback_f( OnReceiveUSB ), this );
-            taskEXIT_CRITICAL ();
-            
-            if ( rc == USB::USB_STATUS_SUCCESS )
-                break;
-
-            // USB endopoint is not ready; wait and retry
-            TRACE_ERROR( "!R " );
-            vTaskDelay( 1 );
+            Latch ();
             }
         }
 
-    void Receiver( void );
+    void Latch( void );
+
+    // Called from CCallbacks::OnStartOfFrame()
+    //
+    void OnStartOfFrame( void );
+
+    // Encodes the model: refFrame[4], tick[4], us[2], drift[4], MSB first.
+    // Returns false if there is no model yet. Not locked; call from the USB
+    // interrupt or with interrupts disabled.
+    //
+    bool GetModel( uchar* data ) const;
+
+    // Sends XPI_IMSG_CLOCK_SYNC if the model has been updated
+    //
+    void Report( void );
+
+    void DumpStatus( void );
+    };
+
+//---------------------------------------------------------------------------------------
+//     Command Executor Task Class
+//---------------------------------------------------------------------------------------
+
+enum
+{
+    CMD_QUEUE_LEN = 8,
+    CMD_DATA_MAX  = 8,  // Longer command data is truncated
+    };
+
+// Executes slow XPI_OMSG commands (FC bus, FPGA initialization, status dumps)
+// outside of the USB receiver task, in order of arrival.
+//
+class CMDEXEC
+{
+    struct CMD
+    {
+        uchar type;
+        uchar subtype;
+        short tag;      // -1 if not tagged
+        uchar len;
+        uchar data[ CMD_DATA_MAX ];
+        };
+
+    // Circular queue; producers are USBRCVR and the EP0 vendor request handler
+    // (interrupt level), the consumer is MainTask
+    //
+    CMD queue[ CMD_QUEUE_LEN ];
+    uint head;
+    uint tail;
+
+    xSEMA semaFull;
+    xSEMA semaEmpty;
+
+    uint maxQueued;
+
+    // Counters of posted and executed commands, and status of the last one
+    //
+    volatile uint postCount;
+    volatile uint doneCount;
+    volatile uchar lastStatus;
+
+    void Fill( uchar type, uchar subtype, const uchar* data, uint len, int tag );
+    int Execute( CMD& cmd );
+
+public:
+
+    CMDEXEC( void )
+        : semaFull( 0 )
+        , semaEmpty( CMD_QUEUE_LEN )
+    {
+        head = tail = 0;
+        maxQueued = 0;
+        postCount = doneCount = 0;
+        lastStatus = XPI_CMD_OK;
+        }
+
+    // Returns true if the command is executed asynchronously
+    //
+    static bool IsAsync( uchar type )
+    {
+        return type == XPI_OMSG_FC_CMD 
+            || type == XPI_OMSG_FPGA_INIT
+            || type == XPI_OMSG_QUERY;
+        }
+
+    // Queues the command for execution. Returns false if the queue stays
+    // full for xTicksToWait.
+    //
+    bool Post
+    ( 
+        uchar type, uchar subtype, const uchar* data, uint len, 
+        int tag, portTickType xTicksToWait 
+        );
+
+    // Same as Post() but never blocks; callable from the USB interrupt
+    //
+    bool PostFromISR
+    ( 
+        uchar type, uchar subtype, const uchar* data, uint len, 
+        int tag, signed portBASE_TYPE& isTaskWoken
+        );
+
+    uint GetPending( void ) const
+    {
+        return postCount - doneCount;
+        }
+
+    uint GetDoneCount( void ) const
+    {
+        return doneCount;
+        }
+
+    uchar GetLastStatus( void ) const
+    {
+        return lastStatus;
+        }
+
+    // Reports completion of a tagged command
+    //
+    static void Reply( int tag, uchar type, int status );
+
+    void DumpStatus( void );
 
     static portTASK_FUNCTION( MainTask, pvParameters );
     };
-    
+
 //---------------------------------------------------------------------------------------
 //     XSVF Player Task Class
 //---------------------------------------------------------------------------------------
+enum
+{
+    XSVF_POOL_BUFS     = 3,
+    XSVF_POOL_BUF_SIZE = 1024,
+    XSVF_SHIFT_MAX     = 128  // OctetArray length in xsvfPlayer.cpp
+    };
+
 class XSVF_Player
 {
-    bool enabled;
+    volatile bool enabled;
+
+    // Pool of XSVF data buffers. USBRCVR fills free buffers and queues them to
+    // the player, so the download of the next data overlaps with JTAG shifting.
+    // When all buffers are queued, Put() blocks USBRCVR and the host is NAKed.
+    //
+    struct BUF
+    {
+        uint  len;
+        uchar data[ XSVF_POOL_BUF_SIZE ];
+        } pool[ XSVF_POOL_BUFS ];
+
+    uint poolHead; // Next buffer to be played
+    uint poolTail; // Next buffer to be filled
+    bool isHolding; // Player holds the buffer in front of poolHead
 
     xSEMA semaFull;
-    xSEMA semaEmpty;
-    volatile uchar* datap;
-    volatile uint datac;
+    xSEMA semaFree;
+    uchar* datap;
+    uint datac;
     volatile int firstByte;
     int traceLevel;
     bool parseOnly;
     uint crc;
     uint byteCount;
     int xsvfRC;
-    
-    XPI_LONG_MSG sMsg;    
+
+    // Time in ticks the player waited for data and USBRCVR waited for a free
+    // buffer, since the first XSVF byte
+    //
+    volatile ulong dWaitData;
+    volatile ulong dWaitBuf;
     
     // Update the CRC for transmitted and received data using
     // the CCITT 16-bit algorithm (X^16 + X^12 + X^5 + 1).
@@ -308,21 +1091,29 @@ class XSVF_Player
         ++byteCount;
         }
 
+    bool NextBuffer( void );
+    void FlushBuffers( void );
+
     void MainLoop( void );
 
 public:    
 
     XSVF_Player( void )
         : semaFull( 0 )
-        , semaEmpty( 0 )
+        , semaFree( XSVF_POOL_BUFS )
     {
         enabled    = false;
         xsvfRC     = -1; // undefined error
+        poolHead   = 0;
+        poolTail   = 0;
+        isHolding  = false;
         datap      = NULL;
         datac      = 0;
         firstByte  = -1;
         traceLevel = 0;
         parseOnly  = false;
+        dWaitData  = 0;
+        dWaitBuf   = 0;
         }
 
     void Enable( int trace_level, bool parse_only );
@@ -348,40 +1139,19 @@ public:
 
         // Get next XSVF data. Consider end of XSVF stream on timeout.
         //
-        if ( datac == 0 )
-        {
-            if ( ! semaFull.Wait( 1, 2000 ) )
-                return -1;
-            
-            if ( datac == 0 )
-                return -1;
-            }
+        if ( datac == 0 && ! NextBuffer () )
+            return -1;
 
         data = *datap++;
         --datac;
 
-        if ( datac == 0 )
-        {
-            datap = NULL;
-            semaEmpty.Release( 1 );
-            }
-
         CRC16( data );
         return data;
         }
 
-    void LockBuffer( uchar* buf, uint len )
-    {
-        if ( ! enabled )
-            return; // ignore if not enabled
-
-        datap = buf;
-        datac = len;
-
-        semaFull.Release( 1 );
-        
-        do ; while( ! semaEmpty.Wait( 1, 100 ) );
-        }
+    // Queues XSVF data received from the host to the player
+    //
+    void Put( const uchar* data, uint len );
 
     static portTASK_FUNCTION( MainTask, pvParameters );
     };
@@ -393,5 +1163,8 @@ public:
 extern USBRCVR usbIn;
 extern USBXMTR usbOut;
 extern XSVF_Player xsvf;
+extern CMDEXEC cmdExec;
+extern USBNOTIFY usbNotify;
+extern USBCLOCK usbClock;
 
 #endif // _SAM7XPUD_H_INCLUDED
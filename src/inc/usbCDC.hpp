@@ -282,6 +282,22 @@ struct S_cdc_line_coding
 
 } ATTR_PACKED;
 
+//---------------------------------------------------------------------------------------
+//! \brief   Notification header
+//! \details Precedes the wLength octets of data of a notification sent through
+//!          the notification endpoint.
+//! \see     usbcdc11.pdf - Section 6.3
+//---------------------------------------------------------------------------------------
+struct S_cdc_notification
+{
+    uchar  bmRequestType;     //!< 0xA1: Device to host, class, interface
+    uchar  bNotification;     //!< Notification code
+    ushort wValue;            //!< Notification dependent value
+    ushort wIndex;            //!< Interface
+    ushort wLength;           //!< Length of the notification data
+
+} ATTR_PACKED;
+
 //---------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------
 // CDC Serial Driver --------------------------------------------------------------------
@@ -395,6 +411,8 @@ public:
     //! \param  dLength   Length of data buffer
     //! \param  fCallback Optional callback function
     //! \param  pArgument Optional parameter for the callback function
+    //! \param  pBufferLowerBound Lower bound of the circular buffer
+    //! \param  pBufferUpperBound Upper bound of the circular buffer
     //! \return SER_STATUS_SUCCESS if transfer has started successfully;
     //!         SER_STATUS_LOCKED if endpoint is currently in use;
     //!         SER_STATUS_ERROR if transfer cannot be started.
@@ -402,11 +420,14 @@ public:
     EnumStandardReturnValue Read
     (
         void* pBuffer, uint dLength,
-        Callback_f fCallback, void *pArgument 
+        Callback_f fCallback, void *pArgument,
+        void* pBufferLowerBound = 0, void* pBufferUpperBound = 0
         )
     {
         return pDriver->Read( SER_EPT_DATA_OUT, pBuffer, 
-                              dLength, fCallback, pArgument );
+                              dLength, fCallback, pArgument,
+                              pBufferLowerBound, pBufferUpperBound
+                              );
     }
 
     //-----------------------------------------------------------------------------------
@@ -432,6 +453,43 @@ public:
                                pBufferLowerBound, pBufferUpperBound
                                );
     }    
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Sends a notification through the Interrupt IN notification endpoint
+    //! \param  pBuffer   Buffer holding S_cdc_notification followed by its data
+    //! \param  dLength   Length of data buffer
+    //! \param  fCallback Optional callback function
+    //! \param  pArgument Optional parameter for the callback function
+    //! \return SER_STATUS_SUCCESS if transfer has started successfully;
+    //!         SER_STATUS_LOCKED if endpoint is currently in use;
+    //!         SER_STATUS_ERROR if transfer cannot be started.
+    //-----------------------------------------------------------------------------------
+    EnumStandardReturnValue Notify( 
+        const void* pBuffer, uint dLength,
+        Callback_f fCallback = 0, void* pArgument = 0
+        )
+    {
+        return pDriver->Write( SER_EPT_NOTIFICATION, pBuffer, dLength, 
+                               fCallback, pArgument
+                               );
+    }    
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Sends data through the Data IN endpoint after the current transfer
+    //! \see    Write
+    //! \see    CUsbDriver::WriteNext
+    //-----------------------------------------------------------------------------------
+    EnumStandardReturnValue WriteNext( 
+        const void* pBuffer, uint dLength,
+        Callback_f fCallback = 0, void* pArgument = 0,
+        const void* pBufferLowerBound = 0, const void* pBufferUpperBound = 0
+        )
+    {
+        return pDriver->WriteNext( SER_EPT_DATA_IN, pBuffer, dLength, 
+                                   fCallback, pArgument,
+                                   pBufferLowerBound, pBufferUpperBound
+                                   );
+    }    
 };
 
 //---------------------------------------------------------------------------------------
@@ -5,6 +5,8 @@
 //      Includes
 //---------------------------------------------------------------------------------------
 
+#include <stddef.h>
+
 #include "common.h"
 #include "trace.h"
 
@@ -194,13 +196,13 @@ enum EnumEndpointRecipient //!< bmRequestType field -- bits [4..0]: Recipient
 };
 
 //! Get the type of the request bits [6..5] from the bmRequestType
-#define USB_REQUEST_TYPE(reqType)       ( (reqType) & = 0x60) >> 5 )
+#define USB_REQUEST_TYPE(reqType)       ( ( (reqType) & 0x60 ) >> 5 )
 
 //! Get the receipient bits [4..0] from the bmRequestType
-#define USB_REQUEST_RECIPIENT(reqType)  ( (reqType) &= 0x1F )
+#define USB_REQUEST_RECIPIENT(reqType)  ( (reqType) & 0x1F )
 
-//! Get the data transfer direction bits [4..0] from the bmRequestType
-#define USB_REQUEST_DIR(reqType)  ( ( (reqType) &= 0x80 ) >> 7 )
+//! Get the data transfer direction bit [7] from the bmRequestType
+#define USB_REQUEST_DIR(reqType)  ( ( (reqType) & 0x80 ) >> 7 )
 
 //---------------------------------------------------------------------------------------
 //! \ingroup usb_std
@@ -675,6 +677,17 @@ public:
                                      //!< transfer is complete
     void*         pArgument;         //!< Argument to pass to the callback function
 
+    //-----------------------------------------------------------------------------------
+    // Next Transfer Descriptor (queued by WriteNext() while a write is in progress)
+    //-----------------------------------------------------------------------------------
+    volatile bool bNextQueued;       //!< Next write transfer is queued
+    const void*   pNextData;         //!< Buffer holding the data to send
+    uint          dNextLength;       //!< Length of the data buffer
+    Callback_f    fNextCallback;     //!< Callback to invoke after the next transfer
+    void*         pNextArgument;     //!< Argument to pass to the callback function
+    const void*   pNextLowerBound;   //!< Circular buffer lower bound
+    const void*   pNextUpperBound;   //!< Circular buffer upper bound
+
     //-----------------------------------------------------------------------------------
     // Hardware Information
     //-----------------------------------------------------------------------------------
@@ -682,6 +695,8 @@ public:
     uint          dFlag;             //!< Hardware flag to clear upon data reception
     uint          dNumFIFO;          //!< Number of FIFO buffers defined for this endpoint
     volatile uint dState;            //!< Endpoint internal state
+    uint          dCsrMask;          //!< Flags of the pending CSR update
+    uint          dCsrValue;         //!< Expected value of the flags
     
     //-----------------------------------------------------------------------------------
     //! \brief Initialize endpoint with single/dualbank.
@@ -699,10 +714,19 @@ public:
         bCompletePacket   = true;
         fCallback         = 0;
         pArgument         = 0;
+        bNextQueued       = false;
+        pNextData         = 0;
+        dNextLength       = 0;
+        fNextCallback     = 0;
+        pNextArgument     = 0;
+        pNextLowerBound   = 0;
+        pNextUpperBound   = 0;
         wMaxPacketSize    = 0;
         dFlag             = 0;
         dNumFIFO          = 0;
         dState            = StateDisabled;
+        dCsrMask          = 0;
+        dCsrValue         = 0;
     }
     
     //-----------------------------------------------------------------------------------
@@ -736,13 +760,25 @@ public:
             {
                 fCallback
                 (
-                     uint( pArgument ),
+                     uint( size_t( pArgument ) ),
                      uint( bStatus ),
                      dBytesTransferred,
                      dBytesRemaining + dBytesBuffered
                      );
             }
         }
+
+        //! Queued transfer cannot start after a failed one; finish it as well
+        //
+        if ( bNextQueued && bStatus != USB_STATUS_SUCCESS )
+        {
+            bNextQueued = false;
+
+            if ( fNextCallback != 0 )
+            {
+                fNextCallback( uint( size_t( pNextArgument ) ), uint( bStatus ), 0, dNextLength );
+            }
+        }
     }
 };
 
@@ -770,6 +806,8 @@ protected:
     S_usb_request     sSetup;          //!< Pointer to the last received SETUP packet
     volatile uint     dState;          //!< Current state of the device
     bool              useSOFCallback;  //!< Indicates wether to forward StartOfFrame events
+    volatile uint     dCsrWrites;      //!< Number of endpoint CSR updates
+    volatile uint     dCsrSpins;       //!< Number of polls waiting for CSR synchronization
 
     //-----------------------------------------------------------------------------------
     //! \brief  Constructor. Just nullify/disable everything.
@@ -784,6 +822,8 @@ protected:
         dNumEndpoints  = 0;
         dState         = 0;
         useSOFCallback = false;
+        dCsrWrites     = 0;
+        dCsrSpins      = 0;
     }
     
     //-----------------------------------------------------------------------------------
@@ -861,6 +901,32 @@ public:
         const void* pDataLowerBound = 0, const void* pDataUpperBound = 0
         ) = 0;
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Sends data through an USB endpoint after the current transfer.
+    //! \details Same as Write() if the endpoint is idle. While a write is in 
+    //! progress, the transfer is queued and started by the endpoint interrupt 
+    //! handler as soon as the current transfer completes, so the endpoint FIFO 
+    //! banks are refilled without waiting for the caller. At most one transfer 
+    //! can be queued. Callbacks are invoked in order, once per transfer.
+    //! Must be called with the endpoint interrupt masked.
+    //! \param  bEndpoint Number of the endpoint through which to send the data
+    //! \param  pData     Pointer to a buffer containing the data to send
+    //! \param  dLength   Size of the data buffer
+    //! \param  fCallback Callback function to invoke when the transfer finishes
+    //! \param  pArgument Optional parameter to pass to the callback function
+    //! \param  pDataLowerBound Lower bound of the circular buffer
+    //! \param  pDataUpperBound Upper bound of the circular buffer
+    //! \return USB_STATUS_LOCKED if a transfer is already queued
+    //! \see    EnumStandardReturnValue
+    //-----------------------------------------------------------------------------------
+    virtual EnumStandardReturnValue WriteNext
+    ( 
+        int bEndpoint,
+        const void* pData, uint dLength,
+        Callback_f fCallback = 0, void* pArgument = 0,
+        const void* pDataLowerBound = 0, const void* pDataUpperBound = 0
+        ) = 0;
+
     //-----------------------------------------------------------------------------------
     //! \brief  Receives data on the specified USB endpoint.
     //! \details This functions receives data on a particular endpoint. It finishes either
@@ -874,6 +940,8 @@ public:
     //! \param  fCallback Optional user-provided callback function invoked upon the
     //!                   transfer completion
     //! \param  pArgument Optional parameter to pass to the callback function
+    //! \param  pDataLowerBound Lower bound of the circular buffer
+    //! \param  pDataUpperBound Upper bound of the circular buffer
     //! \return Result of operation
     //! \see    EnumStandardReturnValue
     //-----------------------------------------------------------------------------------
@@ -881,7 +949,8 @@ public:
     (
         int bEndpoint,
         void* pData, uint dLength,
-        Callback_f fCallback = 0, void* pArgument = 0
+        Callback_f fCallback = 0, void* pArgument = 0,
+        void* pDataLowerBound = 0, void* pDataUpperBound = 0
         ) = 0;
 
     //-----------------------------------------------------------------------------------
@@ -910,6 +979,18 @@ public:
     //-----------------------------------------------------------------------------------
     virtual void RemoteWakeUp( void ) = 0;
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Enables or disables the SOF interrupt, which invokes
+    //!         CEventSink::OnStartOfFrame every frame.
+    //! \param  enable true to enable the SOF interrupt
+    //-----------------------------------------------------------------------------------
+    virtual void EnableSOF( bool enable ) = 0;
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Returns the frame number of the last received SOF (11 bits)
+    //-----------------------------------------------------------------------------------
+    virtual uint GetFrameNumber( void ) = 0;
+
     //-----------------------------------------------------------------------------------
     //! \brief  Configures the specified endpoint using the provided endpoint
     //!         descriptor.
@@ -1037,6 +1118,17 @@ public:
         return dNumEndpoints;
     }
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Returns endpoint CSR update statistics
+    //! \param  writes Number of CSR updates
+    //! \param  spins  Number of CSR polls spent waiting for synchronization
+    //-----------------------------------------------------------------------------------
+    void GetCsrStatistics( uint& writes, uint& spins ) const
+    {
+        writes = dCsrWrites;
+        spins  = dCsrSpins;
+    }
+
     //-----------------------------------------------------------------------------------
     //! \brief  Establish the list of configured endpoints
     //-----------------------------------------------------------------------------------
@@ -1088,6 +1180,14 @@ struct S_std_descriptors
 #endif
 };
 
+//---------------------------------------------------------------------------------------
+//! \brief   Handler of vendor-specific SETUP requests.
+//! \details Invoked from CSTD::RequestHandler in the context of the USB interrupt.
+//!          The handler must start the data or status stage on endpoint 0 and 
+//!          return true, or return false to have the request stalled.
+//---------------------------------------------------------------------------------------
+typedef bool (*VendorRequest_f)( CUsbDriver* pDriver, const S_usb_request* pSetup );
+
 //---------------------------------------------------------------------------------------
 //! \brief   USB standard class driver structure.
 //! \details Used to provide standard driver information so external modules can
@@ -1115,6 +1215,7 @@ protected:
                                             //!< \see_usb20 Figure 9-4
     ushort                   wData;         //!< Temporary data buffer used by
                                             //!< pDriver->Write()
+    VendorRequest_f          fVendorRequest; //!< Handler of vendor requests (optional)
 
 private:
     
@@ -1310,6 +1411,7 @@ protected:
     {
         pDriver = usbDriver;
         pDriver->LinkTo( eventSink, board );
+        fVendorRequest = 0;
     }
 
 public:
@@ -1330,6 +1432,16 @@ public:
         pDriver->Init ();
     }
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Installs the handler of vendor-specific SETUP requests.
+    //! \details Vendor requests are stalled if there is no handler.
+    //! \param  fHandler Handler function
+    //-----------------------------------------------------------------------------------
+    void SetVendorRequestHandler( VendorRequest_f fHandler )
+    {
+        fVendorRequest = fHandler;
+    }
+
     //-----------------------------------------------------------------------------------
     //! \brief  Return true if device is powered 
     //-----------------------------------------------------------------------------------
@@ -1353,6 +1465,24 @@ public:
     {
         pDriver->Attach ();
     }
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Enables or disables the SOF interrupt. 
+    //! \see    CUsbDriver::EnableSOF
+    //-----------------------------------------------------------------------------------
+    void EnableSOF( bool enable )
+    {
+        pDriver->EnableSOF( enable );
+    }
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Returns endpoint CSR update statistics. 
+    //! \see    CUsbDriver::GetCsrStatistics
+    //-----------------------------------------------------------------------------------
+    void GetCsrStatistics( uint& writes, uint& spins ) const
+    {
+        pDriver->GetCsrStatistics( writes, spins );
+    }
 };
 
 //---------------------------------------------------------------------------------------
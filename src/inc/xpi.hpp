@@ -11,9 +11,222 @@ enum XPI_OMSG_TYPE
     XPI_OMSG_XSVF_DATA   = 0x05,
     XPI_OMSG_FPGA_INIT   = 0x06,
     XPI_OMSG_FC_CMD      = 0x07,
-    XPI_OMSG_SC_DATA     = 0x08
+    XPI_OMSG_SC_DATA     = 0x08,
+    XPI_OMSG_USB_CFG     = 0x09,
+    XPI_OMSG_TAGGED      = 0x0A, // subtype: tag; data: { type, subtype, data[] }
+    XPI_OMSG_SC_BATCH    = 0x0B  // subtype: count; data: see below
     };
 
+// XPI_OMSG_SC_BATCH carries count SC frames, each one as
+//    uint8  len           length of the following data, 3 .. 30
+//    uint8  data[len]     requestID (MSB first) and SC frame, as XPI_OMSG_SC_DATA
+// The batch is queued as a whole or rejected as a whole (XPI_IMSG_FLOW_CTRL 
+// 0x77 for every frame); a malformed batch is dropped. Credits are consumed
+// as if the frames were sent as separate XPI_OMSG_SC_DATA messages.
+//
+// SC frames (XPI_OMSG_SC_DATA data is 3 .. 30 octets, as above) are queued per
+// destination board, i.e. the address in the first SC frame octet, and the
+// boards are served round-robin. Frames to the same board are sent in order;
+// frames to different boards may be sent out of order.
+//
+
+// XPI_OMSG_QUERY subtypes: 0x01 dumps the XPI status to the log, 0x02 replies
+// with XPI_IMSG_CAPS, 0x03 with XPI_IMSG_SC_RTT; any other subtype dumps the 
+// system status to the log.
+//
+enum XPI_QUERY_TYPE
+{
+    XPI_QUERY_XPI_STATUS = 0x01,
+    XPI_QUERY_CAPS       = 0x02,
+    XPI_QUERY_SC_RTT     = 0x03
+    };
+
+// Commands XPI_OMSG_FC_CMD, XPI_OMSG_FPGA_INIT and XPI_OMSG_QUERY are executed
+// by the command executor task, asynchronously to the other commands. Any
+// command may be wrapped into XPI_OMSG_TAGGED; its completion is then reported
+// with XPI_IMSG_CMD_DONE carrying the same tag. A command that depends on an 
+// asynchronous one should be sent after its XPI_IMSG_CMD_DONE.
+//
+enum XPI_CMD_STATUS
+{
+    XPI_CMD_OK           = 0x00,
+    XPI_CMD_BUSY         = 0x01, // Executor queue full; command not executed
+    XPI_CMD_FAILED       = 0x02  // Board not installed (FC_CMD board reset), reply
+                                 // not sent (QUERY caps or RTT), or SC frames not
+                                 // queued (SC_DATA, SC_BATCH)
+    };
+
+enum XPI_OMSG_USB_CFG_SUBTYPE
+{
+    // Coalescing of XPI_IMSG messages into multi-message USB IN transfers.
+    // data[0..1]: byte budget per transfer, MSB first (0 = disabled)
+    // data[2]:    flush deadline in ticks after the first message of a batch;
+    //             a message with nothing queued behind it is sent at once
+    //
+    XPI_USB_CFG_COALESCE = 0x01,
+
+    // Sequence numbers of XPI_IMSG messages.
+    // data[0]: non-zero to append 2-octet sequence number (MSB first) after
+    //          the data of every XPI_IMSG message. Dropped messages leave a gap,
+    //          which XPI_IMSG_LOST accounts for. Numbers increase in the order
+    //          of messages within a USB lane; control messages may overtake
+    //          log and trace messages with lower numbers.
+    //
+    XPI_USB_CFG_SEQUENCE = 0x02,
+
+    // Streaming of USB IN transfers.
+    // data[0]: non-zero to queue the next transfer while the current one is
+    //          in progress, instead of waiting for each transfer to complete
+    //
+    XPI_USB_CFG_STREAM   = 0x03,
+
+    // Framing of XPI_IMSG messages in USB IN transfers.
+    // data[0]: 2 to select compact v2 framing; any other value selects v1 (default)
+    //
+    // v2 framing implies coalescing: every USB IN transfer is a batch of messages
+    //    uint8  magic[2]      '@', '#'
+    //    record[]
+    // XPI_IMSG record:
+    //    uint8  tsub          0 tttt sss: type in bits 6..3, subtype in bits 2..0;
+    //                         sss = 7: subtype >= 7 follows as uint8
+    //    varint len           length of data (7 bits per octet, LS group first,
+    //                         bit 7 set if more octets follow)
+    //    varint dts           zigzag encoded timeStamp delta to the previous record
+    //                         of the batch (to 0 for the first record)
+    //    uint8  data[len]
+    // Other (raw) record, e.g. loopback data:
+    //    uint8  len_MSB       0x80 | len >> 8
+    //    uint8  len_LSB
+    //    uint8  data[len]
+    // A transfer that does not start with the magic is a v1 coalesced batch
+    // (the first record would not fit in place).
+    //
+    XPI_USB_CFG_FRAMING  = 0x04,
+
+    // Framing of XPI_OMSG messages in USB OUT transfers.
+    // data[0]: non-zero to select framed mode, 0 for one message per transfer
+    //          (default)
+    //
+    // In framed mode USB OUT transfers carry a stream of frames; a transfer may
+    // hold any number of frames and a frame may span transfers:
+    //    uint8  len_MSB       length of the message, 4 .. 4094
+    //    uint8  len_LSB
+    //    XPI_OMSG_HEADER + data[len - 4]
+    // A frame without the magic is skipped octet by octet until sync is found.
+    // Data following the frame that turns framed mode off is dropped.
+    //
+    XPI_USB_CFG_OMSG_FRAMING = 0x05,
+
+    // Notifications on the CDC notification endpoint (interrupt IN, polled 
+    // every frame).
+    // data[0]: non-zero to enable, 0 to disable (default)
+    //
+    // Every notification is S_cdc_notification header followed by data:
+    //    bmRequestType 0xA1, bNotification, wValue, wIndex 0, wLength, data[]
+    // SERIAL_STATE (bNotification 0x20), sent when enabled and on change:
+    //    wValue 0, wLength 2, data: uint16 XPI_SERIAL_STATE (little endian)
+    // XPI_NOTIFY_EVENT, copies of urgent XPI_IMSG messages (FPGA_STATUS on
+    // FPGA reset, FLOW_CTRL rejections, FC_EVENT) that are still sent in the 
+    // bulk stream too:
+    //    wValue XPI_IMSG type in LSB, subtype in MSB, wLength <= 8, data[]
+    //
+    XPI_USB_CFG_NOTIFY   = 0x06,
+
+    // SOF based clock synchronization.
+    // data[0]: non-zero to enable the SOF interrupt and XPI_IMSG_CLOCK_SYNC 
+    //          reports (about one per second), 0 to disable (default)
+    //
+    XPI_USB_CFG_CLOCK_SYNC = 0x07,
+
+    // Credit based flow control of XPI_OMSG_SC_DATA.
+    // data[0]: non-zero to enable, 0 to disable (default)
+    //
+    // Every XPI_OMSG_SC_DATA with dataLen octets of data consumes dataLen + 2
+    // octets and one frame slot of the SC transmit buffer. In credit mode the
+    // receiver never waits for the buffer: an SC_DATA exceeding the credits is
+    // rejected at once with XPI_IMSG_FLOW_CTRL 0x77. The host keeps the 
+    // buffer full without rejects by sending only while
+    //    baseBytes + freedBytes - (octets sent) >= dataLen + 2, and
+    //    baseFrames + freedFrames - (frames sent) >= 1
+    // counting the SC_DATA sent after this XPI_OMSG_USB_CFG. XPI_IMSG_CREDIT 
+    // is sent on enable, whenever a quarter of the buffer has been freed and
+    // when the buffer gets empty.
+    //
+    XPI_USB_CFG_CREDITS  = 0x08
+    };
+
+enum
+{
+    XPI_NOTIFY_EVENT     = 0x80  // Vendor notification code
+    };
+
+enum XPI_SERIAL_STATE
+{
+    // CDC bits; the device sets DCD and DSR while notifications are enabled
+    //
+    XPI_SERIAL_STATE_DCD     = 0x0001,
+    XPI_SERIAL_STATE_DSR     = 0x0002,
+
+    // Vendor bits (reserved in CDC); set when 3/4 full, cleared when half empty
+    //
+    XPI_SERIAL_STATE_RX_FULL = 0x0100,  // USB OUT receive ring
+    XPI_SERIAL_STATE_SC_FULL = 0x0200   // SC_DATA transmit buffer
+    };
+
+// Vendor-specific control requests on endpoint 0 (bmRequestType 0x40 or 0xC0).
+// They are served by the USB interrupt out of band of the bulk endpoints, so 
+// their latency does not depend on the XPI_OMSG data pending on endpoint 1.
+// Unsupported requests are stalled.
+//
+enum XPI_VREQ_TYPE
+{
+    // Device to host; data stage: XPI_VREQ_STATUS_REPLY (up to wLength octets)
+    //
+    XPI_VREQ_STATUS      = 0x02,
+
+    // Host to device, no data stage; same as XPI_OMSG_LOG_CFG
+    // wValue:     trace mask
+    //
+    XPI_VREQ_LOG_CFG     = 0x03,
+
+    // Device to host; queues XPI_OMSG_FC_CMD to the command executor
+    // wValue:     data[0] (Addr) in LSB, data[1] (D1, D0) in MSB
+    // wIndex:     length of data, 1 or 2, as with XPI_OMSG_FC_CMD
+    // data stage: uint8 XPI_CMD_STATUS; XPI_CMD_BUSY if the queue is full.
+    //             Completion is seen in XPI_VREQ_STATUS_REPLY::cmdDone.
+    //
+    XPI_VREQ_FC_CMD      = 0x07,
+
+    // Device to host; data stage: XPI_IMSG_CLOCK_SYNC data of the current model
+    // (stalled if XPI_USB_CFG_CLOCK_SYNC is off)
+    //
+    XPI_VREQ_CLOCK       = 0x08,
+
+    // Device to host; data stage: XPI_IMSG_CAPS data
+    //
+    XPI_VREQ_CAPS        = 0x09
+    };
+
+enum XPI_VREQ_STATUS_FLAGS
+{
+    XPI_VREQ_ST_FPGA_OK      = 0x01,  // FPGA is initialized
+    XPI_VREQ_ST_OMSG_FRAMING = 0x02   // XPI_USB_CFG_OMSG_FRAMING is on
+    };
+
+struct XPI_VREQ_STATUS_REPLY // Little endian
+{
+    ulong  timeStamp;  // same clock as XPI_IMSG_HEADER::timeStamp
+    uchar  flags;      // XPI_VREQ_STATUS_FLAGS
+    uchar  cmdPending; // commands queued or executing in the command executor
+    uchar  cmdDone;    // commands executed, modulo 256
+    uchar  cmdStatus;  // XPI_CMD_STATUS of the last executed command
+    ushort rxUsed;     // octets of USB OUT data received but not dispatched yet
+    ushort reserved;
+    ulong  scFreedBytes;  // XPI_IMSG_CREDIT freedBytes (0 if not in credit mode)
+    ushort scFreedFrames; // XPI_IMSG_CREDIT freedFrames
+
+    } ATTR_PACKED; // Total size 18 octets
+
 enum XPI_IMSG_TYPE
 {
     XPI_IMSG_NULL        = 0x00,
@@ -27,13 +240,92 @@ enum XPI_IMSG_TYPE
     XPI_IMSG_TRACE_CTX   = 0x08,
     XPI_IMSG_TRACE_CRX   = 0x09,
     XPI_IMSG_TRACE_EIRQ  = 0x0A,
-    XPI_IMSG_TRACE_HSSC  = 0x0B
+    XPI_IMSG_TRACE_HSSC  = 0x0B,
+    XPI_IMSG_LOST        = 0x0C, // data: { type, count_MSB, count_LSB } per type;
+                                 // types above 0x0F are counted as type 0x00
+    XPI_IMSG_CMD_DONE    = 0x0D, // subtype: tag; data: { type, XPI_CMD_STATUS }
+    XPI_IMSG_CLOCK_SYNC  = 0x0E, // subtype: 0; data: see below
+    XPI_IMSG_CREDIT      = 0x0F, // subtype: 0; data: see XPI_USB_CFG_CREDITS
+    XPI_IMSG_CAPS        = 0x10, // subtype: 0; data: see below
+    XPI_IMSG_SC_RTT      = 0x11  // subtype: 0; data: see below
+    };
+
+// XPI_IMSG_CAPS data, MSB first (types above 0x0F are sent as raw records in
+// v2 framing):
+//    uint8  capsVersion      1; later versions only append fields
+//    uint8  verMajor
+//    uint8  verMinor
+//    uint16 verBuild
+//    uint16 usbXmtrBufSize   USB IN buffer size (all lanes)
+//    uint16 usbRcvrBufSize   max XPI_OMSG message (USB OUT transfer) length
+//    uint16 usbRcvrRingSize  USB OUT receive ring size
+//    uint16 scXmtrBufSize    SC transmit buffer size (XPI_USB_CFG_CREDITS)
+//    uint16 scXmtrSlots      SC transmit buffer frame slots
+//    uint8  scFrameMax       max frame length in XPI_OMSG_SC_BATCH
+//    uint8  maxBoardCount
+//    uint16 xsvfShiftMax     max XSVF shift length in octets
+//    uint16 xsvfBufSize      XSVF_DATA buffer size...
+//    uint8  xsvfBufs         ...and count; XSVF_DATA should not exceed xsvfBufSize
+//    uint8  cmdQueueLen      command executor queue length
+//    uint32 features         XPI_CAPS_FEATURES
+//
+enum XPI_CAPS_FEATURES
+{
+    XPI_CAPS_TAGGED         = 0x0001,  // XPI_OMSG_TAGGED, XPI_IMSG_CMD_DONE
+    XPI_CAPS_OMSG_FRAMING   = 0x0002,  // XPI_USB_CFG_OMSG_FRAMING
+    XPI_CAPS_IMSG_V2        = 0x0004,  // XPI_USB_CFG_FRAMING 2
+    XPI_CAPS_NOTIFY         = 0x0008,  // XPI_USB_CFG_NOTIFY
+    XPI_CAPS_CLOCK_SYNC     = 0x0010,  // XPI_USB_CFG_CLOCK_SYNC
+    XPI_CAPS_CREDITS        = 0x0020,  // XPI_USB_CFG_CREDITS
+    XPI_CAPS_SC_BATCH       = 0x0040,  // XPI_OMSG_SC_BATCH
+    XPI_CAPS_VREQ           = 0x0080,  // XPI_VREQ vendor requests
+    XPI_CAPS_ISR_DEFERRED   = 0x0100,  // Build option USBISR=TASK
+    XPI_CAPS_XMTR_LOCKFREE  = 0x0200,  // Build option USBXMTR=LOCKFREE
+    XPI_CAPS_CSR_SYNC       = 0x0400,  // Build option USBCSR=SYNC
+    XPI_CAPS_SC_RTT         = 0x0800   // XPI_QUERY_SC_RTT
+    };
+
+enum
+{
+    XPI_CAPS_LEN = 27
     };
 
+// XPI_IMSG_SC_RTT data: one record per board position with RTT samples,
+// MSB first:
+//    uint8  board         board position
+//    uint16 srtt          smoothed round-trip time, us
+//    uint16 rttvar        mean deviation of round-trip time, us
+//    uint8  timeout       current ACK timeout, ms (the poll timeout is the
+//                         same without backoff)
+//    uint16 samples       sample count, saturated at 65535
+//
+enum
+{
+    XPI_SC_RTT_RECORD_LEN = 8
+    };
+
+// XPI_IMSG_CREDIT data, MSB first (also sent as XPI_NOTIFY_EVENT, without base):
+//    uint32 freedBytes    octets freed in the SC transmit buffer
+//    uint16 freedFrames   frame slots freed, modulo 65536
+//    uint16 baseBytes     free octets when credit mode was enabled
+//    uint16 baseFrames    free frame slots when credit mode was enabled
+//
+
+// XPI_IMSG_CLOCK_SYNC data, MSB first:
+//    uint32 frame     32-bit SOF frame count; low 11 bits are the USB frame number
+//    uint32 tick      device time at that SOF: dTimerTick (XPI_IMSG timeStamp)...
+//    uint16 us        ...plus microseconds, 0 .. 999
+//    int32  drift     device clock rate relative to the frame clock, in ppb
+// Device time T (in us; timeStamp * 1000 for XPI_IMSG) maps to frame time
+//    frame + ( T - ( tick * 1000 + us ) ) / ( 1000 * ( 1 + drift * 1e-9 ) )
+// which the host relates to its own clock through its frame counter.
+//
+
 enum
 {
     XPI_MSG_MAGIC_MSB = '@',
-    XPI_MSG_MAGIC_LSB = '!'
+    XPI_MSG_MAGIC_LSB = '!',
+    XPI_V2_MAGIC_LSB  = '#'  // v2 batch magic: '@', '#'
     };
 
 struct XPI_IMSG_HEADER
@@ -55,18 +347,11 @@ struct XPI_OMSG_HEADER
 
     } ATTR_PACKED; // Total size 4 octets
 
-struct XPI_SHORT_MSG : public XPI_IMSG_HEADER
+struct XPI_IMSG : public XPI_IMSG_HEADER
 {
-    uchar data[ 8 ];
+    uchar data[ 0 ]; // Variable length, built in place by USBXMTR::BeginMsg()
 
-    } ATTR_PACKED; // Total size 16 octets
-
-struct XPI_LONG_MSG : public XPI_IMSG_HEADER
-{
-    uchar data[ 24 ]; // Max 18 octets of SC data
-
-    } ATTR_PACKED; // Total size 32 octets
-    
+    } ATTR_PACKED;
 
 //---------------------------------------------------------------------------------------
 // Backplane interface
@@ -75,16 +360,23 @@ class XPI
 {
     friend portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters );
 
+public:
+
     enum 
     { 
         XPI_XMTR_BUF_SIZE  = 4096,
+        XPI_XMTR_SLOTS     = 128,  // Max SC frames queued in the transmit buffer
+        XPI_SC_FRAME_MAX   = 30,   // Max requestID + SC frame length
         EIRQ_POLL_DELAY    = 4,
         INTER_SEND_DELAY   = 2,
         RECEIVE_TIMEOUT    = 5,
         CTXE_TIMEOUT       = 10,
-        MAX_BOARD_COUNT    = 64
+        MAX_BOARD_COUNT    = 64,
+        FIFO_BURST_MAX     = 24    // Max CTX/CRX octets read in one FIFO burst
         };
 
+private:
+
     enum
     {
         DBG_EIRQ        = 0x01,
@@ -94,29 +386,88 @@ class XPI
         DBG_CRX         = 0x10
         };
 
+    enum
+    {
+        SC_SLOT_NONE    = 0xFF,
+        SC_HOLDOFF      = 50,   // ms a board is held off after a failed frame
+        SC_TIMEOUT_MIN  = 2,    // ms; adaptive ACK and poll timeout floor...
+        SC_TIMEOUT_MAX  = 20,   // ...and ceiling
+        SC_RTTVAR_MIN   = 250,  // us; RTT deviation floor
+        SC_BACKOFF_MAX  = 2,    // ACK timeout doubled at most twice
+        EIRQ_HIT_WEIGHT = 256,  // eirq_weight added when a board answers a poll...
+        EIRQ_HINT_WEIGHT = 64,  // ...and on an FC event from the board
+        EIRQ_DECAY_PERIOD = 16  // EIRQs between halving all eirq_weight
+        };
+
     xMUTEX semaMutex;
     xSEMA semaFull;
     xSEMA semaEmpty;
     xSEMA semaSent;
+    xSEMA semaSlots;  // Free frame slots
 
-    // Circular buffer of MSGBUF packets.
-    // MSGBUF length is max 32 octets, so the circular buffer last packet
-    // crossing pMax is not split, rather it is kept complete over pMax boundary
-    // so it could be accessed directly with linear functions like memcpy().
+    // Credit based flow control (XPI_USB_CFG_CREDITS). Octets and frames in 
+    // the transmit buffer are counted by Put() and Transmitter(); credits are
+    // cumulative since credit mode was enabled, so a lost report is covered by
+    // the next one.
     //
-    // MSGBUF Packet format:
-    //    Header:
-    //       uint8 len_MSB
-    //       uint8 len_LSB
-    //    Body:
-    //       uint8 data[len]
+    volatile bool isCredit;
+    volatile uint queuedBytes;
+    volatile uint queuedFrames;
+    ulong  freedBytes;
+    ushort freedFrames;
+    ushort baseBytes;
+    ushort baseFrames;
+    ulong  reportedBytes;
+    ushort reportedFrames;
+
+    // SC transmit buffer: frame slots linked into per-board FIFO queues, keyed
+    // by the board address in the first SC frame octet. Transmitter() serves
+    // the queues round-robin, so a slow or dead board delays only its own
+    // frames; a board with a failed frame is skipped for SC_HOLDOFF ms while
+    // other boards have frames. bufSize is the octet budget of semaFull, kept
+    // for credit accounting.
     //
-    uchar  buf[ XPI_XMTR_BUF_SIZE + 32 ];
-    uint   bufSize;
+    struct SC_SLOT
+    {
+        uchar next;                      // Next slot in the queue or free list
+        uchar len;                       // Length of data
+        uchar data[ XPI_SC_FRAME_MAX ];  // requestID (MSB first) and SC frame
+        };
 
-    uchar* pRead;
-    uchar* pWrite;
-    uchar* pMax;
+    struct SC_QUEUE
+    {
+        uchar head;
+        uchar tail;
+        ulong holdoff;                   // dTimerTick until the board is skipped
+        };
+
+    SC_SLOT  slots[ XPI_XMTR_SLOTS ];
+    SC_QUEUE scQueue[ MAX_BOARD_COUNT ];
+    uint     freeSlot;
+    uint     scNext;   // Next board to serve
+    uint     bufSize;
+
+    uchar* pRead;      // SC frame being sent
+    bool   isCtxRetry; // pRead is being resent
+
+    // Round-trip time per board position, from putting a frame (that expects
+    // an ACK) or a poll into CTX until the board responds, in us. As in TCP,
+    // srtt8 is 8 x smoothed RTT and rttvar4 is 4 x its mean deviation; resent
+    // frames are not sampled. backoff doubles the timeout after each ACK 
+    // timeout, until the next sample.
+    //
+    struct SC_RTT
+    {
+        uint   srtt8;
+        uint   rttvar4;
+        ushort samples;
+        uchar  backoff;
+        };
+
+    SC_RTT scRtt[ MAX_BOARD_COUNT ];
+    int    rttBoard;     // Board of the pending sample, or -1
+    uint   rttStartLat;  // LAT_Now() and dTimerTick at CTX start
+    ulong  rttStartTick;
 
     volatile uint ctx_count;
     uchar* pCtx;
@@ -124,14 +475,14 @@ class XPI
 
     void LockWrite( void )
     {
-        // Lock pWrite mutex
+        // Lock producer mutex
         //
         do ; while( ! semaMutex.Lock( 100 ) );
         }
 
     void UnlockWrite( void )
     {
-        // Unlock pWrite mutex
+        // Unlock producer mutex
         //
         semaMutex.Unlock ();
         }
@@ -168,14 +519,25 @@ class XPI
     bool rearrange_poll_list;
     ulong eirq_count;
     ulong stuck_eirq_count;
+    ulong poll_steps;
 
-    XPI_SHORT_MSG sMsg;
+    // Decaying EIRQ hit count per board position (8.8 fixed point); active 
+    // boards are polled in descending order of weight.
+    //
+    ushort eirq_weight[ MAX_BOARD_COUNT ];
+    ulong fifo_bursts;
+    ulong fifo_octets;
+    uint  fifo_burst_max;
 
-    XPI_LONG_MSG sCTX;
+    // CTX and CRX frames being assembled. Max 18 octets of SC data.
+    //
+    uchar ctxData[ 24 ];
+    ulong ctxTimeStamp;
     int ctxLen;
     int ctxCkSum;
     
-    XPI_LONG_MSG sCRX;
+    uchar crxData[ 24 ];
+    ulong crxTimeStamp;
     int crxLen;
     int crxCkSum;
     uint requestID;
@@ -200,12 +562,32 @@ class XPI
 
     void ResetPollList( void );
     void RearrangePollList( void );
+    void SortPollList( void );
     void MarkBoardActive( bool active );
+    bool IsBoardActive( uint board ) const;
+    void CountEirqHit( uint board, uint weight );
+    void DecayEirqWeights( void );
     void PollNextBoard( void );
 
+    void PutFrame( uchar type, uchar subtype, ulong timeStamp, 
+            const uchar* data, int len, portTickType xTicksToWait );
+
+    void Reject( const uchar* pReqId );
+    void QueueFrame( const uchar* data, uint len );
+    uint NextSlot( uint& board );
+
+    void StartRtt( int board );
+    void SampleRtt( uint board );
+    void TimeoutRtt( uint board );
+    long BoardTimeout( uint board, long defaultTimeout, bool isAck ) const;
+
+    uint ReadFifo( uint addr, uint irq, uchar* data, uint& irq_list );
+    void AssembleCTX( uint octet );
+    void AssembleCRX( uint octet );
+
     void On_CTXE( void );
-    void On_CTX( void );
-    void On_CRX( void );
+    void On_CTX( uint& irq_list );
+    void On_CRX( uint& irq_list );
     void On_EIRQ( void );
     void On_FC( void );
     void On_Timer( void );
@@ -221,6 +603,7 @@ public:
         : semaFull( XPI_XMTR_BUF_SIZE )
         , semaEmpty( 0 )
         , semaSent( 0 )
+        , semaSlots( XPI_XMTR_SLOTS )
     {
         fpgaOK    = false;
         isMCPU    = false;
@@ -238,32 +621,62 @@ public:
 
         eirq_count = 0;
         stuck_eirq_count = 0;
+        poll_steps = 0;
+        fifo_bursts = 0;
+        fifo_octets = 0;
+        fifo_burst_max = 0;
         ResetPollList ();
 
-        sMsg.magicMSB = XPI_MSG_MAGIC_MSB;
-        sMsg.magicLSB = XPI_MSG_MAGIC_LSB;
+        ctxTimeStamp  = 0;
+        ctxLen        = 0;
+        ctxCkSum      = 0xFF;
 
-        sCTX.magicMSB = XPI_MSG_MAGIC_MSB;
-        sCTX.magicLSB = XPI_MSG_MAGIC_LSB;
-        sCTX.type     = XPI_IMSG_TRACE_CTX;
+        crxTimeStamp  = 0;
         crxLen        = 0;
         crxCkSum      = 0xFF;
 
-        sCRX.magicMSB = XPI_MSG_MAGIC_MSB;
-        sCRX.magicLSB = XPI_MSG_MAGIC_LSB;
-        sCRX.type     = XPI_IMSG_TRACE_CRX;
-        ctxLen        = 0;
-        ctxCkSum      = 0xFF;
+        for ( int i = 0; i < XPI_XMTR_SLOTS; i++ )
+            slots[ i ].next = i + 1 < XPI_XMTR_SLOTS ? i + 1 : SC_SLOT_NONE;
+
+        for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+        {
+            scQueue[ i ].head    = SC_SLOT_NONE;
+            scQueue[ i ].tail    = SC_SLOT_NONE;
+            scQueue[ i ].holdoff = 0;
+            }
 
+        freeSlot  = 0;
+        scNext    = 0;
         bufSize   = XPI_XMTR_BUF_SIZE;
-        pRead     = buf;
-        pWrite    = buf;
-        pMax      = buf + bufSize;
+        pRead     = slots[ 0 ].data + 2;
+        isCtxRetry = false;
+
+        for ( int i = 0; i < MAX_BOARD_COUNT; i++ )
+        {
+            scRtt[ i ].srtt8   = 0;
+            scRtt[ i ].rttvar4 = 0;
+            scRtt[ i ].samples = 0;
+            scRtt[ i ].backoff = 0;
+            }
+
+        rttBoard     = -1;
+        rttStartLat  = 0;
+        rttStartTick = 0;
 
         pCtx      = NULL;
         ctx_count = 0;
         ctx_status = 0;
         requestID = 0;
+
+        isCredit     = false;
+        queuedBytes  = 0;
+        queuedFrames = 0;
+        freedBytes   = 0;
+        freedFrames  = 0;
+        baseBytes    = 0;
+        baseFrames   = 0;
+        reportedBytes  = 0;
+        reportedFrames = 0;
         }
 
     void SetTraceMask( int mask )
@@ -278,6 +691,17 @@ public:
     void InitializeFPGA( bool coldStart, bool forcePassive );    
 
     bool Put( void* data, uint len, portTickType xTicksToWait );
+    bool PutBatch( const uchar* data, uint len, uint count, portTickType xTicksToWait );
+
+    bool IsCreditMode( void ) const
+    {
+        return isCredit;
+        }
+
+    void SetCreditMode( bool enable );
+    void ReportCredits( bool force );
+    void GetCredits( ulong& bytes, ushort& frames ) const;
+    uint GetRtt( uchar* data, uint maxLen ) const;
     void Transmitter( void );
     void StartTransmissionIfIdle( void );
     };
@@ -5,18 +5,26 @@
 
 #include "sam7xpud.hpp"
 
+#include <string.h> // memcpy
+
 //---------------------------------------------------------------------------------------
 //      External References
 //---------------------------------------------------------------------------------------
 
 extern portTASK_FUNCTION( MainTimer_Task, pvParameters );
 extern portTASK_FUNCTION( FPGA_IrqTasklet, pvParameters );
+#ifdef USB_ISR_DEFERRED
+extern portTASK_FUNCTION( USB_ServiceTask, pvParameters );
+#endif
 
 //---------------------------------------------------------------------------------------
 //      Module Implementation
 //---------------------------------------------------------------------------------------
 
-static xTaskHandle t1, t2, t3, t4, t5, t6;
+static xTaskHandle t1, t2, t3, t4, t5, t6, t7;
+#ifdef USB_ISR_DEFERRED
+static xTaskHandle t8;
+#endif
 
 //---------------------------------------------------------------------------------------
 // Put character to US1
@@ -46,26 +54,22 @@ void usb_putc( int ch )
     // Note: The implementation is NOT THREAD safe and assumes
     // to be used only from single thread (in this case xsvf main task).
     //
-    static struct ATTR_PACKED : public XPI_IMSG_HEADER 
-    {
-        uchar data[ 128 ];
-        } sMsg;
-
+    static uchar line[ 128 ];
     static volatile size_t dataLen = 0;
 
     if ( ch != '\n' )
     {
-        sMsg.data[ dataLen++ ] = ch;
+        line[ dataLen++ ] = ch;
         }
     
-    if ( ch == '\n' || dataLen >= sizeof( sMsg.data ) )
+    if ( ch == '\n' || dataLen >= sizeof( line ) )
     {
-        sMsg.magicMSB  = XPI_MSG_MAGIC_MSB;
-        sMsg.magicLSB  = XPI_MSG_MAGIC_LSB;
-        sMsg.type      = XPI_IMSG_LOG;
-        sMsg.subtype   = 0;
-        sMsg.timeStamp = dTimerTick;
-        usbOut.Put( &sMsg, sizeof( XPI_IMSG_HEADER) + dataLen, 1000 );
+        XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_LOG, 0, dataLen, 1000 );
+        if ( pMsg )
+        {
+            memcpy( pMsg->data, line, dataLen );
+            usbOut.Commit( pMsg );
+            }
         dataLen = 0;
         }
     };
@@ -124,6 +128,21 @@ int main( void )
         192, NULL, tskIDLE_PRIORITY + 6, &t6 
         );
 
+    xTaskCreate
+    ( 
+        CMDEXEC::MainTask, (const signed portCHAR* const) "CMD", 
+        256, NULL, tskIDLE_PRIORITY + 3, &t7 
+        );
+
+#ifdef USB_ISR_DEFERRED
+    // USB interrupt bottom half: must not be preempted by other tasks
+    xTaskCreate
+    ( 
+        USB_ServiceTask, (const signed portCHAR* const) "USBS", 
+        256, NULL, configMAX_PRIORITIES - 1, &t8 
+        );
+#endif
+
     TRACE_INFO( "--------------------------\n" );
     TRACE_INFO( "Starting FreeRTOS...\n" );
     
@@ -177,6 +196,31 @@ void sysDumpStatus( void )
 {
     tracef( 2, "CPU %3d.%d%%, ", cpu_usage / 10, cpu_usage % 10 );
     tracef( 2, "Heap %d of %d\n", vPortGetMaxHeap (), configTOTAL_HEAP_SIZE );
+
+    usbOut.DumpStatus ();
+    usbIn.DumpStatus ();
+    usbNotify.DumpStatus ();
+    usbClock.DumpStatus ();
+    cmdExec.DumpStatus ();
+
+    uint csrWrites, csrSpins;
+    sSer.GetCsrStatistics( csrWrites, csrSpins );
+    tracef( 2, "USB CSR: %u updates, %u sync polls\n", csrWrites, csrSpins );
+
+#ifdef USB_ISR_DEFERRED
+    const char* usbIsrMode = "deferred";
+#else
+    const char* usbIsrMode = "direct";
+#endif
+    tracef( 2, "USB ISR (%s): max %u us, avg %u us; ", 
+        usbIsrMode, latUsbIsr.MaxUs (), latUsbIsr.AvgUs () );
+    tracef( 2, "FPGA IRQ wake-up: max %u us, avg %u us\n", 
+        latFpgaWake.MaxUs (), latFpgaWake.AvgUs () );
+
+    taskENTER_CRITICAL ();
+    latUsbIsr.Reset ();
+    latFpgaWake.Reset ();
+    taskEXIT_CRITICAL ();
     
     ShowStackFreeSpace( t1 );
     ShowStackFreeSpace( t2 );
@@ -184,4 +228,55 @@ void sysDumpStatus( void )
     ShowStackFreeSpace( t4 );
     ShowStackFreeSpace( t5 );
     ShowStackFreeSpace( t6 );
+    ShowStackFreeSpace( t7 );
+#ifdef USB_ISR_DEFERRED
+    ShowStackFreeSpace( t8 );
+#endif
+    }
+
+//---------------------------------------------------------------------------------------
+// Fills XPI_IMSG_CAPS data (XPI_CAPS_LEN octets); returns the length
+//---------------------------------------------------------------------------------------
+static uchar* PutCap( uchar* p, uint value, int octets )
+{
+    while( octets-- > 0 )
+        *p++ = uchar( value >> ( 8 * octets ) );
+
+    return p;
+    }
+
+uint sysGetCapabilities( uchar* data )
+{
+    uint features = XPI_CAPS_TAGGED | XPI_CAPS_OMSG_FRAMING | XPI_CAPS_IMSG_V2
+                  | XPI_CAPS_NOTIFY | XPI_CAPS_CLOCK_SYNC | XPI_CAPS_CREDITS
+                  | XPI_CAPS_SC_BATCH | XPI_CAPS_VREQ | XPI_CAPS_SC_RTT;
+#ifdef USB_ISR_DEFERRED
+    features |= XPI_CAPS_ISR_DEFERRED;
+#endif
+#ifdef USB_XMTR_LOCKFREE
+    features |= XPI_CAPS_XMTR_LOCKFREE;
+#endif
+#ifdef USB_CSR_SYNC
+    features |= XPI_CAPS_CSR_SYNC;
+#endif
+
+    uchar* p = data;
+    p = PutCap( p, 1, 1 ); // capsVersion
+    p = PutCap( p, verMajor, 1 );
+    p = PutCap( p, verMinor, 1 );
+    p = PutCap( p, verBuild, 2 );
+    p = PutCap( p, USB_XMTR_BUF_SIZE, 2 );
+    p = PutCap( p, USB_RCVR_BUF_SIZE, 2 );
+    p = PutCap( p, USB_RCVR_RING_SIZE, 2 );
+    p = PutCap( p, XPI::XPI_XMTR_BUF_SIZE, 2 );
+    p = PutCap( p, XPI::XPI_XMTR_SLOTS, 2 );
+    p = PutCap( p, XPI::XPI_SC_FRAME_MAX, 1 );
+    p = PutCap( p, XPI::MAX_BOARD_COUNT, 1 );
+    p = PutCap( p, XSVF_SHIFT_MAX, 2 );
+    p = PutCap( p, XSVF_POOL_BUF_SIZE, 2 );
+    p = PutCap( p, XSVF_POOL_BUFS, 1 );
+    p = PutCap( p, CMD_QUEUE_LEN, 1 );
+    p = PutCap( p, features, 4 );
+
+    return p - data;
     }
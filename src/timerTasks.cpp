@@ -92,6 +92,14 @@ portTASK_FUNCTION( MainTimer_Task, pvParameters )
     AT91C_BASE_TC0->TC_RC = ( AT91C_MASTER_CLOCK / 2 ) / 1000;
     AT91C_BASE_TC0->TC_CCR = AT91C_TC_CLKEN;
     AT91C_BASE_TC0->TC_CCR = AT91C_TC_SWTRG;
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // Configure Timer 1: free running at MCK/8, used for latency measurements
+    //
+    AT91F_TC1_CfgPMC ();
+    AT91C_BASE_TC1->TC_CMR = AT91C_TC_CLKS_TIMER_DIV2_CLOCK;
+    AT91C_BASE_TC1->TC_CCR = AT91C_TC_CLKEN;
+    AT91C_BASE_TC1->TC_CCR = AT91C_TC_SWTRG;
     
     taskEXIT_CRITICAL ();
 
@@ -119,10 +127,9 @@ portTASK_FUNCTION( MainTimer_Task, pvParameters )
             // Set green LED and clear yellow and red LED
             //
             taskENTER_CRITICAL ();
-            FPGA_BegWrite ();
-            FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-            FPGA_Write( XPI_W_P0_LED_CLEAR, XPI_LED_G );
-            FPGA_BegRead ();
+            FPGA_BusPage( 0 );
+            FPGA_BusWrite( XPI_W_P0_LED_CLEAR, XPI_LED_G );
+            FPGA_BusEnd ();
             taskEXIT_CRITICAL ();
             }
         
@@ -137,15 +144,17 @@ portTASK_FUNCTION( MainTimer_Task, pvParameters )
             // Set green LED and clear yellow and red LED
             //
             taskENTER_CRITICAL ();
-            FPGA_BegWrite ();
-            FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
-            FPGA_Write( XPI_W_P0_LED_SET, XPI_LED_G );
-            FPGA_BegRead ();
+            FPGA_BusPage( 0 );
+            FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_G );
+            FPGA_BusEnd ();
             taskEXIT_CRITICAL ();
             }
         
         // Snapshot of the CPU usage
         Calc_CPU_Usage_Every1s ();
+
+        // Report the SOF clock model, if updated
+        usbClock.Report ();
         }
     }
 
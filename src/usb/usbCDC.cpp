@@ -111,7 +111,7 @@ static const S_ser_configuration_descriptor sConfiguration =
         USB_ENDPOINT_IN | SER_EPT_NOTIFICATION, //!< IN endpoint, address = 0x03
         ENDPOINT_TYPE_INTERRUPT,            //!< INTERRUPT endpoint type
         64,                                 //!< Maximum packet size is 64 bytes
-        0x10                                //!< Endpoint polled every 10 ms
+        0x01                                //!< Endpoint polled every frame (1 ms)
     },
     //! Data class interface descriptor
     {
@@ -282,6 +282,15 @@ void CCDC::RequestHandler( void )
 
     TRACE_DEBUG_M( "NewReq " );
 
+    // Only class requests are handled here; bRequest codes of standard and
+    // vendor requests may overlap with the CDC ones
+    //
+    if ( USB_REQUEST_TYPE( pSetup->bmRequestType ) != USB_CLASS_REQUEST )
+    {
+        CSTD::RequestHandler ();
+        return;
+    }
+
     // Handle the request
     //
     switch( pSetup->bRequest )
@@ -2,11 +2,7 @@
 //      Includes
 //---------------------------------------------------------------------------------------
 
-#include "usbFramework.hpp"
-#include "usbCDC.hpp"
-
-#include "device.h"
-#include "board.h"
+#include "sam7xpud.hpp"
 
 using namespace USB;
 
@@ -17,25 +13,19 @@ using namespace USB;
 extern void ISR_Wrapper_USB( void );
 extern void ISR_Wrapper_VBus( void );
 
-//---------------------------------------------------------------------------------------
-//      Forward reference to exported object
-//---------------------------------------------------------------------------------------
-
-extern CCDC sSer;
-
-//---------------------------------------------------------------------------------------
-namespace { // UNNAMED
-//---------------------------------------------------------------------------------------
-
 //---------------------------------------------------------------------------------------
 // Handler for the VBus state change interrupt
 // This method calls the CUsbDriver::Attach function to perform the necessary
-// operations.
+// operations. Called from ISR_Wrapper_VBus, so it is not in the unnamed namespace.
 //---------------------------------------------------------------------------------------
 
 void ISR_VBus(void)
 {
+#ifdef USB_ISR_DEFERRED
+    USB_DeferVBusFromISR ();
+#else
     sSer.Attach ();
+#endif
 
     // Acknowledge the interrupt
     //
@@ -43,6 +33,10 @@ void ISR_VBus(void)
     AT91F_AIC_AcknowledgeIt( AT91C_BASE_AIC );
     }
 
+//---------------------------------------------------------------------------------------
+namespace { // UNNAMED
+//---------------------------------------------------------------------------------------
+
 //---------------------------------------------------------------------------------------
 //      Structures and Classes
 //---------------------------------------------------------------------------------------
@@ -214,6 +208,7 @@ void CCallbacks::OnReset( void )
 //---------------------------------------------------------------------------------------
 void CCallbacks::OnStartOfFrame( void )
 {
+    USB_StartOfFrame ();
     }
 
 //---------------------------------------------------------------------------------------
@@ -0,0 +1,85 @@
+// NOTE: This is ARM module (not THUMB).
+// Do not not use -mthumb switch when compiling!
+
+//---------------------------------------------------------------------------------------
+//      Includes
+//---------------------------------------------------------------------------------------
+
+#include "common.h"
+
+// Type of the UDP_FDR endpoint FIFO data register. Host tests include this file
+// with a model of the FIFO instead.
+//
+#ifndef UDP_FIFO_REG
+#define UDP_FIFO_REG volatile uint
+#endif
+
+//---------------------------------------------------------------------------------------
+//      Exported Functions
+//---------------------------------------------------------------------------------------
+
+//---------------------------------------------------------------------------------------
+// UDP endpoint FIFO copy kernels used by CUdpDriver::WritePayload() and GetPayload()
+// from the USB interrupt. They run in ARM mode from RAM (.fastrun section is copied
+// to RAM by the startup code), so there are no flash wait states in the copy loop.
+// Loops are unrolled by 8; the remainder is handled by falling through the switch.
+// The circular buffer wrap is handled by the caller with two linear copies.
+//
+void UDP_WriteFifo( UDP_FIFO_REG* pFDR, const uchar* pSrc, uint dBytes )
+    __attribute__((section(".fastrun")));
+void UDP_ReadFifo( UDP_FIFO_REG* pFDR, uchar* pDst, uint dBytes )
+    __attribute__((section(".fastrun")));
+
+//---------------------------------------------------------------------------------------
+
+void UDP_WriteFifo( UDP_FIFO_REG* pFDR, const uchar* pSrc, uint dBytes )
+{
+    for ( ; dBytes >= 8; dBytes -= 8, pSrc += 8 )
+    {
+        *pFDR = pSrc[ 0 ];
+        *pFDR = pSrc[ 1 ];
+        *pFDR = pSrc[ 2 ];
+        *pFDR = pSrc[ 3 ];
+        *pFDR = pSrc[ 4 ];
+        *pFDR = pSrc[ 5 ];
+        *pFDR = pSrc[ 6 ];
+        *pFDR = pSrc[ 7 ];
+        }
+
+    switch( dBytes )
+    {
+        case 7: *pFDR = *pSrc++;
+        case 6: *pFDR = *pSrc++;
+        case 5: *pFDR = *pSrc++;
+        case 4: *pFDR = *pSrc++;
+        case 3: *pFDR = *pSrc++;
+        case 2: *pFDR = *pSrc++;
+        case 1: *pFDR = *pSrc++;
+        }
+    }
+
+void UDP_ReadFifo( UDP_FIFO_REG* pFDR, uchar* pDst, uint dBytes )
+{
+    for ( ; dBytes >= 8; dBytes -= 8, pDst += 8 )
+    {
+        pDst[ 0 ] = uchar( *pFDR );
+        pDst[ 1 ] = uchar( *pFDR );
+        pDst[ 2 ] = uchar( *pFDR );
+        pDst[ 3 ] = uchar( *pFDR );
+        pDst[ 4 ] = uchar( *pFDR );
+        pDst[ 5 ] = uchar( *pFDR );
+        pDst[ 6 ] = uchar( *pFDR );
+        pDst[ 7 ] = uchar( *pFDR );
+        }
+
+    switch( dBytes )
+    {
+        case 7: *pDst++ = uchar( *pFDR );
+        case 6: *pDst++ = uchar( *pFDR );
+        case 5: *pDst++ = uchar( *pFDR );
+        case 4: *pDst++ = uchar( *pFDR );
+        case 3: *pDst++ = uchar( *pFDR );
+        case 2: *pDst++ = uchar( *pFDR );
+        case 1: *pDst++ = uchar( *pFDR );
+        }
+    }
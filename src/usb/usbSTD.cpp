@@ -22,6 +22,24 @@ void CSTD::RequestHandler( void )
 
     TRACE_DEBUG_M( "Std " );
 
+    // Vendor requests are passed to the application, out of band of the
+    // data endpoints
+    //
+    if ( USB_REQUEST_TYPE( pSetup->bmRequestType ) == USB_VENDOR_REQUEST )
+    {
+        TRACE_DEBUG_M( "Vnd " );
+
+        if ( ! fVendorRequest || ! fVendorRequest( pDriver, pSetup ) )
+        {
+            TRACE_WARNING(
+                "W: STD::RequestHandler: Unsupported Vendor Request 0x%02X\n",
+                pSetup->bRequest
+            );
+            pDriver->Stall ();
+        }
+        return;
+    }
+
     // Handle incoming request
     //
     switch( pSetup->bRequest )
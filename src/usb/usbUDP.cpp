@@ -11,6 +11,15 @@
 
 using namespace USB;
 
+//---------------------------------------------------------------------------------------
+//      External References
+//---------------------------------------------------------------------------------------
+
+// FIFO copy kernels (ARM mode, RAM resident); see usbFifo.cpp
+//
+extern void UDP_WriteFifo( volatile uint* pFDR, const uchar* pSrc, uint dBytes );
+extern void UDP_ReadFifo( volatile uint* pFDR, uchar* pDst, uint dBytes );
+
 //---------------------------------------------------------------------------------------
 //      Structures and Classes
 //---------------------------------------------------------------------------------------
@@ -23,7 +32,9 @@ class CUdpDriver : public CUsbDriver
         UDP_EPTYPE_INDEX                = 8,
         UDP_EPDIR_INDEX                 = 10,
 
-        ISR_MASK                        = 0x00003FFF
+        ISR_MASK                        = 0x00003FFF,
+
+        CSR_SYNC_POLLS_MAX              = 32  //!< Bound of UDP_CSR polls in SyncEndpointFlags
     };
 
     //-----------------------------------------------------------------------------------
@@ -33,6 +44,7 @@ class CUdpDriver : public CUsbDriver
     AT91PS_UDP  pInterface;   //!< Pointer to the USB controller peripheral
     uint        dID;          //!< ID of the USB controller peripheral
     uint        dPMC;         //!< ID to enable the USB controller peripheral clock
+    uint        dCsrPending;  //!< Endpoints with UDP_CSR update not yet synchronized
 
 public:
     //-----------------------------------------------------------------------------------
@@ -51,6 +63,8 @@ public:
         pInterface = controller;
         dID        = ctrlID;
         dPMC       = ctrlPMC;
+
+        dCsrPending = 0;
     };
     
 private:
@@ -59,25 +73,39 @@ private:
     //-----------------------------------------------------------------------------------
 
     //-----------------------------------------------------------------------------------
-    //! \brief  Clear flags in the UDP_CSR register and waits for synchronization
+    //! \brief  Waits for synchronization of the UDP_CSR update started by 
+    //!         ClearEndpointFlags() or SetEndpointFlags()
+    //! \details Due to synchronization between MCK and UDPCK, the software 
+    //! application must wait for the end of the write operation before executing 
+    //! another write by polling the bits which must be set/cleared.
+    //! The wait is deferred until the next write of the register, the next access
+    //! to the endpoint FIFO, or the end of the interrupt handler pass, so it is 
+    //! usually over by then.
+    //! The hardware may change the flags back right after the write is done 
+    //! (TXPKTRDY is cleared once the packet is sent, RX_DATA_BKx and TXCOMP are set
+    //! by the next packet), so the expected value may never be seen. The poll is 
+    //! bounded by CSR_SYNC_POLLS_MAX, which is well above the 3 UDPCK and 3 MCK 
+    //! cycles that the write takes.
+    //! \see    Section 35.6.10 UDP Endpoint CSR in AT91SAM7 datasheet (doc6175.pdf)
     //! \param  bEndpoint Index of endpoint
-    //! \param  dFlags    Flags to clear
     //-----------------------------------------------------------------------------------
-    inline void ClearEndpointFlags( int bEndpoint, uint dFlags )
+    inline void SyncEndpointFlags( int bEndpoint )
     {
-        AT91_REG& UDP_CSR = pInterface->UDP_CSR[ bEndpoint ];
-        
-        if ( ( UDP_CSR & dFlags ) == 0 )
+        if ( ISCLEARED( dCsrPending, 1 << bEndpoint ) )
             return;
 
-        UDP_CSR &= ~dFlags;
+        CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
+        AT91_REG& UDP_CSR = pInterface->UDP_CSR[ bEndpoint ];
 
-        // WARNING: Due to synchronization between MCK and UDPCK, the software 
-        // application must wait for the end of the write operation before executing 
-        // another write by polling the bits which must be set/cleared.
-        // \see Section 35.6.10 UDP Endpoint CSR in AT91SAM7 datasheet (doc6175.pdf)
-        //
-        do ; while( ( UDP_CSR & dFlags ) != 0 );
+        for ( int i = 0; i < CSR_SYNC_POLLS_MAX; i++ )
+        {
+            if ( ( UDP_CSR & pEndpoint->dCsrMask ) == pEndpoint->dCsrValue )
+                break;
+
+            ++dCsrSpins;
+        }
+
+        CLEAR( dCsrPending, 1 << bEndpoint );
 
         // Note: In a preemptive environment, set or clear the flag and wait for a time 
         // of 1 UDPCK clock cycle and 1 peripheral clock cycle. However, RX_DATA_BK0, 
@@ -86,30 +114,78 @@ private:
     }
 
     //-----------------------------------------------------------------------------------
-    //! \brief  Set flags in the UDP_CSR register and waits for synchronization
+    //! \brief  Waits for synchronization of all pending UDP_CSR updates
+    //-----------------------------------------------------------------------------------
+    void SyncAllEndpointFlags( void )
+    {
+        for ( int bEndpoint = 0; dCsrPending != 0; bEndpoint++ )
+            SyncEndpointFlags( bEndpoint );
+    }
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Marks UDP_CSR update as pending synchronization
+    //! \param  bEndpoint Index of endpoint
+    //! \param  dMask     Flags being updated
+    //! \param  dValue    Expected value of the flags
+    //-----------------------------------------------------------------------------------
+    inline void DeferEndpointFlags( int bEndpoint, uint dMask, uint dValue )
+    {
+        CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
+
+        pEndpoint->dCsrMask  = dMask;
+        pEndpoint->dCsrValue = dValue;
+        SET( dCsrPending, 1 << bEndpoint );
+        ++dCsrWrites;
+
+#ifdef USB_CSR_SYNC
+        // Wait for synchronization right away
+        //
+        SyncEndpointFlags( bEndpoint );
+#endif
+    }
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Clear flags in the UDP_CSR register
     //! \param  bEndpoint Index of endpoint
     //! \param  dFlags    Flags to clear
+    //! \see    SyncEndpointFlags
+    //-----------------------------------------------------------------------------------
+    inline void ClearEndpointFlags( int bEndpoint, uint dFlags )
+    {
+        AT91_REG& UDP_CSR = pInterface->UDP_CSR[ bEndpoint ];
+        
+        // Previous write must be completed first
+        //
+        SyncEndpointFlags( bEndpoint );
+
+        if ( ( UDP_CSR & dFlags ) == 0 )
+            return;
+
+        UDP_CSR &= ~dFlags;
+
+        DeferEndpointFlags( bEndpoint, dFlags, 0 );
+    }
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Set flags in the UDP_CSR register
+    //! \param  bEndpoint Index of endpoint
+    //! \param  dFlags    Flags to set
+    //! \see    SyncEndpointFlags
     //-----------------------------------------------------------------------------------
     inline void SetEndpointFlags( int bEndpoint, uint dFlags )
     {
         AT91_REG& UDP_CSR = pInterface->UDP_CSR[ bEndpoint ];
 
+        // Previous write must be completed first
+        //
+        SyncEndpointFlags( bEndpoint );
+
         if ( ( UDP_CSR & dFlags ) == dFlags )
             return;
 
         UDP_CSR |= dFlags;
 
-        // WARNING: Due to synchronization between MCK and UDPCK, the software 
-        // application must wait for the end of the write operation before executing 
-        // another write by polling the bits which must be set/cleared.
-        // \see Section 35.6.10 UDP Endpoint CSR in AT91SAM7 datasheet (doc6175.pdf)
-        //
-        do ; while ( ( UDP_CSR & dFlags ) != dFlags );
-
-        // Note: In a preemptive environment, set or clear the flag and wait for a time 
-        // of 1 UDPCK clock cycle and 1 peripheral clock cycle. However, RX_DATA_BK0, 
-        // TXPKTRDY, RX_DATA_BK1 require wait times of 3 UDPCK clock cycles and 3 
-        // peripheral clock cycles before accessing DPR.
+        DeferEndpointFlags( bEndpoint, dFlags, dFlags );
     }
 
     //-----------------------------------------------------------------------------------
@@ -182,7 +258,11 @@ private:
     uint WritePayload( int bEndpoint )
     {
         CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
-        AT91_REG& FDR = pInterface->UDP_FDR[ bEndpoint ];
+        AT91_REG* pFDR = &pInterface->UDP_FDR[ bEndpoint ];
+
+        // TXPKTRDY must be synchronized before accessing the FIFO
+        //
+        SyncEndpointFlags( bEndpoint );
 
         // Get the number of bytes to send
         //
@@ -196,8 +276,8 @@ private:
         {
             // Send data from the flat buffer (or inner part of circular buffer)
             //
-            for( uint dCtr = 0; dCtr < dBytes; dCtr++ )
-                FDR = *pEndpoint->pData++;
+            UDP_WriteFifo( pFDR, pEndpoint->pData, dBytes );
+            pEndpoint->pData += dBytes;
         }
         else 
         {
@@ -206,13 +286,10 @@ private:
             uint len2 = pEndpoint->pData + dBytes - pEndpoint->pDataUpperBound;
             uint len1 = dBytes - len2;
 
-            for( uint i = 0; i < len1; i++ )
-                FDR = *pEndpoint->pData++;
-
-            pEndpoint->pData = pEndpoint->pDataLowerBound;
+            UDP_WriteFifo( pFDR, pEndpoint->pData, len1 );
+            UDP_WriteFifo( pFDR, pEndpoint->pDataLowerBound, len2 );
 
-            for( uint i = 0; i < len2; i++ )
-                FDR = *pEndpoint->pData++;
+            pEndpoint->pData = pEndpoint->pDataLowerBound + len2;
         }
 
         pEndpoint->dBytesBuffered  += dBytes;
@@ -231,7 +308,11 @@ private:
     uint GetPayload( int bEndpoint, ushort wPacketSize )
     {
         CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
-        AT91_REG& FDR = pInterface->UDP_FDR[ bEndpoint ];
+        AT91_REG* pFDR = &pInterface->UDP_FDR[ bEndpoint ];
+
+        // RX_DATA_BKx must be synchronized before accessing the FIFO
+        //
+        SyncEndpointFlags( bEndpoint );
 
         TRACE_DEBUG_L( "%d ", wPacketSize );
 
@@ -239,11 +320,28 @@ private:
         //
         uint dBytes = min( pEndpoint->dBytesRemaining, wPacketSize );
 
-        // Retrieve packet
+        // Are we doing flat transfer or transfer across circular buffer upper boundary?
         //
-        for( uint dCtr = 0; dCtr < dBytes; dCtr++ )
+        if ( ! pEndpoint->pDataLowerBound 
+             || pEndpoint->pData + dBytes < pEndpoint->pDataUpperBound 
+            ) 
+        {
+            // Retrieve packet into the flat buffer (or inner part of circular buffer)
+            //
+            UDP_ReadFifo( pFDR, pEndpoint->pData, dBytes );
+            pEndpoint->pData += dBytes;
+        }
+        else
         {
-            *pEndpoint->pData++ = uchar( FDR );
+            // Retrieve packet by crossing upper boundary of the circular buffer
+            //
+            uint len2 = pEndpoint->pData + dBytes - pEndpoint->pDataUpperBound;
+            uint len1 = dBytes - len2;
+
+            UDP_ReadFifo( pFDR, pEndpoint->pData, len1 );
+            UDP_ReadFifo( pFDR, pEndpoint->pDataLowerBound, len2 );
+
+            pEndpoint->pData = pEndpoint->pDataLowerBound + len2;
         }
 
         pEndpoint->dBytesRemaining   -= dBytes;
@@ -339,6 +437,18 @@ private:
         const void* pDataLowerBound, const void* pDataUpperBound
         );
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Sends data through an USB endpoint after the current transfer.
+    //! \see    CUsbDriver::WriteNext
+    //-----------------------------------------------------------------------------------
+    EnumStandardReturnValue WriteNext
+    ( 
+        int bEndpoint,
+        const void* pData, uint dLength,
+        Callback_f fCallback, void* pArgument, 
+        const void* pDataLowerBound, const void* pDataUpperBound
+        );
+
     //-----------------------------------------------------------------------------------
     //! \brief  Receives data on the specified USB endpoint.
     //! \details This functions receives data on a particular endpoint. It finishes either
@@ -352,6 +462,8 @@ private:
     //! \param  fCallback Optional user-provided callback function invoked upon the
     //!                   transfer completion
     //! \param  pArgument Optional parameter to pass to the callback function
+    //! \param  pDataLowerBound Lower bound of the circular buffer
+    //! \param  pDataUpperBound Upper bound of the circular buffer
     //! \return Result of operation
     //! \see    EnumStandardReturnValue
     //-----------------------------------------------------------------------------------
@@ -359,7 +471,8 @@ private:
     (
         int bEndpoint,
         void* pData, uint dLength,
-        Callback_f fCallback, void* pArgument
+        Callback_f fCallback, void* pArgument,
+        void* pDataLowerBound, void* pDataUpperBound
         );
 
     //-----------------------------------------------------------------------------------
@@ -388,6 +501,19 @@ private:
     //-----------------------------------------------------------------------------------
     void RemoteWakeUp( void );
 
+    //-----------------------------------------------------------------------------------
+    //! \brief  Enables or disables the SOF interrupt
+    //-----------------------------------------------------------------------------------
+    void EnableSOF( bool enable );
+
+    //-----------------------------------------------------------------------------------
+    //! \brief  Returns the frame number of the last received SOF
+    //-----------------------------------------------------------------------------------
+    uint GetFrameNumber( void )
+    {
+        return pInterface->UDP_NUM & AT91C_UDP_FRM_NUM;
+    }
+
     //-----------------------------------------------------------------------------------
     //! \brief  Configures the specified endpoint using the provided endpoint
     //!         descriptor.
@@ -526,6 +652,7 @@ void CUdpDriver::ResetEndpoints( void )
         pEndpoint->dBytesBuffered = 0;
         pEndpoint->fCallback = 0;
         pEndpoint->pArgument = 0;
+        pEndpoint->bNextQueued = false;
 
         // Configure endpoint characteristics
         //
@@ -559,6 +686,8 @@ void CUdpDriver::DisableEndpoints( void )
 void CUdpDriver::EndpointHandler( int bEndpoint )
 {
     CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
+
+    SyncEndpointFlags( bEndpoint );
     uint dCSR = pInterface->UDP_CSR[ bEndpoint ];
 
     TRACE_DEBUG_L( "Ept%d ", bEndpoint);
@@ -602,6 +731,18 @@ void CUdpDriver::EndpointHandler( int bEndpoint )
                 }
 
                 pEndpoint->EndOfTransfer( USB_STATUS_SUCCESS );
+
+                // Start the transfer queued by WriteNext() right away
+                //
+                if ( pEndpoint->bNextQueued )
+                {
+                    pEndpoint->bNextQueued = false;
+
+                    Write( bEndpoint, pEndpoint->pNextData, pEndpoint->dNextLength,
+                           pEndpoint->fNextCallback, pEndpoint->pNextArgument,
+                           pEndpoint->pNextLowerBound, pEndpoint->pNextUpperBound
+                           );
+                }
             }
             else 
             {
@@ -838,6 +979,8 @@ bool CUdpDriver::ConfigureEndpoint( const S_usb_endpoint_descriptor* pEpDesc )
     // Configure endpoint
     // Do not use SetEndpointFlags() here!
     //
+    SyncEndpointFlags( bEndpoint );
+
     AT91_REG& UDP_CSR = pInterface->UDP_CSR[ bEndpoint ];
     TRACE_DEBUG_L( "CfgEpt%d(%08X->", bEndpoint, UDP_CSR );
     
@@ -993,6 +1136,10 @@ void CUdpDriver::EventHandler( void )
             SetState( USB_STATE_DEFAULT );
             EnableTransceiver ();
 
+            // UDP_CSR registers are reset; nothing to synchronize
+            //
+            dCsrPending = 0;
+
             // The device leaves the Address and Configured states
             //
             ClearState( USB_STATE_ADDRESS | USB_STATE_CONFIGURED );
@@ -1038,6 +1185,10 @@ void CUdpDriver::EventHandler( void )
             }
         }
 
+        // Interrupt flags must be cleared before the status is read again
+        //
+        SyncAllEndpointFlags ();
+
         // Retrieve new interrupt status
         //
         dISR = pInterface->UDP_ISR & pInterface->UDP_IMR & ISR_MASK;
@@ -1122,6 +1273,11 @@ EnumStandardReturnValue CUdpDriver::Write
         WritePayload( bEndpoint );
     }
 
+    // TXPKTRDY is cleared by the hardware when the packet is sent, so its
+    // synchronization is not left pending to the endpoint handler
+    //
+    SyncEndpointFlags( bEndpoint );
+
     // Enable interrupt on endpoint
     //
     SET( pInterface->UDP_IER, 1 << bEndpoint );
@@ -1129,6 +1285,64 @@ EnumStandardReturnValue CUdpDriver::Write
     return USB_STATUS_SUCCESS;
 }
 
+//---------------------------------------------------------------------------------------
+//! \brief   Sends data through an USB endpoint after the current transfer
+//! \details If the endpoint is idle, the transfer is started immediately.
+//!          Otherwise, while the endpoint is in Write state, the transfer
+//!          descriptor is queued and the transfer is started by the endpoint
+//!          interrupt handler when the current transfer completes.
+//!          Must be called with the endpoint interrupt masked.
+//! \param   bEndpoint Index of endpoint
+//! \param   pData     Pointer to a buffer containing the data to send
+//! \param   dLength   Length of the data buffer
+//! \param   fCallback Optional function to invoke when the transfer finishes
+//! \param   pArgument Optional argument for the callback function
+//! \param   pDataLowerBound Lower bound of the circular buffer
+//! \param   pDataUpperBound Upper bound of the circular buffer
+//! \return  Operation result code
+//! \see     EnumStandardReturnValue
+//! \see     Callback_f
+//---------------------------------------------------------------------------------------
+EnumStandardReturnValue CUdpDriver::WriteNext
+(
+    int bEndpoint,
+    const void* pData, uint dLength,
+    Callback_f fCallback, void* pArgument,
+    const void* pDataLowerBound, const void* pDataUpperBound
+    )
+{
+    CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
+
+    // Start the transfer if the endpoint is in Idle state
+    //
+    if ( pEndpoint->dState == CEndpoint::StateIdle )
+    {
+        return Write( bEndpoint, pData, dLength, fCallback, pArgument,
+                      pDataLowerBound, pDataUpperBound );
+    }
+
+    // Only one transfer can be queued, and only behind a write
+    //
+    if ( pEndpoint->dState != CEndpoint::StateWrite || pEndpoint->bNextQueued )
+    {
+        return USB_STATUS_LOCKED;
+    }
+
+    TRACE_DEBUG_M( "Next%d%4d ", bEndpoint, dLength );
+
+    // Setup the next transfer descriptor
+    //
+    pEndpoint->pNextData       = pData;
+    pEndpoint->dNextLength     = dLength;
+    pEndpoint->fNextCallback   = fCallback;
+    pEndpoint->pNextArgument   = pArgument;
+    pEndpoint->pNextLowerBound = pDataLowerBound;
+    pEndpoint->pNextUpperBound = pDataUpperBound;
+    pEndpoint->bNextQueued     = true;
+
+    return USB_STATUS_SUCCESS;
+}
+
 //---------------------------------------------------------------------------------------
 //! \brief   Reads incoming data on an USB endpoint
 //! \details This methods sets the transfer descriptor and activate the endpoint
@@ -1141,6 +1355,8 @@ EnumStandardReturnValue CUdpDriver::Write
 //! \param   dLength   Length of the receive buffer
 //! \param   fCallback Optional callback function
 //! \param   pArgument Optional callback argument
+//! \param   pDataLowerBound Lower bound of the circular buffer
+//! \param   pDataUpperBound Upper bound of the circular buffer
 //! \return  Operation result code
 //! \see     Callback_f
 //---------------------------------------------------------------------------------------
@@ -1148,7 +1364,8 @@ EnumStandardReturnValue CUdpDriver::Read
 (
     int bEndpoint,
     void* pData, uint dLength,
-    Callback_f fCallback, void* pArgument
+    Callback_f fCallback, void* pArgument,
+    void* pDataLowerBound, void* pDataUpperBound
     )
 {
     CEndpoint* pEndpoint = &pEndpoints[ bEndpoint ];
@@ -1178,6 +1395,8 @@ EnumStandardReturnValue CUdpDriver::Read
     pEndpoint->dBytesTransferred = 0;
     pEndpoint->fCallback         = fCallback;
     pEndpoint->pArgument         = pArgument;
+    pEndpoint->pDataLowerBound   = (uchar*) pDataLowerBound;
+    pEndpoint->pDataUpperBound   = (uchar*) pDataUpperBound;
 
     // If there is data left earlier in FIFO buffer, get it and exit immediatelly.
     //
@@ -1193,6 +1412,7 @@ EnumStandardReturnValue CUdpDriver::Read
         if ( pEndpoint->dBytesBuffered == 0 )
         {
             ClearRXFlag( bEndpoint );
+            SyncEndpointFlags( bEndpoint );
         }
 
         // Note that end-of-read callback will not be called in interrupt context!
@@ -1238,6 +1458,7 @@ bool CUdpDriver::Halt( int bEndpoint, int bRequest )
         // Clear FORCESTALL flag
         //
         ClearEndpointFlags( bEndpoint, AT91C_UDP_FORCESTALL );
+        SyncEndpointFlags( bEndpoint );
 
         // Reset Endpoint FIFOs, beware this is a 2 steps operation
         //
@@ -1262,6 +1483,7 @@ bool CUdpDriver::Halt( int bEndpoint, int bRequest )
         // Put endpoint into Halt state
         //
         SetEndpointFlags( bEndpoint, AT91C_UDP_FORCESTALL );
+        SyncEndpointFlags( bEndpoint );
         pEndpoint->dState = CEndpoint::StateHalted;
 
         // Enable the endpoint interrupt
@@ -1296,6 +1518,7 @@ EnumStandardReturnValue CUdpDriver::Stall( int bEndpoint )
     TRACE_DEBUG_L( "Stall%d ", bEndpoint );
 
     SetEndpointFlags( bEndpoint, AT91C_UDP_FORCESTALL );
+    SyncEndpointFlags( bEndpoint );
 
     return USB_STATUS_SUCCESS;
 }
@@ -1320,6 +1543,26 @@ void CUdpDriver::RemoteWakeUp( void )
     CLEAR( pInterface->UDP_GLBSTATE, AT91C_UDP_ESR );
 }
 
+//---------------------------------------------------------------------------------------
+//! \brief  Enables or disables the SOF interrupt
+//! \details The setting is kept over bus resets. Must be called with interrupts
+//!          disabled if called outside of the USB interrupt.
+//---------------------------------------------------------------------------------------
+void CUdpDriver::EnableSOF( bool enable )
+{
+    useSOFCallback = enable;
+
+    if ( enable )
+    {
+        SET( pInterface->UDP_ICR, AT91C_UDP_SOFINT );
+        SET( pInterface->UDP_IER, AT91C_UDP_SOFINT );
+    }
+    else
+    {
+        SET( pInterface->UDP_IDR, AT91C_UDP_SOFINT );
+    }
+}
+
 //---------------------------------------------------------------------------------------
 //! \brief  Handles attachment or detachment from the USB when the VBus power
 //!         line status changes.
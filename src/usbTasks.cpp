@@ -1,12 +1,14 @@
 
 #include "sam7xpud.hpp"
 
-#include <string.h> // memcmp
+#include <string.h> // memcmp, memcpy
 
 //---------------------------------------------------------------------------------------
 
 USBXMTR usbOut;
 USBRCVR usbIn;
+USBNOTIFY usbNotify;
+USBCLOCK usbClock;
 
 //---------------------------------------------------------------------------------------
 // Handler for the USB controller interrupt
@@ -15,8 +17,16 @@ USBRCVR usbIn;
 
 volatile portBASE_TYPE isTaskWokenByPostInUsbIrq = pdFALSE;
 
+LATENCY latUsbIsr;
+
+#ifndef USB_ISR_DEFERRED
+
 void ISR_USB( void )
 {
+    uint dStart = LAT_Now ();
+
+    usbClock.Capture ();
+
     isTaskWokenByPostInUsbIrq = pdFALSE;
 
     // USB_Handler may also call callbacks established by SER_Read()/SER_Write()
@@ -25,6 +35,8 @@ void ISR_USB( void )
 
     AT91F_AIC_AcknowledgeIt( AT91C_BASE_AIC );
 
+    latUsbIsr.Add( dStart );
+
     // If an event caused a task to unblock then we call "Yield from ISR" to ensure 
     // that the unblocked task is the task that executes when the interrupt completes
     // if the unblocked task has a priority higher than the interrupted task.
@@ -33,29 +45,199 @@ void ISR_USB( void )
         portYIELD_FROM_ISR();
     }
 
-//---------------------------------------------------------------------------------------
-// USBXMTR
-//---------------------------------------------------------------------------------------
+#else // USB_ISR_DEFERRED
 
-portTASK_FUNCTION( USBXMTR::MainTask, pvParameters )
+static xSEMA usbEvent;
+
+static volatile bool isVBusEventPending = false;
+
+// Top half: masks the UDP interrupt until USB_ServiceTask has handled it.
+// UDP_ISR is kept latched by the UDP itself and read by sSer.EventHandler().
+//
+void ISR_USB( void )
+{
+    uint dStart = LAT_Now ();
+
+    usbClock.Capture ();
+
+    AT91F_AIC_DisableIt( AT91C_BASE_AIC, AT91C_ID_UDP );
+
+    portBASE_TYPE isTaskWokenByPost = pdFALSE;
+
+    if ( usbEvent.ReleaseFromISR( 1, isTaskWokenByPost ) )
+    {
+        isTaskWokenByPost = pdTRUE;
+        }
+
+    AT91F_AIC_AcknowledgeIt( AT91C_BASE_AIC );
+
+    latUsbIsr.Add( dStart );
+
+    if( isTaskWokenByPost )
+        portYIELD_FROM_ISR();
+    }
+
+// Called from ISR_VBus: CUsbDriver::Attach() is deferred to USB_ServiceTask too,
+// as it changes the driver state.
+//
+void USB_DeferVBusFromISR( void )
+{
+    isVBusEventPending = true;
+
+    if ( usbEvent.ReleaseFromISR( 1, pdFALSE ) )
+        portYIELD_FROM_ISR();
+    }
+
+// Bottom half: runs the USB event processing with interrupts enabled.
+// The scheduler is suspended meanwhile, so tasks calling sSer.Read()/Write() in 
+// critical sections still see the driver state changed atomically, just as with
+// the processing done in ISR_USB.
+//
+portTASK_FUNCTION( USB_ServiceTask, pvParameters )
 {
     (void) pvParameters; // The parameters are not used.
 
-#ifdef TR_INFO    
-    taskENTER_CRITICAL ();
-    TRACE_INFO( "USBXMTR: Main Task\n" );
-    taskEXIT_CRITICAL ();
-#endif
+    for( ;; )
+    {
+        if ( ! usbEvent.Wait( 1, 1000 ) )
+            continue;
 
-    usbOut.Initialize ();
+        vTaskSuspendAll ();
 
-    for(;;)
+        isTaskWokenByPostInUsbIrq = pdFALSE;
+
+        if ( isVBusEventPending )
+        {
+            isVBusEventPending = false;
+            sSer.Attach ();
+            }
+
+        sSer.EventHandler ();
+
+        // Tasks woken up by the callbacks are made ready here
+        //
+        xTaskResumeAll ();
+
+        AT91F_AIC_EnableIt( AT91C_BASE_AIC, AT91C_ID_UDP );
+        }
+    }
+
+#endif // USB_ISR_DEFERRED
+
+//---------------------------------------------------------------------------------------
+// Handler of the XPI_VREQ vendor requests on endpoint 0
+// Runs in the USB interrupt (or in USB_ServiceTask), so the commands must not block.
+//---------------------------------------------------------------------------------------
+
+static XPI_VREQ_STATUS_REPLY vreqStatus; // Written to EP0 asynchronously
+static uchar vreqCmdStatus;
+static uchar vreqClock[ USB_CLOCK_MODEL_LEN ];
+static uchar vreqCaps[ XPI_CAPS_LEN ];
+
+static bool USB_VendorRequest( USB::CUsbDriver* pDriver, const USB::S_usb_request* pSetup )
+{
+    bool isIn = USB_REQUEST_DIR( pSetup->bmRequestType ) == USB::USB_DIR_DEVICE2HOST;
+
+    switch( pSetup->bRequest )
     {
-        usbOut.Transmitter ();
+        //-------------------------------------------------------------------------------
+        case XPI_VREQ_STATUS:
+        {
+            if ( ! isIn )
+                return false;
+
+            vreqStatus.timeStamp  = dTimerTick;
+            vreqStatus.flags      = ( xpi.IsFpgaOK () ? XPI_VREQ_ST_FPGA_OK : 0 )
+                                  | ( usbIn.IsFramed () ? XPI_VREQ_ST_OMSG_FRAMING : 0 );
+            vreqStatus.cmdPending = uchar( cmdExec.GetPending () );
+            vreqStatus.cmdDone    = uchar( cmdExec.GetDoneCount () );
+            vreqStatus.cmdStatus  = cmdExec.GetLastStatus ();
+            vreqStatus.rxUsed     = ushort( usbIn.GetUsed () );
+            vreqStatus.reserved   = 0;
+
+            ulong freedBytes;
+            ushort freedFrames;
+            xpi.GetCredits( freedBytes, freedFrames );
+            vreqStatus.scFreedBytes  = freedBytes;
+            vreqStatus.scFreedFrames = freedFrames;
+
+            pDriver->Write( 0, &vreqStatus, 
+                min( sizeof( vreqStatus ), uint( pSetup->wLength ) ) );
+            }
+            return true;
+
+        //-------------------------------------------------------------------------------
+        case XPI_VREQ_LOG_CFG:
+        {
+            if ( isIn )
+                return false;
+
+            xpi.SetTraceMask( pSetup->wValue );
+            pDriver->SendZLP0 ();
+            }
+            return true;
+
+        //-------------------------------------------------------------------------------
+        case XPI_VREQ_FC_CMD:
+        {
+            if ( ! isIn || pSetup->wIndex < 1 || pSetup->wIndex > 2 )
+                return false;
+
+            uchar data[ 2 ];
+            data[ 0 ] = uchar( pSetup->wValue );
+            data[ 1 ] = uchar( pSetup->wValue >> 8 );
+
+            signed portBASE_TYPE isTaskWoken = pdFALSE;
+
+            USB_CALLBACK_ENTER ();
+
+            bool posted = cmdExec.PostFromISR( XPI_OMSG_FC_CMD, 0, 
+                                               data, pSetup->wIndex, -1, isTaskWoken );
+
+            USB_CALLBACK_EXIT ();
+
+            if ( isTaskWoken )
+                isTaskWokenByPostInUsbIrq = pdTRUE;
+
+            vreqCmdStatus = posted ? XPI_CMD_OK : XPI_CMD_BUSY;
+            pDriver->Write( 0, &vreqCmdStatus, min( 1u, uint( pSetup->wLength ) ) );
+            }
+            return true;
+
+        //-------------------------------------------------------------------------------
+        case XPI_VREQ_CLOCK:
+        {
+            if ( ! isIn || ! usbClock.IsEnabled () || ! usbClock.GetModel( vreqClock ) )
+                return false;
+
+            pDriver->Write( 0, vreqClock, 
+                min( sizeof( vreqClock ), uint( pSetup->wLength ) ) );
+            }
+            return true;
+
+        //-------------------------------------------------------------------------------
+        case XPI_VREQ_CAPS:
+        {
+            if ( ! isIn )
+                return false;
+
+            uint len = sysGetCapabilities( vreqCaps );
+
+            pDriver->Write( 0, vreqCaps, min( len, uint( pSetup->wLength ) ) );
+            }
+            return true;
         }
+
+    return false;
     }
 
-bool USBXMTR::Put( void* data, uint len, portTickType xTicksToWait )
+//---------------------------------------------------------------------------------------
+// USBXMTR_LANE
+//---------------------------------------------------------------------------------------
+
+#ifndef USB_XMTR_LOCKFREE
+
+bool USBXMTR_LANE::Put( void* data, uint len, portTickType xTicksToWait )
 {
     // Wait enough space to fit 2-byte length + data
     //
@@ -110,93 +292,1242 @@ bool USBXMTR::Put( void* data, uint len, portTickType xTicksToWait )
     //
     UnlockWrite ();
 
+    pOwner->Notify ();
+
     return true;
     }
 
-void USBXMTR:: Transmitter( void )
+uchar* USBXMTR_LANE::Reserve( uint len, portTickType xTicksToWait, ushort* pSeq )
 {
-    // Wait 2-byte header
+    if ( len > USB_XMTR_RESERVE_MAX )
+        return NULL;
+
+    // Wait enough space to fit 2-byte length + data
     //
-    do ; while( ! semaEmpty.Wait( 2, 1000 ) );
+    if ( ! semaFull.Wait( len + 2, xTicksToWait ) )
+        return NULL;
 
-    // Retrieve data length from packet header
+    // Lock pWrite mutex; unlocked by Commit()
     //
-    uint len = *pRead++;
-    if ( pRead >= pMax )
-        pRead = buf;
-    len = ( len << 8 ) + *pRead++;
-    if ( pRead >= pMax )
-        pRead = buf;
+    LockWrite ();
 
-    // Wait the rest of data
+    reservedLen = len;
+
+    // Sequence number is taken under the pWrite mutex, in the order of packets;
+    // seqNo is shared with the other lane, which has its own mutex
     //
-    do ; while( ! semaEmpty.Wait( len, 1000 ) );
+    if ( pSeq )
+    {
+        taskENTER_CRITICAL ();
+        *pSeq = pOwner->seqNo++;
+        taskEXIT_CRITICAL ();
+        }
 
-    // Send data over USB
+    return pWrite + 2;
+    }
+
+void USBXMTR_LANE::Commit( void* data )
+{
+    (void) data; // Packet is known from reservedLen
+
+    uint len = reservedLen;
+
+    // Put 2-byte length in front of the data: MSB first
     //
-    bool isSent = false;
+    pWrite[ 0 ] = ( len >> 8 ) & 0xFF;
+    pWrite[ 1 ] = len & 0xFF;
 
-    for ( int i = 0; i < 100; i++ )
+    pWrite += len + 2;
+
+    if ( pWrite >= pMax )
     {
+        // Move part of the packet built over pMax to the beginning of 
+        // the circular buffer
+        //
+        uint len2 = pWrite - pMax;
+        memcpy( buf, pMax, len2 );
+        pWrite = buf + len2;
+        }
+
+    // Notify Transmitter()
+    //
+    semaEmpty.Release( len + 2 );
+
+    // Unlock pWrite mutex
+    //
+    UnlockWrite ();
+
+    pOwner->Notify ();
+    }
+
+int USBXMTR_LANE::Poll( void )
+{
+    return semaEmpty.GetCount () >= 2 ? READY : EMPTY;
+    }
+
+void USBXMTR_LANE::Skip( void )
+{
+    }
+
+void USBXMTR_LANE::Take( uint len )
+{
+    // Complete packet was released by the producer at once
+    //
+    do ; while( ! semaEmpty.Wait( len + 2, 1000 ) );
+    }
+
+uint USBXMTR_LANE::FreeLength( uint len )
+{
+    return len;
+    }
+
+void USBXMTR_LANE::FreeSpace( uint len )
+{
+    semaFull.Release( len );
+    }
+
+signed portBASE_TYPE USBXMTR_LANE::FreeSpaceFromISR
+(
+    uint len,
+    signed portBASE_TYPE xTaskPreviouslyWoken
+    )
+{
+    return semaFull.ReleaseFromISR( len, xTaskPreviouslyWoken );
+    }
+
+#else // USB_XMTR_LOCKFREE
+
+uchar* USBXMTR_LANE::TryReserve( uint len, bool fromISR, bool countWaiter, ushort* pSeq )
+{
+    uint need = len + 2;
+
+    if ( ! fromISR )
         taskENTER_CRITICAL ();
-        int rc = sSer.Write( pRead, len, Callback_f( OnSendCompleted ), this, buf, pMax );
-        taskEXIT_CRITICAL ();
 
-        if ( rc == USB::USB_STATUS_SUCCESS )
-        {
-            isSent = true;
-            break;
-            }
+    // An empty lane starts over at the beginning of the buffer, so that a packet
+    // of up to bufSize octets fits. Transmitter() reads pRead only while packets
+    // are in the buffer (or in critical sections, in Poll()).
+    //
+    if ( used == 0 )
+        pRead = pWrite = buf;
 
-        // USB endopoint is not ready; wait and retry
+    // Packet must be linear; skip the rest of buffer if it does not fit below pMax
+    //
+    uchar* p = pWrite;
+    uint skip = p + need > pMax ? pMax - p : 0;
+
+    if ( used + skip + need > bufSize )
+    {
+        // Buffer full; let FreeSpace() know that someone waits for space
         //
-        vTaskDelay( 1 );
+        if ( countWaiter )
+            ++spaceWaiters;
 
-        if ( i == 0 )
+        p = NULL;
+        }
+    else
+    {
+        if ( skip >= 2 )
         {
-#ifdef TR_ERROR
-            taskENTER_CRITICAL ();
-            TRACE_ERROR( "USBXMTR: Write failed\n" );
-            taskEXIT_CRITICAL ();
-#endif
+            p[ 0 ] = USB_XMTR_SKIP_MSB;
+            p[ 1 ] = USB_XMTR_SKIP_LSB;
             }
+
+        if ( skip > 0 )
+            p = buf;
+
+        p[ 0 ] = USB_XMTR_PENDING | ( ( len >> 8 ) & 0x7F );
+        p[ 1 ] = len & 0xFF;
+
+        used  += skip + need;
+        pWrite = p + need < pMax ? p + need : buf;
+
+        if ( pSeq )
+            *pSeq = pOwner->seqNo++;
+
+        p += 2;
+        }
+
+    if ( ! fromISR )
+        taskEXIT_CRITICAL ();
+
+    return p;
+    }
+
+uchar* USBXMTR_LANE::Acquire( uint len, portTickType xTicksToWait, ushort* pSeq )
+{
+    for(;;)
+    {
+        // Fast path: space is available
+        //
+        uchar* p = TryReserve( len, false, xTicksToWait > 0, pSeq );
+        if ( p != NULL )
+            return p;
+
+        // Slow path: wait for Transmitter() to free some space and retry
+        //
+        if ( xTicksToWait == 0 || ! semaFull.Wait( 1, xTicksToWait ) )
+            return NULL;
         }
+    }
+
+bool USBXMTR_LANE::Put( void* data, uint len, portTickType xTicksToWait )
+{
+    if ( len + 2 > bufSize )
+        return false;
+
+    uchar* p = Acquire( len, xTicksToWait, NULL );
+    if ( p == NULL )
+        return false;
 
-    // Wait for transmission to end
+    memcpy( p, data, len );
+
+    Commit( p );
+
+    return true;
+    }
+
+uchar* USBXMTR_LANE::Reserve( uint len, portTickType xTicksToWait, ushort* pSeq )
+{
+    if ( len > USB_XMTR_RESERVE_MAX )
+        return NULL;
+
+    return Acquire( len, xTicksToWait, pSeq );
+    }
+
+void USBXMTR_LANE::Commit( void* data )
+{
+    // Clear pending flag in len_MSB
+    //
+    taskENTER_CRITICAL ();
+    ( (uchar*) data )[ -2 ] &= ~USB_XMTR_PENDING;
+    taskEXIT_CRITICAL ();
+
+    pOwner->Notify ();
+    }
+
+signed portBASE_TYPE USBXMTR_LANE::CommitFromISR
+(
+    void* data,
+    signed portBASE_TYPE xTaskPreviouslyWoken
+    )
+{
+    // Clear pending flag in len_MSB
     //
-    if ( isSent )
+    ( (uchar*) data )[ -2 ] &= ~USB_XMTR_PENDING;
+
+    if ( pOwner->OnCommit () )
+        return pOwner->semaReady.ReleaseFromISR( 1, xTaskPreviouslyWoken );
+
+    return xTaskPreviouslyWoken;
+    }
+
+int USBXMTR_LANE::Poll( void )
+{
+    if ( used == held )
+        return EMPTY;
+
+    if ( pRead + 1 >= pMax 
+        || ( pRead[ 0 ] == USB_XMTR_SKIP_MSB && pRead[ 1 ] == USB_XMTR_SKIP_LSB ) 
+        )
     {
-        do ; while( ! semaSent.Wait( 1, 1000 ) );
+        return SKIP;
+        }
 
-        if ( bStatus != USB::USB_STATUS_SUCCESS ) 
-        {
-#ifdef TR_ERROR
-            taskENTER_CRITICAL ();
-            TRACE_ERROR( "USBXMTR: Transfer error\n" );
-            taskEXIT_CRITICAL ();
-#endif
-            }
-        else
-        {
-#ifdef TR_DEBUG_M
-            taskENTER_CRITICAL ();
-            TRACE_DEBUG_M( "USBXMTR: Sent %5u, %5u; RC = %d\n", 
-                    dBytesTransferred, dBytesRemaining, bStatus );
-            taskEXIT_CRITICAL ();
-#endif            
-            }
+    return ( pRead[ 0 ] & USB_XMTR_PENDING ) ? EMPTY : READY;
+    }
+
+void USBXMTR_LANE::Skip( void )
+{
+    // Padding is freed together with the packets that follow it, as the space
+    // of the packets in front of it may still be in use by the USB driver
+    //
+    uint len = pMax - pRead;
+    pRead = buf;
+    skipped += len;
+
+    taskENTER_CRITICAL ();
+    held += len;
+    taskEXIT_CRITICAL ();
+    }
+
+void USBXMTR_LANE::Take( uint len )
+{
+    // Committed packet is always complete
+    //
+    taskENTER_CRITICAL ();
+    held += len + 2;
+    taskEXIT_CRITICAL ();
+    }
+
+uint USBXMTR_LANE::FreeLength( uint len )
+{
+    len += skipped;
+    skipped = 0;
+    return len;
+    }
+
+void USBXMTR_LANE::FreeSpace( uint len )
+{
+    taskENTER_CRITICAL ();
+
+    used -= len;
+    held -= len;
+
+    uint waiters = spaceWaiters;
+    spaceWaiters = 0;
+
+    taskEXIT_CRITICAL ();
+
+    // Wake up producers waiting for space
+    //
+    if ( waiters > 0 )
+        semaFull.Release( waiters );
+    }
+
+signed portBASE_TYPE USBXMTR_LANE::FreeSpaceFromISR
+(
+    uint len,
+    signed portBASE_TYPE xTaskPreviouslyWoken
+    )
+{
+    used -= len;
+    held -= len;
+
+    uint waiters = spaceWaiters;
+    spaceWaiters = 0;
+
+    if ( waiters > 0 )
+        return semaFull.ReleaseFromISR( waiters, xTaskPreviouslyWoken );
+
+    return xTaskPreviouslyWoken;
+    }
+
+#endif // USB_XMTR_LOCKFREE
+
+uint USBXMTR_LANE::PeekLength( void ) const
+{
+    uchar* pLSB = pRead + 1;
+    if ( pLSB >= pMax )
+        pLSB = buf;
+
+    return ( uint( *pRead ) << 8 ) + *pLSB;
+    }
+
+//---------------------------------------------------------------------------------------
+// USBXMTR
+//---------------------------------------------------------------------------------------
+
+portTASK_FUNCTION( USBXMTR::MainTask, pvParameters )
+{
+    (void) pvParameters; // The parameters are not used.
+
+#ifdef TR_INFO    
+    taskENTER_CRITICAL ();
+    TRACE_INFO( "USBXMTR: Main Task\n" );
+    taskEXIT_CRITICAL ();
+#endif
+
+    usbOut.Initialize ();
+
+    for(;;)
+    {
+        usbOut.Transmitter ();
+        }
+    }
+
+bool USBXMTR::Put( void* data, uint len, portTickType xTicksToWait, int i )
+{
+    if ( lane[ i ]->Put( data, len, xTicksToWait ) )
+        return true;
+
+    // Account drop by XPI_IMSG type, if data looks like XPI_IMSG
+    //
+    XPI_IMSG_HEADER* pMsg = (XPI_IMSG_HEADER*) data;
+
+    if ( len >= sizeof( XPI_IMSG_HEADER )
+        && pMsg->magicMSB == XPI_MSG_MAGIC_MSB 
+        && pMsg->magicLSB == XPI_MSG_MAGIC_LSB 
+        )
+    {
+        OnDrop( pMsg->type );
+        }
+    else
+    {
+        OnDrop( XPI_IMSG_NULL );
+        }
+
+    return false;
+    }
+
+XPI_IMSG* USBXMTR::BeginMsg
+(
+    uchar type, 
+    uchar subtype, 
+    uint dataLen, 
+    portTickType xTicksToWait 
+    )
+{
+    bool withSeq = isSeqEnabled;
+
+    // Sequence number is taken by the lane with the space of the message, so
+    // that numbers are in the order in which the lane sends the messages
+    //
+    ushort seq;
+
+    XPI_IMSG* pMsg = (XPI_IMSG*) lane[ LaneOf( type ) ]->Reserve( 
+            sizeof( XPI_IMSG_HEADER ) + dataLen + ( withSeq ? 2 : 0 ), xTicksToWait, &seq );
+
+    if ( pMsg == NULL )
+    {
+        // A dropped message leaves a gap, which XPI_IMSG_LOST reports; a report
+        // that did not fit is retried and takes no number.
+        //
+        if ( type != XPI_IMSG_LOST )
+        {
+            taskENTER_CRITICAL ();
+            ++seqNo;
+            taskEXIT_CRITICAL ();
+            }
+
+        OnDrop( type );
+        return NULL;
+        }
+
+    pMsg->magicMSB  = XPI_MSG_MAGIC_MSB;
+    pMsg->magicLSB  = XPI_MSG_MAGIC_LSB;
+    pMsg->type      = type;
+    pMsg->subtype   = subtype;
+    pMsg->timeStamp = dTimerTick;
+
+    if ( withSeq )
+    {
+        pMsg->data[ dataLen ]     = ( seq >> 8 ) & 0xFF;
+        pMsg->data[ dataLen + 1 ] = seq & 0xFF;
+        }
+
+    return pMsg;
+    }
+
+void USBXMTR::OnDrop( uchar type )
+{
+    // A report that did not fit is not a new loss: the counts it carries stay
+    // pending and ReportDrops() retries after the next transfer.
+    //
+    if ( type == XPI_IMSG_LOST )
+        return;
+
+    if ( type >= USB_XMTR_TYPES )
+        type = XPI_IMSG_NULL;
+
+    taskENTER_CRITICAL ();
+
+    ++dropTotal[ type ];
+
+    if ( dropPending[ type ] < 0xFFFF )
+        ++dropPending[ type ];
+
+    isDropPending = true;
+
+    taskEXIT_CRITICAL ();
+    }
+
+// Sends XPI_IMSG_LOST with the number of messages dropped since the last report.
+// Does not wait for space; the report is retried after the next transfer.
+//
+void USBXMTR::ReportDrops( void )
+{
+    ushort count[ USB_XMTR_TYPES ];
+    int n = 0;
+
+    taskENTER_CRITICAL ();
+
+    for ( int i = 0; i < USB_XMTR_TYPES; i++ )
+    {
+        count[ i ] = dropPending[ i ];
+        if ( count[ i ] )
+            ++n;
+        }
+
+    taskEXIT_CRITICAL ();
+
+    if ( n == 0 )
+    {
+        isDropPending = false;
+        return;
+        }
+
+    XPI_IMSG* pMsg = BeginMsg( XPI_IMSG_LOST, 0, 3 * n, 0 );
+    if ( pMsg == NULL )
+        return;
+
+    uchar* pData = pMsg->data;
+
+    taskENTER_CRITICAL ();
+
+    bool isMore = false;
+
+    for ( int i = 0; i < USB_XMTR_TYPES; i++ )
+    {
+        if ( count[ i ] )
+        {
+            *pData++ = i;
+            *pData++ = ( count[ i ] >> 8 ) & 0xFF;
+            *pData++ = count[ i ] & 0xFF;
+
+            dropPending[ i ] -= count[ i ];
+            }
+
+        if ( dropPending[ i ] )
+            isMore = true;
+        }
+
+    isDropPending = isMore;
+
+    taskEXIT_CRITICAL ();
+
+    Commit( pMsg );
+    }
+
+void USBXMTR::DumpStatus( void )
+{
+    tracef( 2, "USB: Seq %u, Lost:", seqNo );
+
+    for ( int i = 0; i < USB_XMTR_TYPES; i++ )
+    {
+        if ( dropTotal[ i ] )
+            tracef( 2, " %02x:%lu", i, dropTotal[ i ] );
+        }
+
+    tracef( 2, "\n" );
+    }
+
+// Returns the highest priority lane with a complete packet ready, waiting for
+// at most xTicksToWait. If pCurrent is given, the packet must continue the batch
+// taken from pCurrent; otherwise NULL is returned.
+//
+USBXMTR_LANE* USBXMTR::WaitLane( portTickType xTicksToWait, USBXMTR_LANE* pCurrent )
+{
+    for(;;)
+    {
+        USBXMTR_LANE* pLane = NULL;
+        int status = USBXMTR_LANE::EMPTY;
+
+        taskENTER_CRITICAL ();
+
+        for ( int i = 0; i < USB_XMTR_LANES; i++ )
+        {
+            status = lane[ i ]->Poll ();
+            if ( status != USBXMTR_LANE::EMPTY )
+            {
+                pLane = lane[ i ];
+                break;
+                }
+            }
+
+        if ( pLane == NULL )
+            dataWaiter = true;
+
+        taskEXIT_CRITICAL ();
+
+        if ( pLane != NULL )
+        {
+            if ( pCurrent != NULL && pLane != pCurrent )
+                return NULL; // Other lane has data; end the batch
+
+            if ( status == USBXMTR_LANE::READY )
+                return pLane;
+
+            // Packets that follow are not contiguous with the current batch
+            //
+            if ( pCurrent != NULL )
+                return NULL;
+
+            pLane->Skip ();
+            continue;
+            }
+
+        // Wait for a producer to notify us
+        //
+        if ( xTicksToWait == 0 || ! semaReady.Wait( 1, xTicksToWait ) )
+            return NULL;
+        }
+    }
+
+void USBXMTR::OnSendCompleted
+(
+    USBXMTR* pThis,
+    uchar bStatus,
+    uint dBytesTransferred,
+    uint dBytesRemaining
+    )
+{
+    // Keep the error until WaitSent() reports it
+    //
+    if ( bStatus != USB::USB_STATUS_SUCCESS )
+        pThis->bStatus = bStatus;
+
+    pThis->dBytesTransferred = dBytesTransferred;
+    pThis->dBytesRemaining = dBytesRemaining;
+
+    // Release space of the completed transfer back to its lane and unblock
+    // producers waiting for more space
+    //
+    USB_CALLBACK_ENTER ();
+
+    if ( pThis->sentCount > 0 )
+    {
+        SENT& s = pThis->sent[ pThis->sentHead ];
+
+        pThis->sentHead = ( pThis->sentHead + 1 ) % USB_XMTR_INFLIGHT;
+        --pThis->sentCount;
+
+        isTaskWokenByPostInUsbIrq = 
+            s.pLane->FreeSpaceFromISR( s.len, isTaskWokenByPostInUsbIrq );
+        }
+
+    if ( pThis->semaSent.ReleaseFromISR( 1, isTaskWokenByPostInUsbIrq ) )
+    {
+        isTaskWokenByPostInUsbIrq = pdTRUE;
+        }
+
+    USB_CALLBACK_EXIT ();
+    }
+
+// Waits until at most maxInFlight transfers are still in progress
+//
+void USBXMTR::WaitSent( uint maxInFlight )
+{
+    while ( sentCount > maxInFlight )
+        semaSent.Wait( 1, 1000 );
+
+    if ( bStatus != USB::USB_STATUS_SUCCESS ) 
+    {
+#ifdef TR_ERROR
+        taskENTER_CRITICAL ();
+        TRACE_ERROR( "USBXMTR: Transfer error\n" );
+        taskEXIT_CRITICAL ();
+#endif
+        bStatus = USB::USB_STATUS_SUCCESS;
+        }
+    else
+    {
+#ifdef TR_DEBUG_M
+        taskENTER_CRITICAL ();
+        TRACE_DEBUG_M( "USBXMTR: Sent %5u, %5u; RC = %d\n", 
+                dBytesTransferred, dBytesRemaining, bStatus );
+        taskEXIT_CRITICAL ();
+#endif            
+        }
+    }
+
+// Re-encodes in place the batch of span octets of MSGBUF packets at pStart
+// using v2 framing (see XPI_USB_CFG_FRAMING). Every record is encoded in no more
+// octets than its packet, so the output never overruns the packets not yet read,
+// except for the magic in front of the first record: if the first record does 
+// not fit, the batch is left in v1 framing. Returns the length of the batch.
+//
+uint USBXMTR::Compact( USBXMTR_LANE* pLane, uchar* pStart, uint span )
+{
+    uchar* pIn  = pStart;
+    uchar* pOut = pStart;
+    uint inLeft = span;
+    uint outLen = 0;
+    ulong prevTimeStamp = 0;
+
+    while ( inLeft > 0 )
+    {
+        // Read MSGBUF length and XPI_IMSG header
+        //
+        uchar in[ 2 + sizeof( XPI_IMSG_HEADER ) ];
+
+        in[ 0 ] = *pIn; pIn = pLane->Next( pIn );
+        in[ 1 ] = *pIn; pIn = pLane->Next( pIn );
+
+        uint len = ( uint( in[ 0 ] ) << 8 ) + in[ 1 ];
+        uint hdrLen = len < sizeof( XPI_IMSG_HEADER ) ? len : sizeof( XPI_IMSG_HEADER );
+
+        uchar* pBody = pIn;
+
+        for ( uint i = 0; i < hdrLen; i++ )
+        {
+            in[ 2 + i ] = *pIn; 
+            pIn = pLane->Next( pIn );
+            }
+
+        inLeft -= len + 2;
+
+        XPI_IMSG_HEADER* pHdr = (XPI_IMSG_HEADER*)( in + 2 );
+
+        bool isMsg = hdrLen == sizeof( XPI_IMSG_HEADER )
+            && pHdr->magicMSB == XPI_MSG_MAGIC_MSB
+            && pHdr->magicLSB == XPI_MSG_MAGIC_LSB
+            && pHdr->type < USB_XMTR_TYPES;
+
+        // Build v2 record header
+        //
+        uchar out[ 16 ];
+        uint n = 0;
+
+        if ( outLen == 0 )
+        {
+            out[ n++ ] = XPI_MSG_MAGIC_MSB;
+            out[ n++ ] = XPI_V2_MAGIC_LSB;
+            }
+
+        uint inHdrLen = 2;
+        uint dataLen = len;
+        uchar* pData = pBody;
+
+        if ( isMsg )
+        {
+            inHdrLen = 2 + sizeof( XPI_IMSG_HEADER );
+            dataLen = len - sizeof( XPI_IMSG_HEADER );
+            pData = pIn;
+
+            uint subtype = pHdr->subtype;
+            out[ n++ ] = ( pHdr->type << 3 ) | ( subtype < 7 ? subtype : 7 );
+            if ( subtype >= 7 )
+                out[ n++ ] = subtype;
+
+            ulong timeStamp;
+            memcpy( &timeStamp, &pHdr->timeStamp, sizeof( timeStamp ) );
+
+            int dts = int( timeStamp - prevTimeStamp );
+            prevTimeStamp = timeStamp;
+
+            ulong values[ 2 ] = { dataLen, ( ulong( dts ) << 1 ) ^ ulong( dts >> 31 ) };
+
+            for ( int i = 0; i < 2; i++ )
+            {
+                ulong v = values[ i ];
+                for ( ; v >= 0x80; v >>= 7 )
+                    out[ n++ ] = uchar( v | 0x80 );
+                out[ n++ ] = uchar( v );
+                }
+            }
+        else
+        {
+            out[ n++ ] = 0x80 | ( len >> 8 );
+            out[ n++ ] = len & 0xFF;
+            }
+
+        if ( outLen == 0 && n > inHdrLen )
+            return span; // First record does not fit; keep v1
+
+        // Write record header and move data down
+        //
+        for ( uint i = 0; i < n; i++ )
+        {
+            *pOut = out[ i ];
+            pOut = pLane->Next( pOut );
+            }
+
+        for ( uint i = 0; i < dataLen; i++ )
+        {
+            *pOut = *pData;
+            pOut = pLane->Next( pOut );
+            pData = pLane->Next( pData );
+            }
+
+        pIn = pData;
+        outLen += n + dataLen;
+        }
+
+    return outLen;
+    }
+
+// Hands len octets at data over to the USB driver. freeLen octets are released
+// back to the lane when the transfer completes.
+//
+bool USBXMTR::Send( USBXMTR_LANE* pLane, uchar* data, uint len, uint freeLen )
+{
+    // In streaming mode, the transfer is queued behind the one in progress
+    //
+    WaitSent( isStreaming ? USB_XMTR_INFLIGHT - 1 : 0 );
+
+    // Send data over USB
+    //
+    bool isSent = false;
+
+    for ( int i = 0; i < 100; i++ )
+    {
+        taskENTER_CRITICAL ();
+
+        int rc = sSer.WriteNext( data, len, Callback_f( OnSendCompleted ), this, 
+                pLane->buf, pLane->pMax );
+
+        if ( rc == USB::USB_STATUS_SUCCESS )
+        {
+            SENT& s = sent[ ( sentHead + sentCount ) % USB_XMTR_INFLIGHT ];
+            s.pLane = pLane;
+            s.len   = freeLen;
+            ++sentCount;
+            }
+
+        taskEXIT_CRITICAL ();
+
+        if ( rc == USB::USB_STATUS_SUCCESS )
+        {
+            isSent = true;
+            break;
+            }
+
+        // USB endopoint is not ready; wait and retry
+        //
+        vTaskDelay( 1 );
+
+        if ( i == 0 )
+        {
+#ifdef TR_ERROR
+            taskENTER_CRITICAL ();
+            TRACE_ERROR( "USBXMTR: Write failed\n" );
+            taskEXIT_CRITICAL ();
+#endif
+            }
+        }
+
+    if ( ! isSent )
+    {
+        // Data is lost; release its space
+        //
+        pLane->FreeSpace( freeLen );
+        }
+    else if ( ! isStreaming )
+    {
+        // Wait for transmission to end
+        //
+        WaitSent( 0 );
+        }
+
+    return isSent;
+    }
+
+void USBXMTR:: Transmitter( void )
+{
+    // Wait for a packet in the highest priority lane
+    //
+    USBXMTR_LANE* pLane;
+    do ; while( ( pLane = WaitLane( 1000, NULL ) ) == NULL );
+
+    uint maxBytes = coalesceMax;
+    bool isV2 = isCompact;
+
+    if ( maxBytes == 0 && ! isV2 )
+    {
+        // Retrieve data length from packet header
+        //
+        uint len = pLane->PeekLength ();
+        pLane->Take( len );
+
+        uchar* pData = pLane->pRead + 2;
+        if ( pData >= pLane->pMax )
+            pData -= pLane->bufSize;
+
+        // Advance pRead
+        //
+        pLane->pRead = pData + len;
+        if ( pLane->pRead >= pLane->pMax )
+            pLane->pRead -= pLane->bufSize;
+
+        // Space is released back to circular buffer when the transfer completes
+        //
+        Send( pLane, pData, len, pLane->FreeLength( len + 2 ) );
+
+        // Report lost messages now that there is some space
+        //
+        if ( isDropPending )
+            ReportDrops ();
+        return;
+        }
+
+    // Coalesce complete packets of the lane, headers included, into a single 
+    // transfer. The first packet is always taken, even if it exceeds the budget.
+    //
+    uchar* pStart = pLane->pRead;
+    uint span = 0;
+    uint count = 0;
+
+    portTickType maxDelay = coalesceDelay;
+    portTickType tStart = xTaskGetTickCount ();
+
+    for(;;)
+    {
+        uint len = pLane->PeekLength ();
+
+        if ( span > 0 && span + len + 2 > maxBytes )
+            break; // Packet does not fit; leave it for the next transfer
+
+        pLane->Take( len );
+
+        span += len + 2;
+        ++count;
+        pLane->pRead += len + 2;
+        if ( pLane->pRead >= pLane->pMax )
+            pLane->pRead -= pLane->bufSize;
+
+        if ( span >= maxBytes )
+            break;
+
+        // Take packets already queued without waiting
+        //
+        if ( WaitLane( 0, pLane ) != NULL )
+            continue;
+
+        // Lane is idle. A lone packet is flushed at once; the batch is held 
+        // until the flush deadline only while more data keeps arriving.
+        //
+        if ( count == 1 )
+            break;
+
+        portTickType elapsed = xTaskGetTickCount () - tStart;
+        portTickType timeout = elapsed < maxDelay ? maxDelay - elapsed : 0;
+
+        if ( WaitLane( timeout, pLane ) == NULL )
+            break;
+        }
+
+    // Space is released back to circular buffer when the transfer completes
+    //
+    uint len = isV2 ? Compact( pLane, pStart, span ) : span;
+
+    Send( pLane, pStart, len, pLane->FreeLength( span ) );
+
+    // Report lost messages now that there is some space
+    //
+    if ( isDropPending )
+        ReportDrops ();
+    }
+
+//---------------------------------------------------------------------------------------
+// USBNOTIFY
+//---------------------------------------------------------------------------------------
+
+// Starts sending the pending SERIAL_STATE or the next event, if the endpoint
+// is idle. Called with interrupts disabled or from the USB callback.
+//
+void USBNOTIFY::Start( void )
+{
+    if ( isBusy || ! enabled )
+        return;
+
+    if ( isStatePending )
+    {
+        serialState.hdr.bmRequestType = 0xA1;
+        serialState.hdr.bNotification = USB::CDC_NOTIFICATION_SERIAL_STATE;
+        serialState.hdr.wValue        = 0;
+        serialState.hdr.wIndex        = 0;
+        serialState.hdr.wLength       = 2;
+        serialState.data[ 0 ]         = uchar( wState );
+        serialState.data[ 1 ]         = uchar( wState >> 8 );
+
+        if ( sSer.Notify( &serialState, sizeof( USB::S_cdc_notification ) + 2, 
+                Callback_f( OnSent ), this ) == USB::USB_STATUS_SUCCESS )
+        {
+            isStatePending = false;
+            isSendingState = true;
+            isBusy = true;
+            }
+        }
+    else if ( count > 0 )
+    {
+        EVENT& e = queue[ head ];
+
+        if ( sSer.Notify( &e, sizeof( USB::S_cdc_notification ) + e.hdr.wLength, 
+                Callback_f( OnSent ), this ) == USB::USB_STATUS_SUCCESS )
+        {
+            isBusy = true;
+            }
+        }
+    }
+
+void USBNOTIFY::OnSent
+(
+    USBNOTIFY* pThis,
+    uchar bStatus,
+    uint dBytesTransferred,
+    uint dBytesRemaining
+    )
+{
+    (void) bStatus; // Failed notifications are dropped as well
+    (void) dBytesTransferred;
+    (void) dBytesRemaining;
+
+    USB_CALLBACK_ENTER ();
+
+    pThis->isBusy = false;
+
+    if ( pThis->isSendingState )
+    {
+        pThis->isSendingState = false;
+        }
+    else if ( pThis->count > 0 )
+    {
+        pThis->head = ( pThis->head + 1 ) % USB_NOTIFY_QUEUE_LEN;
+        pThis->count--;
+        pThis->sent++;
+        }
+
+    pThis->Start ();
+
+    USB_CALLBACK_EXIT ();
+    }
+
+void USBNOTIFY::Enable( bool enable )
+{
+    taskENTER_CRITICAL ();
+
+    enabled = enable;
+
+    if ( enabled )
+    {
+        wState |= XPI_SERIAL_STATE_DCD | XPI_SERIAL_STATE_DSR;
+        isStatePending = true;
+        Start ();
+        }
+    else
+    {
+        // Keep only the event in flight, if any
+        //
+        count = isBusy && ! isSendingState && count > 0 ? 1 : 0;
+        isStatePending = false;
+        }
+
+    taskEXIT_CRITICAL ();
+    }
+
+void USBNOTIFY::Event( uchar type, uchar subtype, const uchar* data, uint len )
+{
+    if ( ! enabled )
+        return;
+
+    if ( len > USB_NOTIFY_DATA_MAX )
+        len = USB_NOTIFY_DATA_MAX;
+
+    taskENTER_CRITICAL ();
+
+    if ( count >= USB_NOTIFY_QUEUE_LEN )
+    {
+        lost++;
+        }
+    else
+    {
+        EVENT& e = queue[ ( head + count ) % USB_NOTIFY_QUEUE_LEN ];
+
+        e.hdr.bmRequestType = 0xA1;
+        e.hdr.bNotification = XPI_NOTIFY_EVENT;
+        e.hdr.wValue        = type | ( subtype << 8 );
+        e.hdr.wIndex        = 0;
+        e.hdr.wLength       = len;
+        memcpy( e.data, data, len );
+
+        count++;
+
+        Start ();
+        }
+
+    taskEXIT_CRITICAL ();
+    }
+
+void USBNOTIFY::SetState( ushort mask, bool set )
+{
+    taskENTER_CRITICAL ();
+
+    ushort newState = set ? ( wState | mask ) : ( wState & ~mask );
+
+    if ( newState != wState )
+    {
+        wState = newState;
+        isStatePending = true;
+        Start ();
+        }
+
+    taskEXIT_CRITICAL ();
+    }
+
+void USBNOTIFY::Watermark( ushort bit, uint used, uint size )
+{
+    if ( used >= size - size / 4 )
+    {
+        if ( ! ( wState & bit ) )
+            SetState( bit, true );
+        }
+    else if ( used <= size / 2 )
+    {
+        if ( wState & bit )
+            SetState( bit, false );
+        }
+    }
+
+void USBNOTIFY::DumpStatus( void )
+{
+    tracef( 2, "USB NT: %s, Sent %u, Lost %u, State %04x\n", 
+        enabled ? "On" : "Off", sent, lost, wState );
+    }
+
+//---------------------------------------------------------------------------------------
+// USBCLOCK
+//---------------------------------------------------------------------------------------
+
+void USBCLOCK::Enable( bool enable )
+{
+    taskENTER_CRITICAL ();
+
+    enabled      = enable;
+    isLatched    = false;
+    isValid      = false;
+    isDriftValid = false;
+    isReportDue  = false;
+    drift        = 0;
+
+    sSer.EnableSOF( enable );
+
+    taskEXIT_CRITICAL ();
+    }
+
+// Samples device time and frame number. Interrupts must be disabled.
+//
+void USBCLOCK::Latch( void )
+{
+    uint cv = AT91C_BASE_TC0->TC_CV;
+    ulong tick = dTimerTick;
+
+    // TC0 has already wrapped, but ISR_Timer0 is held off
+    //
+    if ( ( AT91C_BASE_AIC->AIC_IPR & ( 1 << AT91C_ID_TC0 ) ) 
+        && cv < AT91C_BASE_TC0->TC_RC / 2 )
+    {
+        tick++;
+        }
+
+    latchFrame = AT91C_BASE_UDP->UDP_NUM & AT91C_UDP_FRM_NUM;
+    latchTick  = tick;
+    latchCV    = cv;
+    isLatched  = true;
+    }
+
+void USBCLOCK::OnStartOfFrame( void )
+{
+    if ( ! enabled )
+        return;
+
+    if ( ! isLatched )
+        Latch ();
+
+    isLatched = false;
+
+    ulong tick = latchTick;
+    uint us = latchCV * 1000 / AT91C_BASE_TC0->TC_RC;
+
+    uint dFrames = ( latchFrame - lastFrame ) & AT91C_UDP_FRM_NUM;
+    lastFrame = latchFrame;
+
+    // Start over after a gap in SOFs (e.g. suspend), as the frame count is lost
+    //
+    if ( ! isValid || dFrames > 16 )
+    {
+        frame    = latchFrame;
+        refFrame = frame;
+        refTick  = tick;
+        refUs    = us;
+        winStart = frame;
+        minRes   = 0x7FFFFFFF;
+        isValid  = true;
+        return;
+        }
+
+    frame += dFrames;
+
+    // Residual of the sample against the model; ISR latency only makes it later
+    //
+    long frames = long( frame - refFrame );
+    long elapsed = long( tick - refTick ) * 1000 + long( us ) - long( refUs );
+    long res = elapsed - frames * 1000 - long( (long long)frames * drift / 1000000 );
+
+    if ( res < minRes )
+    {
+        minRes   = res;
+        minFrame = frame;
+        minTick  = tick;
+        minUs    = us;
+        }
+
+    if ( frame - winStart < USB_CLOCK_WINDOW )
+        return;
+
+    // End of window: the least delayed sample becomes the new reference
+    //
+    frames = long( minFrame - refFrame );
+    elapsed = long( minTick - refTick ) * 1000 + long( minUs ) - long( refUs );
+
+    if ( frames >= USB_CLOCK_WINDOW / 2 )
+    {
+        long d = long( (long long)( elapsed - frames * 1000 ) * 1000000 / frames );
+        drift = isDriftValid ? ( 3 * drift + d ) / 4 : d;
+        isDriftValid = true;
+        }
+
+    refFrame = minFrame;
+    refTick  = minTick;
+    refUs    = minUs;
+    winStart = frame;
+    minRes   = 0x7FFFFFFF;
+
+    updates++;
+    isReportDue = true;
+    }
+
+bool USBCLOCK::GetModel( uchar* data ) const
+{
+    if ( ! isValid || updates == 0 )
+        return false;
+
+    ulong values[ 4 ] = { refFrame, refTick, refUs, ulong( drift ) };
+    uint sizes[ 4 ] = { 4, 4, 2, 4 };
+
+    for ( int i = 0; i < 4; i++ )
+    {
+        for ( int j = sizes[ i ] - 1; j >= 0; j-- )
+            *data++ = uchar( values[ i ] >> ( 8 * j ) );
+        }
+
+    return true;
+    }
+
+void USBCLOCK::Report( void )
+{
+    if ( ! isReportDue )
+        return;
+
+    uchar data[ USB_CLOCK_MODEL_LEN ];
+
+    taskENTER_CRITICAL ();
+    isReportDue = false;
+    bool isValidModel = GetModel( data );
+    taskEXIT_CRITICAL ();
+
+    if ( ! isValidModel )
+        return;
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_CLOCK_SYNC, 0, sizeof( data ), 10 );
+    if ( pMsg )
+    {
+        memcpy( pMsg->data, data, sizeof( data ) );
+        usbOut.Commit( pMsg );
         }
+    }
 
-    // Advance pRead
-    //
-    pRead += len;
-    if ( pRead >= pMax )
-        pRead -= bufSize;
+void USBCLOCK::DumpStatus( void )
+{
+    tracef( 2, "USB CK: %s, Updates %u, Drift %ld ppb\n", 
+        enabled ? "On" : "Off", updates, drift );
+    }
 
-    // Release space back to circular buffer and unblock some USBXMTR::Put
-    // waiting for more space.
-    //
-    semaFull.Release( len + 2 );
+// Called from CCallbacks::OnStartOfFrame()
+//
+void USB_StartOfFrame( void )
+{
+    usbClock.OnStartOfFrame ();
     }
 
 //---------------------------------------------------------------------------------------
@@ -214,6 +1545,7 @@ portTASK_FUNCTION( USBRCVR::MainTask, pvParameters )
 #endif
 
     // Initialize the USB CDC driver
+    sSer.SetVendorRequestHandler( USB_VendorRequest );
     sSer.Init ();
     
 #ifdef TR_INFO    
@@ -241,43 +1573,396 @@ portTASK_FUNCTION( USBRCVR::MainTask, pvParameters )
     for(;;)
     {
         usbIn.Receiver ();
-        usbIn.ReadMoreData ();
         }
     }
 
-void USBRCVR::Receiver( void )
+void USBRCVR::OnReceiveUSB
+(
+    USBRCVR* pThis,
+    uchar bStatus,
+    uint dBytesTransferred,
+    uint dBytesRemaining
+    )
 {
-    // Check whether read callback has returned already found in FIFO. If not
-    // then we should wait for read callback to complete.
+    (void) dBytesRemaining;
+
+    USB_CALLBACK_ENTER ();
+
+    pThis->isReading = false;
+
+    // Queue the transfer; Arm() has checked that a slot is free. In framed 
+    // mode transfer boundaries do not matter, so the transfer is appended
+    // to the last one if possible.
+    //
+    SLOT* pTail = pThis->slotCount > 0
+        ? &pThis->slot[ ( pThis->slotHead + pThis->slotCount - 1 ) % USB_RCVR_SLOTS ]
+        : NULL;
+
+    if ( pThis->isFramed && IsOK( bStatus ) && pTail != NULL && IsOK( pTail->bStatus ) )
+    {
+        pTail->len += dBytesTransferred;
+        }
+    else
+    {
+        SLOT& s = pThis->slot[ ( pThis->slotHead + pThis->slotCount ) % USB_RCVR_SLOTS ];
+        s.pData   = pThis->pWrite;
+        s.len     = dBytesTransferred;
+        s.bStatus = bStatus;
+
+        if ( ++pThis->slotCount > pThis->maxSlots )
+            pThis->maxSlots = pThis->slotCount;
+        }
+
+    pThis->used += dBytesTransferred;
+    if ( pThis->used > pThis->maxUsed )
+        pThis->maxUsed = pThis->used;
+
+    pThis->pWrite += dBytesTransferred;
+    if ( pThis->pWrite >= pThis->pMax )
+        pThis->pWrite -= USB_RCVR_RING_SIZE;
+
+    // Immediate read completes from within CCDC::Read() called by Arm(), which
+    // posts the next read itself. After a transfer error the read is posted 
+    // again by Receiver().
     //
-    if ( bStatus != USB::USB_STATUS_IMMEDREAD )
+    if ( bStatus == USB::USB_STATUS_SUCCESS )
+    {
+        pThis->Arm ();
+        }
+
+    if ( pThis->isWaiter && bStatus != USB::USB_STATUS_IMMEDREAD )
+    {
+        pThis->isWaiter = false;
+
+        if ( pThis->semaReceived.ReleaseFromISR( 1, isTaskWokenByPostInUsbIrq ) )
+        {
+            isTaskWokenByPostInUsbIrq = pdTRUE;
+            }
+        }
+
+    USB_CALLBACK_EXIT ();
+    }
+
+void USBRCVR::Arm( void )
+{
+    while ( ! isReading )
     {
-        // Wait callback to receive data
+        // A v1 message is a whole transfer, so there must be room for the 
+        // longest one. In framed mode any multiple of the packet size will do.
         //
-        do ; while( ! semaReceived.Wait( 1, 1000 ) );
-        
-        // Check CCDC::Read() callback status
+        uint len = USB_RCVR_BUF_SIZE;
+        uint free = USB_RCVR_RING_SIZE - used;
+
+        if ( isFramed && free < len )
+            len = free & ~( USB_RCVR_PACKET_SIZE - 1 );
+
+        if ( slotCount >= USB_RCVR_SLOTS || free < len || len == 0 )
+        {
+            // No room for the next transfer; the host is NAKed until
+            // Receiver() frees some space
+            //
+            if ( ! isStalled )
+            {
+                isStalled = true;
+                ++stalls;
+                }
+            return;
+            }
+
+        isStalled = false;
+
+        // isReading is cleared by OnReceiveUSB(), which may be called from
+        // within CCDC::Read() when data is left in the FIFO
         //
-        if ( bStatus != USB::USB_STATUS_SUCCESS ) 
+        isReading = true;
+
+        int rc = sSer.Read( pWrite, len, Callback_f( OnReceiveUSB ), this, ring, pMax );
+
+        if ( rc != USB::USB_STATUS_SUCCESS )
         {
-#ifdef TR_ERROR            
-            taskENTER_CRITICAL ();
-            TRACE_ERROR( "USBRCVR: Transfer error\n" );
-            taskEXIT_CRITICAL ();
-#endif
+            isReading = false;
             return;
             }
         }
+    }
 
-#ifdef TR_DEBUG_M
+// Returns the number of octets in the successfully completed transfers at 
+// the head of the queue. isBroken is set if a failed transfer follows them.
+// Must be called with interrupts disabled.
+//
+uint USBRCVR::Available( bool& isBroken ) const
+{
+    uint avail = 0;
+    isBroken = false;
+
+    for ( uint i = 0; i < slotCount; i++ )
+    {
+        const SLOT& s = slot[ ( slotHead + i ) % USB_RCVR_SLOTS ];
+
+        if ( ! IsOK( s.bStatus ) )
+        {
+            isBroken = true;
+            break;
+            }
+
+        avail += s.len;
+        }
+
+    return avail;
+    }
+
+// Returns the length of the frame at the head of the queue, 0 if the 
+// length is invalid.
+//
+uint USBRCVR::FrameLength( void ) const
+{
+    const uchar* p = slot[ slotHead ].pData;
+
+    uint len = uint( p[ 0 ] ) << 8;
+    if ( ++p >= pMax )
+        p = ring;
+    len += p[ 0 ];
+
+    if ( len < sizeof( XPI_OMSG_HEADER ) || len + 2 > USB_RCVR_BUF_SIZE )
+        return 0;
+
+    return len;
+    }
+
+// Returns true if Receiver() has something to do with the head of the queue.
+// Must be called with interrupts disabled.
+//
+bool USBRCVR::IsReady( void ) const
+{
+    if ( slotCount == 0 )
+        return false;
+
+    if ( ! isFramed || ! IsOK( slot[ slotHead ].bStatus ) )
+        return true;
+
+    // Framed mode: wait for a complete frame
+    //
+    bool isBroken;
+    uint avail = Available( isBroken );
+
+    if ( isBroken )
+        return true;
+
+    if ( avail < 2 )
+        return false;
+
+    uint len = FrameLength ();
+
+    return len == 0 || avail >= len + 2;
+    }
+
+// Releases len octets at the head of the queue. Slots are removed as they
+// become empty.
+//
+void USBRCVR::Release( uint len )
+{
+    taskENTER_CRITICAL ();
+
+    while ( slotCount > 0 )
+    {
+        SLOT& s = slot[ slotHead ];
+
+        uint n = len < s.len ? len : s.len;
+
+        s.pData += n;
+        if ( s.pData >= pMax )
+            s.pData -= USB_RCVR_RING_SIZE;
+
+        s.len -= n;
+        used  -= n;
+        len   -= n;
+
+        if ( s.len > 0 )
+            break;
+
+        slotHead = ( slotHead + 1 ) % USB_RCVR_SLOTS;
+        --slotCount;
+
+        if ( len == 0 )
+            break;
+        }
+
+    taskEXIT_CRITICAL ();
+    }
+
+void USBRCVR::Initialize( void )
+{
+#ifdef TR_INFO        
+    taskENTER_CRITICAL ();
+    TRACE_INFO( "USBRCVR: Initialize(): Size=%u\n", USB_RCVR_RING_SIZE );
+    taskEXIT_CRITICAL ();
+#endif
+
+    // Wait a bit for USB endpoint to be ready
+    vTaskDelay( 100 );
+
+    for( ;; ) 
+    {
+        taskENTER_CRITICAL ();
+        Arm ();
+        bool isPosted = isReading || slotCount > 0;
+        taskEXIT_CRITICAL ();
+        
+        if ( isPosted )
+            break;
+        
+        // USB endopoint is not ready; wait and retry
+        vTaskDelay( 10 );
+        }
+
+#ifdef TR_INFO
     taskENTER_CRITICAL ();
-    TRACE_DEBUG_M( "USBRCVR: Got %6u, %5u; RC = %d\n", 
-            dBytesTransferred, dBytesRemaining, bStatus );
+    TRACE_INFO( "USBRCVR: Posted initial CCDC::Read\n" );
     taskEXIT_CRITICAL ();
 #endif
+    }
+
+void USBRCVR::DumpStatus( void )
+{
+    tracef( 2, "USB RX: Queued max %u of %u, Used max %u of %u, Stalls %u, "
+        "Framing errors %u\n",
+        maxSlots, USB_RCVR_SLOTS, maxUsed, USB_RCVR_RING_SIZE, stalls, framingErrors );
+    }
+
+void USBRCVR::Receiver( void )
+{
+    // Wait for a completed transfer (or a complete frame in framed mode). 
+    // Post the read again if it has been stopped (no space, transfer error or 
+    // endpoint not ready).
+    //
+    for(;;)
+    {
+        taskENTER_CRITICAL ();
+        Arm ();
+        bool isReady = IsReady ();
+        if ( ! isReady )
+            isWaiter = true;
+        taskEXIT_CRITICAL ();
+
+        usbNotify.Watermark( XPI_SERIAL_STATE_RX_FULL, used, USB_RCVR_RING_SIZE );
+
+        if ( isReady )
+            break;
+
+        semaReceived.Wait( 1, isReading ? 1000 : 1 );
+        }
+
+    // Only Receiver() removes slots and moves their data pointer, so the head
+    // slot is stable (its length may only grow)
+    //
+    SLOT& s = slot[ slotHead ];
+
+    if ( ! IsOK( s.bStatus ) ) 
+    {
+#ifdef TR_ERROR            
+        taskENTER_CRITICAL ();
+        TRACE_ERROR( "USBRCVR: Transfer error\n" );
+        taskEXIT_CRITICAL ();
+#endif
+        Release( s.len );
+        }
+    else if ( ! isFramed )
+    {
+        uint len = s.len;
+
+#ifdef TR_DEBUG_M
+        taskENTER_CRITICAL ();
+        TRACE_DEBUG_M( "USBRCVR: Got %6u; RC = %d\n", len, s.bStatus );
+        taskEXIT_CRITICAL ();
+#endif
+
+        if ( len > 0 )
+        {
+            Linearize( s.pData, len );
+            Dispatch( s.pData, len );
+            }
+
+        Release( len );
+        }
+    else
+    {
+        ReceiveFrame ();
+        }
+    }
+
+// Processes the frame at the head of the queue in framed mode. Frames that
+// are cut by a failed transfer are dropped; on invalid framing one octet is
+// skipped, until the stream is in sync again.
+//
+void USBRCVR::ReceiveFrame( void )
+{
+    taskENTER_CRITICAL ();
+    bool isBroken;
+    uint avail = Available( isBroken );
+    taskEXIT_CRITICAL ();
+
+    uint len = avail >= 2 ? FrameLength () : 0;
+
+    if ( avail < 2 || ( len > 0 && avail < len + 2 ) )
+    {
+        // Incomplete frame in front of a failed transfer
+        //
+        if ( avail > 0 )
+            ++framingErrors;
+
+        Release( avail );
+        return;
+        }
+
+    uchar* pFrame = slot[ slotHead ].pData;
 
-    if ( dBytesTransferred == 0 )
+    if ( len > 0 )
+        Linearize( pFrame, len + 2 );
+
+    XPI_OMSG_HEADER* pMsg = (XPI_OMSG_HEADER*)( pFrame + 2 );
+
+    if ( len == 0 
+        || pMsg->magicMSB != XPI_MSG_MAGIC_MSB 
+        || pMsg->magicLSB != XPI_MSG_MAGIC_LSB 
+        )
+    {
+        ++framingErrors;
+        Release( 1 );
         return;
+        }
+
+    Dispatch( (uchar*) pMsg, len );
+
+    Release( len + 2 );
+
+    // Data following the command that left framed mode is dropped
+    //
+    if ( ! isFramed )
+    {
+        taskENTER_CRITICAL ();
+        uint left = used;
+        taskEXIT_CRITICAL ();
+
+        Release( left );
+        }
+    }
+
+// Makes len octets at pData contiguous: the part wrapped to the beginning 
+// of the ring is copied to the overflow area at pMax.
+//
+void USBRCVR::Linearize( uchar* pData, uint len )
+{
+    if ( pData + len > pMax )
+        memcpy( pMax, ring, pData + len - pMax );
+    }
+
+// Processes a message received from the host. Slow commands are queued to
+// the command executor. If tag is given, completion is reported with 
+// XPI_IMSG_CMD_DONE.
+//
+void USBRCVR::Dispatch( uchar* buf, uint dBytesTransferred, int tag )
+{
+    MSG& sMsg = *(MSG*) buf;
 
     int dataLen = dBytesTransferred - sizeof( XPI_OMSG_HEADER );
 
@@ -295,6 +1980,49 @@ void USBRCVR::Receiver( void )
         return;
         }
 
+    // Unwrap tagged command: the inner header is rebuilt in place of the
+    // outer one, just in front of the inner data
+    //
+    if ( sMsg.type == XPI_OMSG_TAGGED )
+    {
+        if ( dataLen < 2 )
+            return;
+
+        uchar innerTag  = sMsg.subtype;
+        uchar innerType = sMsg.data[ 0 ];
+        uchar innerSub  = sMsg.data[ 1 ];
+
+        MSG& sInner = *(MSG*)( buf + 2 );
+        sInner.magicMSB = XPI_MSG_MAGIC_MSB;
+        sInner.magicLSB = XPI_MSG_MAGIC_LSB;
+        sInner.type     = innerType;
+        sInner.subtype  = innerSub;
+
+        Dispatch( buf + 2, dBytesTransferred - 2, innerTag );
+        return;
+        }
+
+    // Slow commands are executed asynchronously
+    //
+    if ( CMDEXEC::IsAsync( sMsg.type ) )
+    {
+        if ( ! cmdExec.Post( sMsg.type, sMsg.subtype, sMsg.data, dataLen, tag, 100 ) )
+        {
+#ifdef TR_ERROR
+            taskENTER_CRITICAL ();
+            TRACE_ERROR( "USBRCVR: Command queue full\n" );
+            taskEXIT_CRITICAL ();
+#endif
+            if ( tag >= 0 )
+                CMDEXEC::Reply( tag, sMsg.type, XPI_CMD_BUSY );
+            }
+        return;
+        }
+
+    // Completion status reported for a tagged command
+    //
+    int status = XPI_CMD_OK;
+
     // Process XPI_OMSG depending on message type
     //
     switch( sMsg.type )
@@ -313,12 +2041,11 @@ void USBRCVR::Receiver( void )
                 for ( int i = 0; i <= dataLen / 32; i++ )
                 {
                     taskENTER_CRITICAL ();
-                    FPGA_BegWrite ();
-                    FPGA_Write( XPI_W_PAGE_ADDR, 1 ); // Page 1
-                    FPGA_BegRead ();
+                    FPGA_BusPage( 1 );
                     for ( int j = 0; j < 64; j++ )
-                        (void) FPGA_Read( XPI_R_P1_BOARD_POS );
-                    taskEXIT_CRITICAL ();  
+                        (void) FPGA_BusRead( XPI_R_P1_BOARD_POS );
+                    FPGA_BusEnd ();
+                    taskEXIT_CRITICAL ();
                     }
                 }
 
@@ -364,79 +2091,76 @@ void USBRCVR::Receiver( void )
         {
             if ( dataLen > 0 )
             {
-                xsvf.LockBuffer( sMsg.data, dataLen );
+                xsvf.Put( sMsg.data, dataLen );
                 }
             }
             break;
 
         //-------------------------------------------------------------------------------
-        case XPI_OMSG_FPGA_INIT:
-        {
-            bool coldStart    = dataLen >= 1 ? sMsg.data[ 0 ] : false;
-            bool forcePassive = dataLen >= 2 ? sMsg.data[ 1 ] : false;
-            xpi.InitializeFPGA( coldStart, forcePassive );
-            }
-            break;
-
-        //-------------------------------------------------------------------------------
-        case XPI_OMSG_QUERY:
+        case XPI_OMSG_LOG_CFG:
         {
-            if ( sMsg.subtype == 0x01 )
-                xpi.DumpStatus ();
-            else
-                sysDumpStatus ();
+            xpi.SetTraceMask( dataLen >= 1 ? sMsg.data[ 0 ] : 0 );
             }
             break;
 
         //-------------------------------------------------------------------------------
-        case XPI_OMSG_LOG_CFG:
+        case XPI_OMSG_SC_DATA:
         {
-            xpi.SetTraceMask( dataLen >= 1 ? sMsg.data[ 0 ] : 0 );
+            // In credit mode the host does not overrun the buffer, so the
+            // receiver does not wait for it
+            //
+            if ( ! xpi.Put( sMsg.data, dataLen, xpi.IsCreditMode () ? 0 : 100 ) )
+                status = XPI_CMD_FAILED;
             }
             break;
 
         //-------------------------------------------------------------------------------
-        case XPI_OMSG_SC_DATA:
+        case XPI_OMSG_SC_BATCH:
         {
-            xpi.Put( sMsg.data, dataLen, 100 );
+            if ( ! xpi.PutBatch( sMsg.data, dataLen, sMsg.subtype, 
+                    xpi.IsCreditMode () ? 0 : 100 ) )
+            {
+                status = XPI_CMD_FAILED;
+                }
             }
             break;
 
         //-------------------------------------------------------------------------------
-        case XPI_OMSG_FC_CMD:
+        case XPI_OMSG_USB_CFG:
         {
-            if ( dataLen >= 2 ) // Addr with D1 and D0
+            if ( sMsg.subtype == XPI_USB_CFG_COALESCE )
             {
-                int card = sMsg.data[ 0 ] & 0x3F;
-
-                FPGA_FC_Command( ( card << 2 ) | ( sMsg.data[ 1 ] & 0x03 )  );
-                vTaskDelay( 2 );
+                uint maxBytes = dataLen >= 2 ? ( sMsg.data[ 0 ] << 8 ) + sMsg.data[ 1 ] : 0;
+                portTickType maxDelay = dataLen >= 3 ? sMsg.data[ 2 ] : 0;
+                usbOut.SetCoalescing( maxBytes, maxDelay );
                 }
-            else if ( dataLen >= 1 ) // Only Addr
+            else if ( sMsg.subtype == XPI_USB_CFG_SEQUENCE )
             {
-                int card = sMsg.data[ 0 ] & 0x3F;
-
-                // Turn off and reset the board
-                //
-                FPGA_FC_Command( ( card << 2 ) | 0x00 );
-                vTaskDelay( 2 );
-
-                // Turn on the board
-                //
-                FPGA_FC_Command( ( card << 2 ) | 0x01 );
-                vTaskDelay( 2 );
-
-                // Is the board installed?
-                //
-                if ( FPGA_FC_Command( ( card << 2 ) | 0x03 ) )
-                {
-                    vTaskDelay( 2 );
-
-                    // Is the board turned on and installed?
-                    //
-                    FPGA_FC_Command( ( card << 2 ) | 0x02 );
-                    }
-                vTaskDelay( 2 );
+                usbOut.SetSequencing( dataLen >= 1 && sMsg.data[ 0 ] );
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_STREAM )
+            {
+                usbOut.SetStreaming( dataLen >= 1 && sMsg.data[ 0 ] );
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_FRAMING )
+            {
+                usbOut.SetCompact( dataLen >= 1 && sMsg.data[ 0 ] == 2 );
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_OMSG_FRAMING )
+            {
+                isFramed = dataLen >= 1 && sMsg.data[ 0 ];
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_NOTIFY )
+            {
+                usbNotify.Enable( dataLen >= 1 && sMsg.data[ 0 ] );
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_CLOCK_SYNC )
+            {
+                usbClock.Enable( dataLen >= 1 && sMsg.data[ 0 ] );
+                }
+            else if ( sMsg.subtype == XPI_USB_CFG_CREDITS )
+            {
+                xpi.SetCreditMode( dataLen >= 1 && sMsg.data[ 0 ] );
                 }
             }
             break;
@@ -446,4 +2170,7 @@ void USBRCVR::Receiver( void )
             // TODO: issue warning "unknown XPI_OMSG"
             break;
         }
+
+    if ( tag >= 0 )
+        CMDEXEC::Reply( tag, sMsg.type, status );
     }
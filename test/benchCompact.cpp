@@ -0,0 +1,212 @@
+//---------------------------------------------------------------------------------------
+//      USBXMTR::Compact(): octets on the wire in v1 and compact v2 framing for
+//      typical message mixes, each batch checked with the host decoder
+//---------------------------------------------------------------------------------------
+//
+// Messages are queued into a lane as producers do, in coalesced batches of up to
+// BATCH_MAX octets. Every batch is re-encoded with Compact(), decoded with
+// XPI_V2_Decode() and compared with what was queued. Reported per mix: octets
+// in v1 and v2 framing, octets per message, and 64-octet full speed packets.
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+#include "hostV2.hpp"
+
+extern USBXMTR usbOut;
+
+enum
+{
+    BATCH_MAX  = 512,
+    MSG_COUNT  = 20000,
+    PACKET_LEN = 64,
+    DATA_MAX   = 64
+    };
+
+typedef USBXMTR_LANE_BUF< BATCH_MAX + 2 * DATA_MAX > LANE;
+
+struct MSG
+{
+    uchar type;
+    uchar subtype;
+    ulong timeStamp;
+    uint  len;
+    uchar data[ DATA_MAX ];
+    };
+
+// Message mix: fills in the next message of the stream
+//
+typedef void (*NEXT_MSG)( MSG& m, uint i );
+
+static uint seed = 1;
+
+static uint Random( uint range )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 16 ) % range;
+    }
+
+static ulong now = 100000;
+
+//---------------------------------------------------------------------------------------
+//      Message mixes
+//---------------------------------------------------------------------------------------
+
+// CTX/CRX trace of SC traffic: one status octet, a few per tick
+//
+static void NextTrace( MSG& m, uint i )
+{
+    now += Random( 4 ) == 0 ? 1 : 0;
+
+    m.type      = i & 1 ? XPI_IMSG_TRACE_CRX : XPI_IMSG_TRACE_CTX;
+    m.subtype   = Random( 8 ) == 0 ? 4 : 0;
+    m.timeStamp = now;
+    m.len       = 1;
+    m.data[ 0 ] = uchar( Random( 256 ) );
+    }
+
+// Same trace with XPI_USB_CFG_SEQUENCE: 2 more octets per message
+//
+static void NextTraceSeq( MSG& m, uint i )
+{
+    NextTrace( m, i );
+    m.data[ 1 ] = uchar( i >> 8 );
+    m.data[ 2 ] = uchar( i );
+    m.len = 3;
+    }
+
+// Log lines of 20 to 60 characters
+//
+static void NextLog( MSG& m, uint i )
+{
+    (void) i;
+    now += Random( 20 );
+
+    m.type      = XPI_IMSG_LOG;
+    m.subtype   = 0;
+    m.timeStamp = now;
+    m.len       = 20 + Random( 41 );
+    for ( uint j = 0; j < m.len; j++ )
+        m.data[ j ] = uchar( 'a' + Random( 26 ) );
+    }
+
+// Control lane traffic: FC events, SC data with ACK status and flow control
+//
+static void NextCtrl( MSG& m, uint i )
+{
+    now += Random( 3 );
+
+    static const uchar types[] = { XPI_IMSG_FC_EVENT, XPI_IMSG_SC_DATA, XPI_IMSG_FLOW_CTRL };
+    static const uchar lens[]  = { 4, 12, 2 };
+
+    uint k = i % 3;
+    m.type      = types[ k ];
+    m.subtype   = uchar( Random( 3 ) );
+    m.timeStamp = now;
+    m.len       = lens[ k ];
+    for ( uint j = 0; j < m.len; j++ )
+        m.data[ j ] = uchar( Random( 256 ) );
+    }
+
+//---------------------------------------------------------------------------------------
+//      Benchmark
+//---------------------------------------------------------------------------------------
+
+static uint PutMsg( LANE& lane, const MSG& m )
+{
+    uchar* p = lane.Reserve( sizeof( XPI_IMSG_HEADER ) + m.len, 0 );
+    assert( p != NULL );
+
+    XPI_IMSG_HEADER hdr;
+    hdr.magicMSB  = XPI_MSG_MAGIC_MSB;
+    hdr.magicLSB  = XPI_MSG_MAGIC_LSB;
+    hdr.type      = m.type;
+    hdr.subtype   = m.subtype;
+    hdr.timeStamp = m.timeStamp;
+
+    memcpy( p, &hdr, sizeof( hdr ) );
+    memcpy( p + sizeof( hdr ), m.data, m.len );
+    lane.Commit( p );
+
+    return sizeof( XPI_IMSG_HEADER ) + m.len + 2;
+    }
+
+static uint Packets( uint len )
+{
+    // A transfer of a multiple of the packet size ends with a zero length packet
+    //
+    return len / PACKET_LEN + 1;
+    }
+
+static void Run( const char* name, NEXT_MSG pNext )
+{
+    static MSG msgs[ BATCH_MAX ];
+
+    uint v1Octets = 0, v2Octets = 0;
+    uint v1Packets = 0, v2Packets = 0;
+    uint done = 0;
+
+    while ( done < MSG_COUNT )
+    {
+        LANE lane;
+        lane.pOwner = &usbOut;
+
+        // Queue messages up to the batch budget
+        //
+        uint span = 0;
+        int count = 0;
+
+        for(;;)
+        {
+            MSG& m = msgs[ count ];
+            pNext( m, done + count );
+
+            if ( span + sizeof( XPI_IMSG_HEADER ) + m.len + 2 > BATCH_MAX )
+                break;
+
+            span += PutMsg( lane, m );
+            ++count;
+            }
+
+        uint len = usbOut.Compact( &lane, lane.pRead, span );
+
+        static XPI_V2_RECORD rec[ BATCH_MAX ];
+        int n = XPI_V2_Decode( lane.pRead, len, rec, BATCH_MAX );
+        assert( n == count );
+
+        for ( int i = 0; i < n; i++ )
+        {
+            assert( rec[ i ].isMsg );
+            assert( rec[ i ].type == msgs[ i ].type && rec[ i ].subtype == msgs[ i ].subtype );
+            assert( rec[ i ].timeStamp == msgs[ i ].timeStamp );
+            assert( rec[ i ].len == msgs[ i ].len );
+            assert( memcmp( rec[ i ].data, msgs[ i ].data, rec[ i ].len ) == 0 );
+            }
+
+        v1Octets  += span;
+        v2Octets  += len;
+        v1Packets += Packets( span );
+        v2Packets += Packets( len );
+        done      += count;
+        }
+
+    printf( "benchCompact: %-10s %6u msgs  v1 %7u octets (%5.2f/msg, %5u packets)"
+            "  v2 %7u octets (%5.2f/msg, %5u packets)  v2/v1 %3.0f%%\n",
+        name, done,
+        v1Octets, double( v1Octets ) / done, v1Packets,
+        v2Octets, double( v2Octets ) / done, v2Packets,
+        100.0 * v2Octets / v1Octets );
+    }
+
+int main( void )
+{
+    Run( "trace", NextTrace );
+    Run( "trace+seq", NextTraceSeq );
+    Run( "log", NextLog );
+    Run( "ctrl", NextCtrl );
+
+    return 0;
+    }
@@ -0,0 +1,231 @@
+//---------------------------------------------------------------------------------------
+//      XPI EIRQ polling: poll steps to the board that raised EIRQ, with active
+//      boards in the order they became active (as before EIRQ weights) and
+//      ordered by EIRQ weight
+//---------------------------------------------------------------------------------------
+//
+// A simulated backplane drives the XPI state machine in MCPU mode through the
+// firmware entry points: StartTransmissionIfIdle() starts the poll, On_CTXE()
+// completes every CTX write, present boards answer their poll with NAK() or,
+// for the board that raised EIRQ, with a MSG() frame through AssembleCRX(), and
+// empty positions time out in On_Timer(). Steps are taken from poll_steps.
+//
+// PRESENT_COUNT boards sit at scattered positions. The board raising each EIRQ
+// is drawn with a probability of 1/rank, with ranks not in address order, and
+// FC events come from any of the 64 positions. Without weights, the weights are
+// cleared after every EIRQ, so the stable sort keeps the order in which the
+// boards became active.
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+#include "hostFpga.hpp"
+
+extern USBXMTR usbOut;
+extern volatile ulong dTimerTick;
+
+enum
+{
+    PRESENT_COUNT = 16,
+    EIRQ_COUNT    = 20000,
+    FC_EVERY      = 4       // an FC event every FC_EVERY EIRQs on average
+    };
+
+static uint seed = 1;
+
+static uint Random( uint range )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 16 ) % range;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Simulated backplane
+//---------------------------------------------------------------------------------------
+
+static bool isPresent[ XPI::MAX_BOARD_COUNT ];
+static uchar byRank[ PRESENT_COUNT ];    // board position of each rank
+static uint rankSum;                      // sum of 1/rank, scaled
+static uint fcBoard;
+
+enum { RANK_SCALE = 10000 };              // rankSum stays within Random()
+
+static uint ReadReg( uint page, uint addr )
+{
+    (void) page;
+    return addr == XPI_R_P0_FC_FDFA ? fcBoard << 2 : 0;
+    }
+
+static void Setup( void )
+{
+    memset( isPresent, 0, sizeof( isPresent ) );
+    seed = 1;
+
+    for ( uint rank = 0; rank < PRESENT_COUNT; rank++ )
+    {
+        uint board;
+        do board = Random( XPI::MAX_BOARD_COUNT ); while( isPresent[ board ] );
+
+        isPresent[ board ] = true;
+        byRank[ rank ] = uchar( board );
+        }
+
+    rankSum = 0;
+    for ( uint rank = 0; rank < PRESENT_COUNT; rank++ )
+        rankSum += RANK_SCALE / ( rank + 1 );
+    }
+
+// Draws the board raising the next EIRQ
+//
+static uint NextEirqBoard( void )
+{
+    uint r = Random( rankSum );
+
+    for ( uint rank = 0; rank < PRESENT_COUNT; rank++ )
+    {
+        uint w = RANK_SCALE / ( rank + 1 );
+        if ( r < w )
+            return byRank[ rank ];
+        r -= w;
+        }
+
+    return byRank[ PRESENT_COUNT - 1 ];
+    }
+
+// Frees the messages traced to the host
+//
+static void Drain( void )
+{
+    for ( int i = 0; i < USB_XMTR_LANES; i++ )
+    {
+        USBXMTR_LANE& lane = *usbOut.lane[ i ];
+
+        for(;;)
+        {
+            int status = lane.Poll ();
+            if ( status == USBXMTR_LANE::SKIP )
+            {
+                lane.Skip ();
+                continue;
+                }
+
+            if ( status != USBXMTR_LANE::READY )
+                break;
+
+            uint len = lane.PeekLength ();
+            lane.Take( len );
+
+            lane.pRead += len + 2;
+            if ( lane.pRead >= lane.pMax )
+                lane.pRead -= lane.bufSize;
+
+            lane.FreeSpace( lane.FreeLength( len + 2 ) );
+            }
+        }
+    }
+
+// Polls for the EIRQ raised by board; returns the poll steps taken
+//
+static uint Eirq( XPI& x, uint board )
+{
+    ulong steps = x.poll_steps;
+
+    x.isEIRQ = true;
+    x.StartTransmissionIfIdle ();
+    assert( x.state == XPI::POLL_EIRQ );
+
+    x.On_CTXE (); // 0xC0 sent: poll the first board
+
+    for(;;)
+    {
+        x.On_CTXE (); // Board id sent
+
+        uint polled = x.poll_list[ x.poll_cur ] & 0x3F;
+
+        if ( polled == board )
+        {
+            // MSG() frame without data: address, length, checksum
+            //
+            x.AssembleCRX( 0x80 | board );
+            x.AssembleCRX( 0x00 );
+            x.AssembleCRX( 0x00 );
+            break;
+            }
+
+        if ( isPresent[ polled ] )
+            x.AssembleCRX( polled ); // NAK()
+        else
+        {
+            dTimerTick += XPI::EIRQ_POLL_DELAY + 1;
+            x.On_Timer ();
+            }
+
+        assert( x.state == XPI::POLL_EIRQ );
+        }
+
+    x.On_CTXE (); // ACK() sent
+    assert( x.state == XPI::IDLE );
+
+    return x.poll_steps - steps;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Benchmark
+//---------------------------------------------------------------------------------------
+
+static void Run( bool isWeighted )
+{
+    Setup ();
+
+    FPGA_ModelReset ();
+    fpgaModel.pRead = ReadReg;
+
+    XPI* px = new XPI;
+    XPI& x = *px;
+    x.isMCPU = true;
+    x.isCTXE = true;
+    x.state  = XPI::IDLE;
+
+    uint steps = 0, first = 0;
+
+    for ( uint i = 0; i < EIRQ_COUNT; i++ )
+    {
+        uint n = Eirq( x, NextEirqBoard () );
+        steps += n;
+        first += n == 1;
+
+        if ( Random( FC_EVERY ) == 0 )
+        {
+            fcBoard = Random( XPI::MAX_BOARD_COUNT );
+            x.On_FC ();
+            }
+
+        if ( ! isWeighted )
+            memset( x.eirq_weight, 0, sizeof( x.eirq_weight ) );
+
+        Drain ();
+        }
+
+    // FC events from passive boards are not weighted
+    //
+    for ( uint b = 0; b < XPI::MAX_BOARD_COUNT; b++ )
+        assert( isPresent[ b ] || x.eirq_weight[ b ] == 0 );
+
+    printf( "benchEirqPoll: %-11s %2u of %2u boards present  %5.2f polls per EIRQ  "
+            "%4.1f%% found at the first poll\n",
+        isWeighted ? "weighted" : "unweighted", PRESENT_COUNT, XPI::MAX_BOARD_COUNT,
+        double( steps ) / EIRQ_COUNT, 100.0 * first / EIRQ_COUNT );
+
+    delete px;
+    }
+
+int main( void )
+{
+    Run( false );
+    Run( true );
+
+    return 0;
+    }
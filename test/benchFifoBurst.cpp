@@ -0,0 +1,207 @@
+//---------------------------------------------------------------------------------------
+//      CTX FIFO: one octet per FPGA_IrqTasklet() pass (as before burst draining)
+//      vs XPI::On_CTX() bursts of up to FIFO_BURST_MAX octets
+//---------------------------------------------------------------------------------------
+//
+// The FIFO is filled with a number of octets per FPGA interrupt, and the pass
+// loop of FPGA_IrqTasklet() runs until no request bit is set. Per-octet mode
+// reads every octet as On_CTX() did before: a tasklet pass of its own, with
+// the page register written and the data bus turned around for every octet.
+// Reported per octet: FPGA bus cycles (from hostFpga), data bus direction
+// switches, tasklet passes and critical sections; and octets per second
+// through the firmware code on the host.
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+
+#include "hostFpga.hpp"
+#include "hostRtos.hpp"
+
+extern USBXMTR usbOut;
+
+#ifdef USB_XMTR_LOCKFREE
+static const char* VARIANT = "lockfree";
+#else
+static const char* VARIANT = "sema";
+#endif
+
+enum
+{
+    FIFO_SIZE   = 31,       // CTX FIFO depth of the FPGA
+    OCTET_COUNT = 300000
+    };
+
+//---------------------------------------------------------------------------------------
+//      FIFO model
+//---------------------------------------------------------------------------------------
+
+static uchar fifo[ FIFO_SIZE ];
+static uint fifoHead;
+static uint fifoTail;
+
+static uint ReadReg( uint page, uint addr )
+{
+    if ( addr == XPI_R_INT_REQUEST )
+        return fifoHead < fifoTail ? XPI_IRQ_CTX : 0;
+
+    assert( page == 0 && addr == XPI_R_P0_SC_CTX );
+    assert( fifoHead < fifoTail );
+
+    return fifo[ fifoHead++ ];
+    }
+
+// Traced CTX frames, as in testFifoBurst
+//
+static const uchar frames[] =
+{
+    0x85, 0x02, 0xAA, 0xBB, 0x00,
+    0x86, 0x01, 0xCC, 0x00
+    };
+
+static uint framePos;
+
+// Fills the FIFO with len octets of the frame stream
+//
+static void Arrive( uint len )
+{
+    fifoHead = fifoTail = 0;
+
+    for ( uint i = 0; i < len; i++ )
+    {
+        fifo[ fifoTail++ ] = frames[ framePos ];
+        framePos = ( framePos + 1 ) % sizeof( frames );
+        }
+    }
+
+// Frees the messages traced to the host
+//
+static void Drain( void )
+{
+    for ( int i = 0; i < USB_XMTR_LANES; i++ )
+    {
+        USBXMTR_LANE& lane = *usbOut.lane[ i ];
+
+        for(;;)
+        {
+            int status = lane.Poll ();
+            if ( status == USBXMTR_LANE::SKIP )
+            {
+                lane.Skip ();
+                continue;
+                }
+
+            if ( status != USBXMTR_LANE::READY )
+                break;
+
+            uint len = lane.PeekLength ();
+            lane.Take( len );
+
+            lane.pRead += len + 2;
+            if ( lane.pRead >= lane.pMax )
+                lane.pRead -= lane.bufSize;
+
+            lane.FreeSpace( lane.FreeLength( len + 2 ) );
+            }
+        }
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tasklet pass loops
+//---------------------------------------------------------------------------------------
+
+// CTX read of On_CTX() before burst draining
+//
+static void OnCtxOctet( XPI& x )
+{
+    taskENTER_CRITICAL ();
+    FPGA_BegWrite ();
+    FPGA_Write( XPI_W_PAGE_ADDR, 0 ); // Page 0
+    FPGA_BegRead ();
+    uint octet = FPGA_Read( XPI_R_P0_SC_CTX );
+    taskEXIT_CRITICAL ();
+
+    x.AssembleCTX( octet );
+    }
+
+// Passes of FPGA_IrqTasklet() until no request is pending; returns their count
+//
+static uint Service( XPI& x, bool isBurst )
+{
+    uint passes = 0;
+
+    for(;;)
+    {
+        taskENTER_CRITICAL ();
+        uint irq_list = FPGA_BusRead( XPI_R_INT_REQUEST );
+        FPGA_BusEnd ();
+        taskEXIT_CRITICAL ();
+
+        if ( ! irq_list )
+            break;
+
+        ++passes;
+
+        if ( irq_list & XPI_IRQ_CTX )
+        {
+            if ( isBurst )
+                x.On_CTX( irq_list );
+            else
+                OnCtxOctet( x );
+            }
+        }
+
+    return passes;
+    }
+
+static void Run( uint perIrq, bool isBurst )
+{
+    static XPI x;
+    x.state = XPI::IDLE;
+
+    FPGA_ModelReset ();
+    fpgaModel.pRead = ReadReg;
+    framePos = 0;
+
+    HOST_RTOS_STATS before = hostRtosStats;
+    uint passes = 0;
+    uint octets = 0;
+
+    unsigned long long start = HostNanoseconds ();
+
+    while ( octets < OCTET_COUNT )
+    {
+        Arrive( perIrq );
+        passes += Service( x, isBurst );
+        octets += perIrq;
+
+        Drain ();
+        }
+
+    unsigned long long elapsed = HostNanoseconds () - start;
+
+    printf( "benchFifoBurst: %-8s %2u octets/irq  %-9s  %5.2f bus cycles  %5.2f direction switches  "
+            "%5.2f passes  %5.2f critical sections per octet  %9.0f octets/s on host\n",
+        VARIANT, perIrq, isBurst ? "burst" : "per-octet",
+        double( fpgaModel.reads + fpgaModel.writes ) / octets,
+        double( fpgaModel.dirSwitches ) / octets,
+        double( passes ) / octets,
+        double( hostRtosStats.criticals - before.criticals ) / octets,
+        octets * 1e9 / elapsed );
+    }
+
+int main( void )
+{
+    static const uint perIrq[] = { 1, 4, 12, FIFO_SIZE };
+
+    for ( uint i = 0; i < sizeof( perIrq ) / sizeof( perIrq[ 0 ] ); i++ )
+    {
+        Run( perIrq[ i ], false );
+        Run( perIrq[ i ], true );
+        }
+
+    return 0;
+    }
@@ -0,0 +1,167 @@
+//---------------------------------------------------------------------------------------
+//      XPI_OMSG_SC_DATA vs XPI_OMSG_SC_BATCH: SC frames per second from USB OUT
+//      transfers into the SC transmit queues
+//---------------------------------------------------------------------------------------
+//
+// Transfers are completed into the receive ring and dispatched by USBRCVR as in
+// testRcvrRing; the queued frames are taken as XPI::Transmitter() does. Reported
+// per batch size (1 = one SC_DATA message per frame):
+//
+//   - USB OUT transfers and 64-octet full speed packets per frame. A host that
+//     writes one message at a time gets about one transfer per 1 ms USB frame,
+//     which bounds the SC frame rate to 1000 * frames per transfer.
+//   - critical sections and semaphore calls per frame on the receive path,
+//     which is what a frame costs the target scheduler
+//   - frames per second through the firmware code on the host
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+#include "hostRtos.hpp"
+
+extern XPI xpi;
+
+enum
+{
+    FRAME_LEN   = 12,      // requestID, board address and 9 octets of SC data
+    FRAME_COUNT = 64000,
+    PACKET_LEN  = 64
+    };
+
+#ifdef USB_XMTR_LOCKFREE
+static const char* VARIANT = "lockfree";
+#else
+static const char* VARIANT = "sema";
+#endif
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Completes a transfer of len octets at pWrite of the ring
+//
+static void Deliver( USBRCVR& rcvr, const uchar* data, uint len )
+{
+    uchar* p = rcvr.pWrite;
+
+    for ( uint i = 0; i < len; i++ )
+    {
+        *p++ = data[ i ];
+        if ( p >= rcvr.pMax )
+            p = rcvr.ring;
+        }
+
+    USBRCVR::OnReceiveUSB( &rcvr, USB::USB_STATUS_IMMEDREAD, len, 0 );
+    rcvr.isReading = true;
+    }
+
+// Takes every queued frame as Transmitter() does; returns the number of frames
+//
+static uint TakeAll( XPI& x )
+{
+    uint count = 0;
+
+    while ( x.semaEmpty.Wait( 1, 0 ) )
+    {
+        uint board;
+        uint slot = x.NextSlot( board );
+
+        XPI::SC_SLOT& s = x.slots[ slot ];
+
+        s.next = x.freeSlot;
+        x.freeSlot = slot;
+        x.queuedBytes -= s.len + 2;
+        x.queuedFrames--;
+        x.semaFull.Release( s.len + 2 );
+        x.semaSlots.Release( 1 );
+
+        ++count;
+        }
+
+    return count;
+    }
+
+// Builds the transfer of count frames: SC_DATA if count is 1, SC_BATCH
+// otherwise; returns its length
+//
+static uint Build( uchar* p, uint count, uint n )
+{
+    bool isBatch = count > 1;
+
+    p[ 0 ] = XPI_MSG_MAGIC_MSB;
+    p[ 1 ] = XPI_MSG_MAGIC_LSB;
+    p[ 2 ] = isBatch ? XPI_OMSG_SC_BATCH : XPI_OMSG_SC_DATA;
+    p[ 3 ] = isBatch ? uchar( count ) : 0;
+
+    uint len = sizeof( XPI_OMSG_HEADER );
+
+    for ( uint i = 0; i < count; i++, n++ )
+    {
+        if ( isBatch )
+            p[ len++ ] = FRAME_LEN;
+
+        p[ len++ ] = uchar( n >> 8 );
+        p[ len++ ] = uchar( n );
+        p[ len++ ] = uchar( n % XPI::MAX_BOARD_COUNT );
+
+        for ( uint j = 3; j < FRAME_LEN; j++ )
+            p[ len++ ] = uchar( j );
+        }
+
+    return len;
+    }
+
+static void Run( uint count )
+{
+    static USBRCVR rcvr;
+    rcvr.isReading = true;
+
+    static uchar transfer[ USB_RCVR_BUF_SIZE ];
+
+    uint transfers = 0, packets = 0, frames = 0;
+    uint criticals = 0, semaCalls = 0;
+
+    unsigned long long start = HostNanoseconds ();
+
+    while ( frames < FRAME_COUNT )
+    {
+        uint len = Build( transfer, count, frames );
+
+        HOST_RTOS_STATS before = hostRtosStats;
+
+        Deliver( rcvr, transfer, len );
+        rcvr.Receiver ();
+
+        criticals += hostRtosStats.criticals - before.criticals;
+        semaCalls += hostRtosStats.semaCalls - before.semaCalls;
+
+        assert( TakeAll( xpi ) == count );
+
+        frames += count;
+        transfers++;
+        packets += len / PACKET_LEN + 1;
+        }
+
+    unsigned long long elapsed = HostNanoseconds () - start;
+
+    printf( "benchScBatch: %-8s batch %3u  %5.3f transfers  %5.3f packets  "
+            "%5.2f critical sections  %5.2f semaphore calls per frame  "
+            "%6u frames/s at 1 transfer/ms  %9.0f frames/s on host\n",
+        VARIANT, count,
+        double( transfers ) / frames, double( packets ) / frames,
+        double( criticals ) / frames, double( semaCalls ) / frames,
+        1000 * count, frames * 1e9 / elapsed );
+    }
+
+int main( void )
+{
+    Run( 1 );
+    Run( 4 );
+    Run( 16 );
+    Run( 64 );
+
+    return 0;
+    }
@@ -0,0 +1,204 @@
+//---------------------------------------------------------------------------------------
+//      XPI SC transmit queues: aggregate frames per second of 64 boards, and the
+//      bus time a dead board still takes with and without SC_HOLDOFF
+//---------------------------------------------------------------------------------------
+//
+// Every board has a frame queued at all times (a new one is put as soon as its
+// frame is sent), and frames are sent by XPI::Transmitter() in MCPU mode. The
+// semaphore wait hook of hostRtos plays the FPGA irq tasklet: a live board
+// completes its frame in FRAME_US, a dead board takes the ACK timeout of
+// WAIT_ACK, BoardTimeout( board, RECEIVE_TIMEOUT, true ), for each of the two
+// tries. Time is simulated; dTimerTick follows it.
+//
+// The design documents give no SC bit rate, so FRAME_US (frame, ACK and
+// INTER_SEND_DELAY together) is a parameter. Modes reported per frame time:
+//
+//   - all live: the bus is never idle
+//   - no holdoff: the holdoff is cleared after every failure, so the dead board
+//     gets its turn every round, as each of its frames did in the single queue
+//   - holdoff: as in the firmware; the dead board still runs its full retry
+//     sequence once every SC_HOLDOFF ms, which is the head-of-line cost that
+//     remains. When a round of the live boards takes longer than SC_HOLDOFF,
+//     the holdoff has expired by the time the dead board is due, and nothing
+//     is gained.
+//
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "sam7xpud.hpp"
+#include "hostRtos.hpp"
+
+extern USBXMTR usbOut;
+extern volatile ulong dTimerTick;
+
+enum
+{
+    SIM_MS     = 10000,     // simulated time per run
+    DEAD_BOARD = 17,
+    NO_BOARD   = XPI::MAX_BOARD_COUNT
+    };
+
+enum MODE
+{
+    ALL_LIVE,
+    NO_HOLDOFF,
+    HOLDOFF
+    };
+
+static const char* modeNames[] = { "all live", "no holdoff", "holdoff" };
+
+//---------------------------------------------------------------------------------------
+//      Simulated backplane
+//---------------------------------------------------------------------------------------
+
+static XPI* pXpi;
+static uint deadBoard;
+static uint frameUs;
+
+static unsigned long long nowUs;
+static unsigned long long deadUs;   // bus time spent on the dead board
+static uint sentBoard;              // board of the last frame sent
+
+static void Advance( unsigned long long us )
+{
+    nowUs += us;
+    dTimerTick = ulong( nowUs / 1000 );
+    }
+
+// Completes the CTX transfer Transmitter() waits for on semaSent
+//
+static void OnWait( xSEMA* pSema )
+{
+    XPI& x = *pXpi;
+
+    if ( pSema != &x.semaSent )
+        return;
+
+    uint board = x.pRead[ 0 ] & 0x3F;
+    sentBoard = board;
+
+    if ( board == deadBoard )
+    {
+        unsigned long long us = x.BoardTimeout( board, XPI::RECEIVE_TIMEOUT, true ) * 1000ull;
+        Advance( us );
+        deadUs += us;
+        }
+    else
+    {
+        x.ctx_status = 0;
+        Advance( frameUs );
+        }
+
+    x.semaSent.Release( 1 );
+    }
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+static void Put( XPI& x, uint board, uint n )
+{
+    uchar frame[ 6 ] = { uchar( n >> 8 ), uchar( n ), uchar( board ), 0x11, 0x22, 0x33 };
+
+    bool isOK = x.Put( frame, sizeof( frame ), 0 );
+    assert( isOK );
+    }
+
+// Frees the failures reported to the host
+//
+static void Drain( void )
+{
+    for ( int i = 0; i < USB_XMTR_LANES; i++ )
+    {
+        USBXMTR_LANE& lane = *usbOut.lane[ i ];
+
+        for(;;)
+        {
+            int status = lane.Poll ();
+            if ( status == USBXMTR_LANE::SKIP )
+            {
+                lane.Skip ();
+                continue;
+                }
+
+            if ( status != USBXMTR_LANE::READY )
+                break;
+
+            uint len = lane.PeekLength ();
+            lane.Take( len );
+
+            lane.pRead += len + 2;
+            if ( lane.pRead >= lane.pMax )
+                lane.pRead -= lane.bufSize;
+
+            lane.FreeSpace( lane.FreeLength( len + 2 ) );
+            }
+        }
+    }
+
+//---------------------------------------------------------------------------------------
+//      Benchmark
+//---------------------------------------------------------------------------------------
+
+static void Run( uint us, MODE mode )
+{
+    XPI* px = new XPI;
+    XPI& x = *px;
+    x.isMCPU = true;
+
+    pXpi      = px;
+    deadBoard = mode == ALL_LIVE ? uint( NO_BOARD ) : uint( DEAD_BOARD );
+    frameUs   = us;
+    nowUs     = 0;
+    deadUs    = 0;
+    Advance( 0 );
+
+    uint n = 0;
+    for ( uint b = 0; b < XPI::MAX_BOARD_COUNT; b++ )
+        Put( x, b, n++ );
+
+    hostOnWait = OnWait;
+
+    uint liveFrames = 0, deadFrames = 0;
+
+    while ( nowUs < SIM_MS * 1000ull )
+    {
+        x.Transmitter ();
+
+        if ( sentBoard == deadBoard )
+        {
+            ++deadFrames;
+            if ( mode == NO_HOLDOFF )
+                x.scQueue[ sentBoard ].holdoff = 0;
+            }
+        else
+            ++liveFrames;
+
+        Put( x, sentBoard, n++ );
+        Drain ();
+        }
+
+    hostOnWait = NULL;
+
+    printf( "benchScBoards: %4u us/frame  %-10s  %7.0f frames/s to live boards  "
+            "dead board: %5.1f frames/s, %4.1f%% of bus time\n",
+        us, modeNames[ mode ],
+        liveFrames * 1e6 / nowUs, deadFrames * 1e6 / nowUs, 100.0 * deadUs / nowUs );
+
+    delete px;
+    }
+
+int main( void )
+{
+    static const uint times[] = { 250, 1000 };
+
+    for ( uint i = 0; i < sizeof( times ) / sizeof( times[ 0 ] ); i++ )
+    {
+        Run( times[ i ], ALL_LIVE );
+        Run( times[ i ], NO_HOLDOFF );
+        Run( times[ i ], HOLDOFF );
+        }
+
+    return 0;
+    }
@@ -0,0 +1,181 @@
+//---------------------------------------------------------------------------------------
+//      USBXMTR_LANE: producer throughput and latency of the backend selected by
+//      USB_XMTR_LOCKFREE
+//---------------------------------------------------------------------------------------
+//
+// Producers queue XPI_IMSG-sized messages with Reserve()/Commit() and Put() into
+// a bulk-sized lane, which is drained as Transmitter() does every DRAIN_EVERY
+// messages. Reported per backend:
+//
+//   - messages per second and the worst time of a single producer call on the
+//     host; the host has no task switches, so this is the cost of the code path
+//     (and of the host clock read around it)
+//   - critical sections and semaphore calls per message, producer and
+//     Transmitter() side together, which is what a message costs the target
+//     scheduler
+//   - reservations that would block behind a reservation of another producer
+//     not yet committed (a task preempted while building its message)
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+#include "hostRtos.hpp"
+
+extern USBXMTR usbOut;
+
+typedef USBXMTR_LANE_BUF< USB_LANE_BULK_SIZE > LANE;
+
+enum
+{
+    MSG_LEN     = sizeof( XPI_IMSG_HEADER ) + 8,
+    PUT_LEN     = 64,
+    MSG_COUNT   = 200000,
+    DRAIN_EVERY = 32
+    };
+
+#ifdef USB_XMTR_LOCKFREE
+static const char* VARIANT = "lockfree";
+#else
+static const char* VARIANT = "sema";
+#endif
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Takes and frees every committed packet, as Transmitter() does
+//
+static void Drain( LANE& lane )
+{
+    for(;;)
+    {
+        int status = lane.Poll ();
+        if ( status == USBXMTR_LANE::SKIP )
+        {
+            lane.Skip ();
+            continue;
+            }
+
+        if ( status != USBXMTR_LANE::READY )
+            return;
+
+        uint len = lane.PeekLength ();
+        lane.Take( len );
+
+        lane.pRead += len + 2;
+        if ( lane.pRead >= lane.pMax )
+            lane.pRead -= lane.bufSize;
+
+        lane.FreeSpace( lane.FreeLength( len + 2 ) );
+        }
+    }
+
+struct RESULT
+{
+    double msgsPerSec;
+    unsigned long long worstNs;
+    double criticals;
+    double semaCalls;
+    };
+
+// Queues MSG_COUNT messages of len octets, with Put() or Reserve()/Commit()
+//
+static RESULT Run( uint len, bool isPut )
+{
+    static LANE lane;
+    lane.pOwner = &usbOut;
+
+    uchar data[ PUT_LEN ];
+    memset( data, 0x5A, sizeof( data ) );
+
+    HOST_RTOS_STATS before = hostRtosStats;
+    unsigned long long worst = 0;
+    unsigned long long start = HostNanoseconds ();
+
+    for ( uint i = 0; i < MSG_COUNT; i++ )
+    {
+        unsigned long long t0 = HostNanoseconds ();
+
+        if ( isPut )
+        {
+            bool isOK = lane.Put( data, len, 0 );
+            assert( isOK );
+            }
+        else
+        {
+            uchar* p = lane.Reserve( len, 0 );
+            assert( p != NULL );
+            memcpy( p, data, len );
+            lane.Commit( p );
+            }
+
+        unsigned long long t = HostNanoseconds () - t0;
+        if ( t > worst )
+            worst = t;
+
+        if ( i % DRAIN_EVERY == DRAIN_EVERY - 1 )
+            Drain( lane );
+        }
+
+    unsigned long long elapsed = HostNanoseconds () - start;
+
+    Drain( lane );
+
+    RESULT r;
+    r.msgsPerSec = MSG_COUNT * 1e9 / elapsed;
+    r.worstNs    = worst;
+    r.criticals  = double( hostRtosStats.criticals - before.criticals ) / MSG_COUNT;
+    r.semaCalls  = double( hostRtosStats.semaCalls - before.semaCalls ) / MSG_COUNT;
+    return r;
+    }
+
+// Producer A reserves a message and is preempted before Commit(); producer B
+// queues a message of its own. Returns true if B would block until A commits.
+//
+static bool IsBlockedByOpenReserve( void )
+{
+    static LANE lane;
+    lane.pOwner = &usbOut;
+
+    uchar* pA = lane.Reserve( MSG_LEN, 0 );
+    assert( pA != NULL );
+
+    bool isBlocked;
+
+#ifdef USB_XMTR_LOCKFREE
+    uchar* pB = lane.Reserve( MSG_LEN, 0 );
+    isBlocked = pB == NULL;
+    if ( pB != NULL )
+        lane.Commit( pB );
+#else
+    // Reserve() would wait on the pWrite mutex held by A
+    //
+    isBlocked = lane.semaMutex.GetCount () == 0;
+#endif
+
+    lane.Commit( pA );
+    Drain( lane );
+
+    return isBlocked;
+    }
+
+static void Report( const char* name, const RESULT& r )
+{
+    printf( "benchXmtr: %-8s %-16s %10.0f msgs/s  worst %6llu ns  "
+            "%4.2f critical sections  %4.2f semaphore calls per msg\n",
+        VARIANT, name, r.msgsPerSec, r.worstNs, r.criticals, r.semaCalls );
+    }
+
+int main( void )
+{
+    Report( "Reserve/Commit", Run( MSG_LEN, false ) );
+    Report( "Put", Run( PUT_LEN, true ) );
+
+    printf( "benchXmtr: %-8s producer blocked by an open reservation: %s\n",
+        VARIANT, IsBlockedByOpenReserve () ? "yes" : "no" );
+
+    return 0;
+    }
@@ -0,0 +1,64 @@
+//---------------------------------------------------------------------------------------
+//      Host (unit test) model of the FPGA bus (see hostFpga.hpp)
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+
+#include "sam7xpud.hpp"
+
+#include "hostFpga.hpp"
+
+FPGA_MODEL fpgaModel;
+
+void FPGA_ModelReset( void )
+{
+    fpgaModel.isWrite     = false;
+    fpgaModel.page        = FPGA_PAGE_UNKNOWN;
+    fpgaModel.pageWrites  = 0;
+    fpgaModel.dirSwitches = 0;
+    fpgaModel.reads       = 0;
+    fpgaModel.writes      = 0;
+    fpgaModel.pRead       = NULL;
+    fpgaModel.pWrite      = NULL;
+
+    FPGA_BusInvalidate ();
+    isFpgaBusWrite = false;
+    fpgaPageWrites = 0;
+    fpgaPageSkips  = 0;
+    }
+
+//---------------------------------------------------------------------------------------
+//      FPGA_HOST_MOCK hooks of fpga.hpp
+//---------------------------------------------------------------------------------------
+
+void FPGA_MockDirection( bool isWrite )
+{
+    if ( isWrite != fpgaModel.isWrite )
+        ++fpgaModel.dirSwitches;
+
+    fpgaModel.isWrite = isWrite;
+    }
+
+void FPGA_MockWrite( uint addr, uint data )
+{
+    assert( fpgaModel.isWrite );
+    ++fpgaModel.writes;
+
+    if ( addr == XPI_W_PAGE_ADDR )
+    {
+        fpgaModel.page = data;
+        ++fpgaModel.pageWrites;
+        }
+    else if ( fpgaModel.pWrite )
+    {
+        fpgaModel.pWrite( fpgaModel.page, addr, data );
+        }
+    }
+
+uint FPGA_MockRead( uint addr )
+{
+    assert( ! fpgaModel.isWrite );
+    ++fpgaModel.reads;
+
+    return fpgaModel.pRead ? fpgaModel.pRead( fpgaModel.page, addr ) : 0;
+    }
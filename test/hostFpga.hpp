@@ -0,0 +1,33 @@
+#ifndef _HOST_FPGA_HPP_INCLUDED
+#define _HOST_FPGA_HPP_INCLUDED
+
+//---------------------------------------------------------------------------------------
+//      Host (unit test) model of the FPGA bus, built with FPGA_HOST_MOCK
+//---------------------------------------------------------------------------------------
+//
+// Every bus cycle is checked against the data bus direction, and the page register
+// is kept by the model. Other registers are left to the test, which installs
+// pRead and pWrite; without them, writes are ignored and reads return 0.
+//
+
+struct FPGA_MODEL
+{
+    bool isWrite;       // Data bus direction
+    uint page;          // Page register
+    uint pageWrites;    // Writes of the page register
+    uint dirSwitches;   // Changes of the data bus direction
+    uint reads;
+    uint writes;
+
+    uint (*pRead)( uint page, uint addr );
+    void (*pWrite)( uint page, uint addr, uint data );
+    };
+
+extern FPGA_MODEL fpgaModel;
+
+// Resets the model and the page and direction shadow of the FPGA_Bus* methods,
+// as after FPGA reset
+//
+void FPGA_ModelReset( void );
+
+#endif // _HOST_FPGA_HPP_INCLUDED
@@ -0,0 +1,182 @@
+//---------------------------------------------------------------------------------------
+//      Host (unit test) replacement of the scheduler and interrupt wrappers
+//---------------------------------------------------------------------------------------
+//
+// Tests run in a single thread, so nothing can block: a Wait() that cannot be
+// satisfied times out at once, and critical sections only keep count of nesting.
+//
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "sema.hpp"
+
+#include "hostRtos.hpp"
+
+HOST_RTOS_STATS hostRtosStats;
+
+void (*hostOnWait)( xSEMA* pSema ) = NULL;
+
+//---------------------------------------------------------------------------------------
+//      Scheduler
+//---------------------------------------------------------------------------------------
+
+volatile unsigned portLONG ulCriticalNesting = 0;
+
+static portTickType hostTick = 0;
+
+extern "C" void vPortEnterCritical( void )
+{
+    ++hostRtosStats.criticals;
+    ++ulCriticalNesting;
+    }
+
+extern "C" void vPortExitCritical( void )
+{
+    --ulCriticalNesting;
+    }
+
+extern "C" void vTaskSwitchContext( void )
+{
+    }
+
+extern "C" void vTaskSuspendAll( void )
+{
+    }
+
+extern "C" signed portBASE_TYPE xTaskResumeAll( void )
+{
+    return pdFALSE;
+    }
+
+extern "C" portTickType xTaskGetTickCount( void )
+{
+    return hostTick;
+    }
+
+extern "C" void vTaskDelay( portTickType xTicksToDelay )
+{
+    hostTick += xTicksToDelay;
+    }
+
+extern "C" void vTaskDelayUntil( portTickType* pxPreviousWakeTime, portTickType xTimeIncrement )
+{
+    *pxPreviousWakeTime += xTimeIncrement;
+    hostTick = *pxPreviousWakeTime;
+    }
+
+extern "C" signed portBASE_TYPE xTaskCreate
+(
+    pdTASK_CODE pvTaskCode,
+    const signed portCHAR* const pcName,
+    unsigned portSHORT usStackDepth,
+    void* pvParameters,
+    unsigned portBASE_TYPE uxPriority,
+    xTaskHandle* pvCreatedTask
+    )
+{
+    (void) pvTaskCode; (void) pcName; (void) usStackDepth;
+    (void) pvParameters; (void) uxPriority;
+
+    if ( pvCreatedTask )
+        *pvCreatedTask = NULL;
+
+    return pdPASS;
+    }
+
+extern "C" void vTaskStartScheduler( void )
+{
+    }
+
+extern "C" unsigned int vPortGetMaxHeap( void )
+{
+    return 0;
+    }
+
+//---------------------------------------------------------------------------------------
+//      TC1 free running counter
+//---------------------------------------------------------------------------------------
+
+unsigned hostTc1 = 0;
+
+unsigned LAT_MockNow( void )
+{
+    return hostTc1 & 0xFFFF;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Interrupt wrappers (ISR.cpp is ARM code)
+//---------------------------------------------------------------------------------------
+
+void ISR_Wrapper_USB( void )
+{
+    }
+
+void ISR_Wrapper_Timer0( void )
+{
+    }
+
+void ISR_Wrapper_FPGA( void )
+{
+    }
+
+void ISR_Wrapper_VBus( void )
+{
+    }
+
+//---------------------------------------------------------------------------------------
+//      Semaphores
+//---------------------------------------------------------------------------------------
+
+xSEMA::xSEMA( unsigned portBASE_TYPE uxInitialCount )
+{
+    isMutex = false;
+    pxMutexHolder = NULL;
+    xItemCount = uxInitialCount;
+    xTxLock = semaUNLOCKED;
+    }
+
+void xSEMA::Release( unsigned portBASE_TYPE count )
+{
+    ++hostRtosStats.semaCalls;
+    xItemCount += count;
+    }
+
+signed portBASE_TYPE xSEMA::ReleaseFromISR
+(
+    unsigned portBASE_TYPE count,
+    signed portBASE_TYPE xTaskPreviouslyWoken
+    )
+{
+    ++hostRtosStats.semaCalls;
+    xItemCount += count;
+    return xTaskPreviouslyWoken;
+    }
+
+signed portBASE_TYPE xSEMA::Wait
+(
+    unsigned portBASE_TYPE count,
+    portTickType xTicksToWait,
+    portBASE_TYPE xJustPeeking
+    )
+{
+    (void) xTicksToWait;
+
+    ++hostRtosStats.semaCalls;
+
+    if ( hostOnWait )
+        hostOnWait( this );
+
+    if ( xItemCount < (signed portBASE_TYPE) count )
+        return pdFALSE;
+
+    if ( ! xJustPeeking )
+        xItemCount -= count;
+
+    return pdTRUE;
+    }
+
+signed portBASE_TYPE xSEMA::WaitFromISR( unsigned portBASE_TYPE count )
+{
+    return Wait( count, 0 );
+    }
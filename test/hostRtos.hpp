@@ -0,0 +1,43 @@
+#ifndef _HOST_RTOS_HPP_INCLUDED
+#define _HOST_RTOS_HPP_INCLUDED
+
+//---------------------------------------------------------------------------------------
+//      Host (unit test) replacement of the scheduler: call counters and clock
+//      for the benchmarks
+//---------------------------------------------------------------------------------------
+//
+// On the target every critical section and semaphore call costs a few dozen cycles
+// and may switch tasks; the counters tell how many of them a code path takes.
+//
+
+#include <time.h>
+
+struct HOST_RTOS_STATS
+{
+    unsigned criticals;     // taskENTER_CRITICAL()
+    unsigned semaCalls;     // xSEMA Wait() and Release(), including the FromISR ones
+    };
+
+extern HOST_RTOS_STATS hostRtosStats;
+
+// Called by xSEMA::Wait() before the count is checked, if set: a benchmark can
+// play the task or interrupt that would release the semaphore meanwhile
+//
+class xSEMA;
+extern void (*hostOnWait)( xSEMA* pSema );
+
+// TC1 counter value returned by LAT_Now(), wrapped to 16 bits; tests advance it
+// (in LAT_TICKS_PER_US per microsecond) together with dTimerTick
+//
+extern unsigned hostTc1;
+
+// Host monotonic clock in nanoseconds
+//
+inline unsigned long long HostNanoseconds( void )
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+#endif // _HOST_RTOS_HPP_INCLUDED
@@ -0,0 +1,92 @@
+//---------------------------------------------------------------------------------------
+//      Host side decoder of USB IN transfers in compact v2 framing
+//---------------------------------------------------------------------------------------
+//
+// Record formats (see USBXMTR::Compact()):
+//
+//    XPI_IMSG message:  tsub [subtype] varint(len) varint(zigzag(timeStamp delta)) data
+//                       tsub = type << 3 | min(subtype, 7); subtype follows if 7
+//    raw packet:        0x80 | len_MSB, len_LSB, data
+//
+
+#include "sam7xpud.hpp"
+#include "hostV2.hpp"
+
+// Reads a varint of at most 5 octets; returns false if it runs over pEnd
+//
+static bool GetVarint( const uchar*& p, const uchar* pEnd, ulong& v )
+{
+    v = 0;
+    for ( int shift = 0; shift < 35 && p < pEnd; shift += 7 )
+    {
+        uchar c = *p++;
+        v |= ulong( c & 0x7F ) << shift;
+        if ( ( c & 0x80 ) == 0 )
+            return true;
+        }
+
+    return false;
+    }
+
+int XPI_V2_Decode( const uchar* p, uint len, XPI_V2_RECORD* rec, int maxRec )
+{
+    const uchar* pEnd = p + len;
+
+    if ( len < 2 || p[ 0 ] != XPI_MSG_MAGIC_MSB || p[ 1 ] != XPI_V2_MAGIC_LSB )
+        return -1;
+
+    p += 2;
+
+    ulong timeStamp = 0;
+    int count = 0;
+
+    while ( p < pEnd )
+    {
+        if ( count >= maxRec )
+            return -1;
+
+        XPI_V2_RECORD& r = rec[ count++ ];
+
+        if ( *p & 0x80 )
+        {
+            if ( p + 2 > pEnd )
+                return -1;
+
+            r.isMsg = false;
+            r.type = r.subtype = 0;
+            r.timeStamp = 0;
+            r.len = ( uint( p[ 0 ] & 0x7F ) << 8 ) + p[ 1 ];
+            p += 2;
+            }
+        else
+        {
+            r.isMsg = true;
+            r.type = *p >> 3;
+            r.subtype = *p++ & 0x07;
+
+            if ( r.subtype == 7 )
+            {
+                if ( p >= pEnd )
+                    return -1;
+                r.subtype = *p++;
+                }
+
+            ulong dataLen, zz;
+            if ( ! GetVarint( p, pEnd, dataLen ) || ! GetVarint( p, pEnd, zz ) )
+                return -1;
+
+            r.len = dataLen;
+
+            timeStamp += ( zz >> 1 ) ^ -( zz & 1 );
+            r.timeStamp = timeStamp;
+            }
+
+        if ( r.len > uint( pEnd - p ) )
+            return -1;
+
+        r.data = p;
+        p += r.len;
+        }
+
+    return count;
+    }
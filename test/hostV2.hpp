@@ -0,0 +1,24 @@
+#ifndef _HOST_V2_HPP_INCLUDED
+#define _HOST_V2_HPP_INCLUDED
+
+//---------------------------------------------------------------------------------------
+//      Host side decoder of USB IN transfers in compact v2 framing
+//      (see XPI_USB_CFG_FRAMING)
+//---------------------------------------------------------------------------------------
+
+struct XPI_V2_RECORD
+{
+    bool  isMsg;        // XPI_IMSG message; otherwise a raw record (a v1 packet)
+    uchar type;
+    uchar subtype;
+    ulong timeStamp;
+    uint  len;          // Length of data: message data, or the whole raw packet
+    const uchar* data;  // Points into the decoded transfer
+    };
+
+// Decodes a v2 transfer of len octets into at most maxRec records; returns
+// the number of records, or -1 if the transfer is not a well-formed v2 batch
+//
+int XPI_V2_Decode( const uchar* p, uint len, XPI_V2_RECORD* rec, int maxRec );
+
+#endif // _HOST_V2_HPP_INCLUDED
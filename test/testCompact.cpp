@@ -0,0 +1,172 @@
+//---------------------------------------------------------------------------------------
+//      USBXMTR::Compact(): in place re-encoding of a coalesced batch with v2 framing
+//      (see XPI_USB_CFG_FRAMING), checked against a reference decoder
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+#include "hostV2.hpp"
+
+extern USBXMTR usbOut;
+
+typedef USBXMTR_LANE_BUF< 128 > LANE;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Queues an XPI_IMSG message with len octets of data filled with fill
+//
+static uint PutMsg( LANE& lane, uchar type, uchar subtype, ulong timeStamp, uint len, uchar fill )
+{
+    uchar* p = lane.Reserve( sizeof( XPI_IMSG_HEADER ) + len, 0 );
+    assert( p != NULL );
+
+    XPI_IMSG_HEADER hdr;
+    hdr.magicMSB  = XPI_MSG_MAGIC_MSB;
+    hdr.magicLSB  = XPI_MSG_MAGIC_LSB;
+    hdr.type      = type;
+    hdr.subtype   = subtype;
+    hdr.timeStamp = timeStamp;
+
+    memcpy( p, &hdr, sizeof( hdr ) );
+    memset( p + sizeof( hdr ), fill, len );
+    lane.Commit( p );
+
+    return sizeof( XPI_IMSG_HEADER ) + len + 2;
+    }
+
+// Queues a packet that is not an XPI_IMSG message, e.g. loopback data
+//
+static uint PutRaw( LANE& lane, uint len, uchar fill )
+{
+    uchar* p = lane.Reserve( len, 0 );
+    assert( p != NULL );
+
+    memset( p, fill, len );
+    lane.Commit( p );
+
+    return len + 2;
+    }
+
+static bool IsFilled( const uchar* p, uint len, uchar fill )
+{
+    for ( uint i = 0; i < len; i++ )
+        if ( p[ i ] != fill )
+            return false;
+
+    return true;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// Messages get compact headers with timeStamp deltas, including a negative one
+// and a subtype that does not fit in tsub; types without drop accounting and
+// packets without the magic are sent as raw records.
+//
+static void TestBatch( void )
+{
+    LANE lane;
+    lane.pOwner = &usbOut;
+
+    uint span = 0;
+    span += PutMsg( lane, XPI_IMSG_LOG, 1, 1000, 5, 0x11 );
+    span += PutMsg( lane, XPI_IMSG_TRACE_CTX, 9, 900, 3, 0x22 );
+    span += PutMsg( lane, XPI_IMSG_TRACE_CRX, 0, 0x12345678, 0, 0 );
+    span += PutMsg( lane, 0x20, 2, 950, 6, 0x33 );
+    span += PutRaw( lane, 4, 0x44 );
+
+    uint len = usbOut.Compact( &lane, lane.pRead, span );
+    assert( len < span );
+
+    XPI_V2_RECORD rec[ 8 ];
+    int count = XPI_V2_Decode( lane.pRead, len, rec, 8 );
+    assert( count == 5 );
+
+    assert( rec[ 0 ].isMsg && rec[ 0 ].type == XPI_IMSG_LOG && rec[ 0 ].subtype == 1 );
+    assert( rec[ 0 ].timeStamp == 1000 && rec[ 0 ].len == 5 );
+    assert( IsFilled( rec[ 0 ].data, 5, 0x11 ) );
+
+    assert( rec[ 1 ].isMsg && rec[ 1 ].type == XPI_IMSG_TRACE_CTX && rec[ 1 ].subtype == 9 );
+    assert( rec[ 1 ].timeStamp == 900 && rec[ 1 ].len == 3 );
+    assert( IsFilled( rec[ 1 ].data, 3, 0x22 ) );
+
+    assert( rec[ 2 ].isMsg && rec[ 2 ].type == XPI_IMSG_TRACE_CRX && rec[ 2 ].subtype == 0 );
+    assert( rec[ 2 ].timeStamp == 0x12345678 && rec[ 2 ].len == 0 );
+
+    // Type 0x20 is sent as is, header included
+    //
+    assert( ! rec[ 3 ].isMsg && rec[ 3 ].len == sizeof( XPI_IMSG_HEADER ) + 6 );
+    assert( rec[ 3 ].data[ 0 ] == XPI_MSG_MAGIC_MSB && rec[ 3 ].data[ 2 ] == 0x20 );
+    assert( IsFilled( rec[ 3 ].data + sizeof( XPI_IMSG_HEADER ), 6, 0x33 ) );
+
+    assert( ! rec[ 4 ].isMsg && rec[ 4 ].len == 4 );
+    assert( IsFilled( rec[ 4 ].data, 4, 0x44 ) );
+    }
+
+// A batch that starts with a raw record has no room for the magic and stays v1
+//
+static void TestFirstRawKeepsV1( void )
+{
+    LANE lane;
+    lane.pOwner = &usbOut;
+
+    uint span = 0;
+    span += PutRaw( lane, 4, 0x55 );
+    span += PutMsg( lane, XPI_IMSG_LOG, 0, 10, 2, 0x66 );
+
+    uchar v1[ 64 ];
+    memcpy( v1, lane.pRead, span );
+
+    assert( usbOut.Compact( &lane, lane.pRead, span ) == span );
+    assert( memcmp( v1, lane.pRead, span ) == 0 );
+    }
+
+// The decoder rejects a batch cut short anywhere
+//
+static void TestTruncated( void )
+{
+    LANE lane;
+    lane.pOwner = &usbOut;
+
+    uint span = 0;
+    span += PutMsg( lane, XPI_IMSG_LOG, 9, 70000, 20, 0x77 );
+    span += PutRaw( lane, 6, 0x88 );
+
+    uint len = usbOut.Compact( &lane, lane.pRead, span );
+
+    XPI_V2_RECORD rec[ 4 ];
+    assert( XPI_V2_Decode( lane.pRead, len, rec, 4 ) == 2 );
+    assert( XPI_V2_Decode( lane.pRead, len, rec, 1 ) == -1 );
+
+    for ( uint i = 0; i < len; i++ )
+    {
+        int count = XPI_V2_Decode( lane.pRead, i, rec, 4 );
+
+        // Cut between records is a shorter batch
+        //
+        if ( i == 2 )
+            assert( count == 0 );
+        else if ( i == len - 8 )
+            assert( count == 1 );
+        else
+            assert( count == -1 );
+        }
+    }
+
+int main( void )
+{
+    assert( sizeof( XPI_IMSG_HEADER ) == 8 );
+
+    TestBatch ();
+    TestFirstRawKeepsV1 ();
+    TestTruncated ();
+
+    printf( "testCompact: OK\n" );
+    return 0;
+    }
@@ -0,0 +1,202 @@
+//---------------------------------------------------------------------------------------
+//      XPI::ReadFifo() / On_CTX() / On_CRX(): CTX and CRX FIFOs drained in bursts
+//      of up to FIFO_BURST_MAX octets, in one page 0 bus session
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+
+#include "hostFpga.hpp"
+
+extern USBXMTR usbOut;
+
+//---------------------------------------------------------------------------------------
+//      FIFO model
+//---------------------------------------------------------------------------------------
+
+struct FIFO
+{
+    uchar data[ 64 ];
+    uint head;
+    uint tail;
+    };
+
+static FIFO ctxFifo;
+static FIFO crxFifo;
+static uint otherIrqs; // Request bits other than CTX and CRX
+
+static uint ReadReg( uint page, uint addr )
+{
+    if ( addr == XPI_R_INT_REQUEST )
+    {
+        return otherIrqs
+            | ( ctxFifo.head < ctxFifo.tail ? XPI_IRQ_CTX : 0 )
+            | ( crxFifo.head < crxFifo.tail ? XPI_IRQ_CRX : 0 );
+        }
+
+    assert( page == 0 );
+
+    FIFO& f = addr == XPI_R_P0_SC_CTX ? ctxFifo : crxFifo;
+    assert( addr == XPI_R_P0_SC_CTX || addr == XPI_R_P0_SC_CRX );
+    assert( f.head < f.tail );
+
+    return f.data[ f.head++ ];
+    }
+
+static void Reset( void )
+{
+    FPGA_ModelReset ();
+    fpgaModel.pRead = ReadReg;
+
+    memset( &ctxFifo, 0, sizeof( ctxFifo ) );
+    memset( &crxFifo, 0, sizeof( crxFifo ) );
+    otherIrqs = 0;
+    }
+
+static void Push( FIFO& f, const uchar* data, uint len )
+{
+    assert( f.tail + len <= sizeof( f.data ) );
+    memcpy( f.data + f.tail, data, len );
+    f.tail += len;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Checks that the next message sent to the host is of the given type with
+// len octets of data
+//
+static void TakeMsg( uchar type, const uchar* data, uint len )
+{
+    USBXMTR_LANE& lane = *usbOut.lane[ USBXMTR::LaneOf( type ) ];
+
+    int status;
+    while ( ( status = lane.Poll () ) == USBXMTR_LANE::SKIP )
+        lane.Skip ();
+
+    assert( status == USBXMTR_LANE::READY );
+
+    uint msgLen = lane.PeekLength ();
+    assert( msgLen == sizeof( XPI_IMSG_HEADER ) + len );
+
+    lane.Take( msgLen );
+
+    uchar msg[ 64 ];
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < msgLen; i++, p = lane.Next( p ) )
+        msg[ i ] = *p;
+
+    lane.pRead += msgLen + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    lane.FreeSpace( lane.FreeLength( msgLen + 2 ) );
+
+    XPI_IMSG* pMsg = (XPI_IMSG*) msg;
+    assert( pMsg->type == type );
+    assert( memcmp( pMsg->data, data, len ) == 0 );
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// The FIFO is read while its request bit stays set; other request bits seen
+// during the burst are collected
+//
+static void TestBurst( void )
+{
+    static XPI x;
+    Reset ();
+
+    uchar in[ 5 ] = { 1, 2, 3, 4, 5 };
+    Push( ctxFifo, in, sizeof( in ) );
+    otherIrqs = XPI_IRQ_EIRQ;
+
+    uchar out[ XPI::FIFO_BURST_MAX ];
+    uint irq_list = 0;
+
+    assert( x.ReadFifo( XPI_R_P0_SC_CTX, XPI_IRQ_CTX, out, irq_list ) == 5 );
+    assert( memcmp( in, out, 5 ) == 0 );
+    assert( irq_list == ( XPI_IRQ_EIRQ | XPI_IRQ_CTX ) );
+
+    // Data and request register read alternately, on a single page write
+    //
+    assert( fpgaModel.reads == 2 * 5 );
+    assert( fpgaModel.pageWrites == 1 );
+    assert( ! fpgaModel.isWrite );
+
+    assert( x.fifo_bursts == 1 && x.fifo_octets == 5 && x.fifo_burst_max == 5 );
+    }
+
+// A burst stops at FIFO_BURST_MAX octets; the rest is read by the next one
+// without writing the page again
+//
+static void TestBurstMax( void )
+{
+    static XPI x;
+    Reset ();
+
+    enum { LEN = XPI::FIFO_BURST_MAX + 6 };
+
+    uchar in[ LEN ];
+    for ( uint i = 0; i < LEN; i++ )
+        in[ i ] = uchar( 0x30 + i );
+    Push( crxFifo, in, LEN );
+
+    uchar out[ XPI::FIFO_BURST_MAX ];
+    uint irq_list = 0;
+
+    assert( x.ReadFifo( XPI_R_P0_SC_CRX, XPI_IRQ_CRX, out, irq_list ) == XPI::FIFO_BURST_MAX );
+    assert( memcmp( in, out, XPI::FIFO_BURST_MAX ) == 0 );
+    assert( crxFifo.head == XPI::FIFO_BURST_MAX );
+
+    assert( x.ReadFifo( XPI_R_P0_SC_CRX, XPI_IRQ_CRX, out, irq_list ) == 6 );
+    assert( memcmp( in + XPI::FIFO_BURST_MAX, out, 6 ) == 0 );
+
+    assert( fpgaModel.pageWrites == 1 && fpgaPageSkips == 1 );
+    assert( x.fifo_bursts == 2 && x.fifo_octets == LEN );
+    assert( x.fifo_burst_max == XPI::FIFO_BURST_MAX );
+    }
+
+// Octets of a burst are assembled in order: two CTX frames read in one burst
+// are traced as two messages
+//
+static void TestOnCtx( void )
+{
+    static XPI x;
+    Reset ();
+
+    x.state = XPI::IDLE;
+
+    uchar frames[] = 
+    {
+        0x85, 0x02, 0xAA, 0xBB, 0x00,
+        0x86, 0x01, 0xCC, 0x00
+        };
+    Push( ctxFifo, frames, sizeof( frames ) );
+
+    uint irq_list = 0;
+    x.On_CTX( irq_list );
+
+    assert( ctxFifo.head == ctxFifo.tail );
+    assert( x.fifo_bursts == 1 && x.fifo_octets == sizeof( frames ) );
+    assert( x.state == XPI::IDLE && x.ctxLen == 0 );
+
+    TakeMsg( XPI_IMSG_TRACE_CTX, frames, 5 );
+    TakeMsg( XPI_IMSG_TRACE_CTX, frames + 5, 4 );
+    }
+
+int main( void )
+{
+    TestBurst ();
+    TestBurstMax ();
+    TestOnCtx ();
+
+    printf( "testFifoBurst: OK\n" );
+    return 0;
+    }
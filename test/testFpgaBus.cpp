@@ -0,0 +1,112 @@
+//---------------------------------------------------------------------------------------
+//      FPGA_Bus* transactions: page register and data bus direction shadow
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "sam7xpud.hpp"
+
+#include "hostFpga.hpp"
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Registers read as page and address, so stale pages are caught
+//
+static uint ReadReg( uint page, uint addr )
+{
+    return ( page << 4 ) | addr;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// A page that is already selected is not written again
+//
+static void TestPageElision( void )
+{
+    FPGA_ModelReset ();
+    fpgaModel.pRead = ReadReg;
+
+    FPGA_BusPage( 1 );
+    assert( FPGA_BusRead( XPI_R_P1_BOARD_POS ) == 0x17 );
+    FPGA_BusEnd ();
+
+    FPGA_BusPage( 1 );
+    assert( FPGA_BusRead( XPI_R_P1_MAGIC_LSB ) == 0x14 );
+    FPGA_BusEnd ();
+
+    assert( fpgaModel.pageWrites == 1 );
+    assert( fpgaPageWrites == 1 && fpgaPageSkips == 1 );
+
+    FPGA_BusPage( 0 );
+    FPGA_BusPage( 0 );
+    assert( FPGA_BusRead( XPI_R_P0_SC_CTX ) == 0x01 );
+    FPGA_BusEnd ();
+
+    assert( fpgaModel.pageWrites == 2 );
+    assert( fpgaPageWrites == 2 && fpgaPageSkips == 2 );
+    }
+
+// After the shadow is invalidated (FPGA reset) the page is written again
+//
+static void TestInvalidate( void )
+{
+    FPGA_ModelReset ();
+    fpgaModel.pRead = ReadReg;
+
+    FPGA_BusPage( 2 );
+    FPGA_BusEnd ();
+
+    // The FPGA comes out of reset on page 0
+    //
+    FPGA_BusInvalidate ();
+    fpgaModel.page = 0;
+
+    FPGA_BusPage( 2 );
+    assert( FPGA_BusRead( XPI_R_P2_PCM_R0 ) == 0x24 );
+    FPGA_BusEnd ();
+
+    assert( fpgaModel.pageWrites == 2 );
+    assert( fpgaPageWrites == 2 && fpgaPageSkips == 0 );
+    }
+
+// The data bus is switched only when the direction changes, and is left in
+// read mode by FPGA_BusEnd()
+//
+static void TestDirection( void )
+{
+    FPGA_ModelReset ();
+
+    FPGA_BusPage( 0 );
+    FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_G );
+    FPGA_BusWrite( XPI_W_P0_LED_CLEAR, XPI_LED_R );
+    assert( fpgaModel.dirSwitches == 1 );
+
+    (void) FPGA_BusRead( XPI_R_INT_REQUEST );
+    (void) FPGA_BusRead( XPI_R_INT_REQUEST );
+    assert( fpgaModel.dirSwitches == 2 );
+
+    FPGA_BusEnd ();
+    assert( fpgaModel.dirSwitches == 2 && ! fpgaModel.isWrite );
+
+    FPGA_BusPage( 0 );
+    FPGA_BusWrite( XPI_W_P0_LED_SET, XPI_LED_Y );
+    FPGA_BusEnd ();
+    assert( fpgaModel.dirSwitches == 4 && ! fpgaModel.isWrite );
+
+    assert( fpgaModel.writes == 4 && fpgaModel.reads == 2 );
+    }
+
+int main( void )
+{
+    TestPageElision ();
+    TestInvalidate ();
+    TestDirection ();
+
+    printf( "testFpgaBus: OK\n" );
+    return 0;
+    }
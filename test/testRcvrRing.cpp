@@ -0,0 +1,219 @@
+//---------------------------------------------------------------------------------------
+//      USBRCVR: transfers and frames wrapped around the end of the receive ring,
+//      and the slot queue wrapped around USB_RCVR_SLOTS
+//---------------------------------------------------------------------------------------
+//
+// Completed transfers are simulated by writing the ring and calling OnReceiveUSB()
+// with USB_STATUS_IMMEDREAD, which does not post the next read. isReading is left
+// set, so Arm() does not touch the USB driver either. Messages are dispatched as
+// loopback, and come back in the bulk lane of usbOut.
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+
+extern USBXMTR usbOut;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Completes a transfer of len octets at pWrite of the ring
+//
+static void Deliver( USBRCVR& rcvr, const uchar* data, uint len )
+{
+    uchar* p = rcvr.pWrite;
+
+    for ( uint i = 0; i < len; i++ )
+    {
+        *p++ = data[ i ];
+        if ( p >= rcvr.pMax )
+            p = rcvr.ring;
+        }
+
+    USBRCVR::OnReceiveUSB( &rcvr, USB::USB_STATUS_IMMEDREAD, len, 0 );
+    rcvr.isReading = true;
+    }
+
+// Checks that the next packet sent to the host is len octets of data
+//
+static void Loopback( const uchar* data, uint len )
+{
+    USBXMTR_LANE& lane = *usbOut.lane[ USB_LANE_BULK ];
+
+    int status;
+    while ( ( status = lane.Poll () ) == USBXMTR_LANE::SKIP )
+        lane.Skip ();
+
+    assert( status == USBXMTR_LANE::READY );
+    assert( lane.PeekLength () == len );
+
+    lane.Take( len );
+
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < len; i++, p = lane.Next( p ) )
+        assert( *p == data[ i ] );
+
+    lane.pRead += len + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    lane.FreeSpace( lane.FreeLength( len + 2 ) );
+    }
+
+static void Fill( uchar* data, uint len, uchar seed )
+{
+    for ( uint i = 0; i < len; i++ )
+        data[ i ] = uchar( seed + i );
+    }
+
+// Builds a framed XPI_OMSG_LOOP message with dataLen octets of data;
+// returns the frame length
+//
+static uint Frame( uchar* p, uint dataLen, uchar seed )
+{
+    uint len = sizeof( XPI_OMSG_HEADER ) + dataLen;
+
+    p[ 0 ] = uchar( len >> 8 );
+    p[ 1 ] = uchar( len );
+    p[ 2 ] = XPI_MSG_MAGIC_MSB;
+    p[ 3 ] = XPI_MSG_MAGIC_LSB;
+    p[ 4 ] = XPI_OMSG_LOOP;
+    p[ 5 ] = 0;
+    Fill( p + 6, dataLen, seed );
+
+    return len + 2;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// A v1 transfer that wraps around pMax is made linear before it is dispatched
+//
+static void TestTransferWrap( void )
+{
+    static USBRCVR rcvr;
+    rcvr.isReading = true;
+    rcvr.pWrite = rcvr.pMax - 10;
+
+    uchar data[ 30 ];
+    Fill( data, sizeof( data ), 0x10 );
+
+    Deliver( rcvr, data, sizeof( data ) );
+    assert( rcvr.slotCount == 1 && rcvr.used == 30 );
+    assert( rcvr.pWrite == rcvr.ring + 20 );
+
+    rcvr.Receiver ();
+    Loopback( data, sizeof( data ) );
+
+    assert( memcmp( rcvr.pMax, data + 10, 20 ) == 0 );
+    assert( rcvr.slotCount == 0 && rcvr.used == 0 );
+    }
+
+// Slots are reused round-robin with several transfers queued at a time
+//
+static void TestSlotWrap( void )
+{
+    static USBRCVR rcvr;
+    rcvr.isReading = true;
+
+    enum { COUNT = 2 * USB_RCVR_SLOTS + 3 };
+
+    uchar data[ COUNT ][ 10 + COUNT ];
+
+    for ( int i = 0; i < COUNT; i += 3 )
+    {
+        int n = COUNT - i < 3 ? COUNT - i : 3;
+
+        for ( int j = 0; j < n; j++ )
+        {
+            Fill( data[ i + j ], 10 + i + j, uchar( 0x40 + i + j ) );
+            Deliver( rcvr, data[ i + j ], 10 + i + j );
+            }
+
+        assert( rcvr.slotCount == uint( n ) );
+
+        for ( int j = 0; j < n; j++ )
+        {
+            rcvr.Receiver ();
+            Loopback( data[ i + j ], 10 + i + j );
+            }
+        }
+
+    assert( rcvr.slotHead == COUNT % USB_RCVR_SLOTS );
+    assert( rcvr.slotCount == 0 && rcvr.used == 0 );
+    assert( rcvr.maxSlots == 3 );
+    }
+
+// In framed mode a frame may span transfers and the end of the ring; it is
+// dispatched only when complete
+//
+static void TestFrameWrap( void )
+{
+    static USBRCVR rcvr;
+    rcvr.isReading = true;
+    rcvr.isFramed = true;
+    rcvr.pWrite = rcvr.pMax - 30;
+
+    uchar stream[ 64 ];
+    uint lenA = Frame( stream, 20, 0x60 );
+    uint lenB = Frame( stream + lenA, 20, 0x80 );
+
+    // Frame A and the first 4 octets of frame B, up to pMax
+    //
+    Deliver( rcvr, stream, 30 );
+    assert( rcvr.pWrite == rcvr.ring );
+    assert( rcvr.IsReady () );
+
+    rcvr.Receiver ();
+    stream[ 4 ] = XPI_IMSG_LOOP;
+    Loopback( stream + 2, lenA - 2 );
+
+    assert( rcvr.used == 4 );
+    assert( ! rcvr.IsReady () );
+
+    // The rest of frame B is appended to the same slot
+    //
+    Deliver( rcvr, stream + 30, lenA + lenB - 30 );
+    assert( rcvr.slotCount == 1 );
+    assert( rcvr.IsReady () );
+
+    rcvr.Receiver ();
+    stream[ lenA + 4 ] = XPI_IMSG_LOOP;
+    Loopback( stream + lenA + 2, lenB - 2 );
+
+    assert( rcvr.slotCount == 0 && rcvr.used == 0 );
+    assert( rcvr.framingErrors == 0 );
+    }
+
+// A transfer of USB_RCVR_BUF_SIZE octets is looped back in a single packet
+//
+static void TestMaxLoopback( void )
+{
+    static USBRCVR rcvr;
+    rcvr.isReading = true;
+
+    static uchar data[ USB_RCVR_BUF_SIZE ];
+    Fill( data, sizeof( data ), 0xA0 );
+
+    Deliver( rcvr, data, sizeof( data ) );
+    rcvr.Receiver ();
+    Loopback( data, sizeof( data ) );
+
+    assert( rcvr.slotCount == 0 && rcvr.used == 0 );
+    }
+
+int main( void )
+{
+    TestTransferWrap ();
+    TestSlotWrap ();
+    TestFrameWrap ();
+    TestMaxLoopback ();
+
+    printf( "testRcvrRing: OK\n" );
+    return 0;
+    }
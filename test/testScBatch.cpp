@@ -0,0 +1,217 @@
+//---------------------------------------------------------------------------------------
+//      XPI::PutBatch(): parsing of XPI_OMSG_SC_BATCH, queueing of a batch as a whole
+//      and rejection of a batch as a whole
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+
+extern USBXMTR usbOut;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+// Appends an SC frame of len octets (requestID, board address, payload)
+// to the batch at p; returns the position of the next frame
+//
+static uchar* Frame( uchar* p, uint len, ushort reqId, uchar board )
+{
+    *p++ = uchar( len );
+    p[ 0 ] = uchar( reqId >> 8 );
+    p[ 1 ] = uchar( reqId );
+    for ( uint i = 2; i < len; i++ )
+        p[ i ] = uchar( board + i - 2 );
+
+    return p + len;
+    }
+
+// Checks the frames queued for board, in order
+//
+static void CheckQueue( XPI& x, uchar board, const ushort* reqId, int count )
+{
+    uint slot = x.scQueue[ board ].head;
+
+    for ( int i = 0; i < count; i++ )
+    {
+        assert( slot != XPI::SC_SLOT_NONE );
+
+        XPI::SC_SLOT& s = x.slots[ slot ];
+        assert( s.data[ 0 ] == uchar( reqId[ i ] >> 8 ) );
+        assert( s.data[ 1 ] == uchar( reqId[ i ] ) );
+        assert( s.data[ 2 ] == board );
+
+        slot = s.next;
+        }
+
+    assert( slot == XPI::SC_SLOT_NONE );
+    }
+
+// Checks that the next message sent to the host is XPI_IMSG_FLOW_CTRL 0x77
+// for reqId; returns false if there is no message
+//
+static bool TakeReject( ushort reqId )
+{
+    USBXMTR_LANE& lane = *usbOut.lane[ USB_LANE_CTRL ];
+
+    int status;
+    while ( ( status = lane.Poll () ) == USBXMTR_LANE::SKIP )
+        lane.Skip ();
+
+    if ( status != USBXMTR_LANE::READY )
+        return false;
+
+    uint len = lane.PeekLength ();
+    assert( len == sizeof( XPI_IMSG_HEADER ) + 2 );
+
+    lane.Take( len );
+
+    uchar msg[ sizeof( XPI_IMSG_HEADER ) + 2 ];
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < len; i++, p = lane.Next( p ) )
+        msg[ i ] = *p;
+
+    lane.pRead += len + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    lane.FreeSpace( lane.FreeLength( len + 2 ) );
+
+    XPI_IMSG* pMsg = (XPI_IMSG*) msg;
+    assert( pMsg->type == XPI_IMSG_FLOW_CTRL && pMsg->subtype == 0x77 );
+    assert( pMsg->data[ 0 ] == uchar( reqId >> 8 ) && pMsg->data[ 1 ] == uchar( reqId ) );
+
+    return true;
+    }
+
+// Nothing has been queued or taken
+//
+static void CheckUntouched( XPI& x )
+{
+    assert( x.semaEmpty.GetCount () == 0 );
+    assert( x.semaSlots.GetCount () == XPI::XPI_XMTR_SLOTS );
+    assert( x.semaFull.GetCount () == XPI::XPI_XMTR_BUF_SIZE );
+    assert( x.queuedFrames == 0 && x.queuedBytes == 0 );
+    assert( x.freeSlot == 0 );
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// Frames of the shortest and longest length go to the queues of their boards
+//
+static void TestValid( void )
+{
+    static XPI x;
+
+    uchar batch[ 64 ];
+    uchar* p = batch;
+    p = Frame( p, 3, 0x0101, 5 );
+    p = Frame( p, 30, 0x0102, 9 );
+    p = Frame( p, 10, 0x0103, 5 );
+
+    uint len = p - batch;
+    assert( x.PutBatch( batch, len, 3, 0 ) );
+
+    uint total = 3 + 30 + 10 + 3 * 2;
+    assert( x.semaEmpty.GetCount () == 3 );
+    assert( x.semaSlots.GetCount () == XPI::XPI_XMTR_SLOTS - 3 );
+    assert( x.semaFull.GetCount () == XPI::XPI_XMTR_BUF_SIZE - total );
+    assert( x.queuedFrames == 3 && x.queuedBytes == total );
+
+    const ushort board5[] = { 0x0101, 0x0103 };
+    const ushort board9[] = { 0x0102 };
+    CheckQueue( x, 5, board5, 2 );
+    CheckQueue( x, 9, board9, 1 );
+
+    assert( x.slots[ x.scQueue[ 9 ].head ].len == 30 );
+
+    // An empty batch is accepted
+    //
+    assert( x.PutBatch( batch, 0, 0, 0 ) );
+    assert( x.semaEmpty.GetCount () == 3 );
+
+    assert( ! TakeReject( 0 ) );
+    }
+
+// A malformed batch is dropped without queueing or rejecting any frame
+//
+static void TestMalformed( void )
+{
+    static XPI x;
+
+    uchar batch[ 64 ];
+    uchar* p = batch;
+    p = Frame( p, 4, 0x0201, 1 );
+    p = Frame( p, 5, 0x0202, 2 );
+    uint len = p - batch;
+
+    // Last frame cut short
+    //
+    assert( ! x.PutBatch( batch, len - 1, 2, 0 ) );
+
+    // More frames announced than present
+    //
+    assert( ! x.PutBatch( batch, len, 3, 0 ) );
+
+    // Frame without the board address
+    //
+    Frame( batch, 2, 0x0203, 3 );
+    assert( ! x.PutBatch( batch, 3, 1, 0 ) );
+
+    // Frame longer than XPI_SC_FRAME_MAX
+    //
+    uchar big[ 40 ];
+    Frame( big, 31, 0x0204, 4 );
+    assert( ! x.PutBatch( big, 32, 1, 0 ) );
+
+    CheckUntouched( x );
+    assert( ! TakeReject( 0 ) );
+    }
+
+// A batch that does not fit is rejected as a whole, and every frame is reported
+//
+static void TestRejected( void )
+{
+    static XPI x;
+
+    // Leave two free slots
+    //
+    assert( x.semaSlots.Wait( XPI::XPI_XMTR_SLOTS - 2, 0 ) );
+
+    uchar batch[ 64 ];
+    uchar* p = batch;
+    p = Frame( p, 4, 0x0301, 1 );
+    p = Frame( p, 4, 0x0302, 2 );
+    p = Frame( p, 4, 0x0303, 3 );
+
+    assert( ! x.PutBatch( batch, p - batch, 3, 0 ) );
+
+    assert( x.semaSlots.GetCount () == 2 );
+    assert( x.semaEmpty.GetCount () == 0 );
+    assert( x.semaFull.GetCount () == XPI::XPI_XMTR_BUF_SIZE );
+
+    assert( TakeReject( 0x0301 ) );
+    assert( TakeReject( 0x0302 ) );
+    assert( TakeReject( 0x0303 ) );
+    assert( ! TakeReject( 0 ) );
+
+    // Two frames still fit
+    //
+    assert( x.PutBatch( batch, p - batch - 5, 2, 0 ) );
+    assert( x.semaSlots.GetCount () == 0 );
+    }
+
+int main( void )
+{
+    TestValid ();
+    TestMalformed ();
+    TestRejected ();
+
+    printf( "testScBatch: OK\n" );
+    return 0;
+    }
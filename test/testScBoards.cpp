@@ -0,0 +1,183 @@
+//---------------------------------------------------------------------------------------
+//      XPI SC transmit queues: boards served round-robin, and a board whose frame
+//      failed held off for SC_HOLDOFF ms without blocking the other boards
+//---------------------------------------------------------------------------------------
+//
+// A dead board is simulated by XPI::Transmitter() in MCPU mode with semaSent
+// released in advance: the frame and its retry complete without ctx_status being
+// cleared, as on ACK timeout. Frames of live boards are taken by Take(), which
+// frees their slots as Transmitter() does after a successful transfer.
+//
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "sam7xpud.hpp"
+
+extern USBXMTR usbOut;
+extern volatile ulong dTimerTick;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+static ushort ReqId( uchar board, uchar n )
+{
+    return ( board << 8 ) | n;
+    }
+
+static void Put( XPI& x, uchar board, uchar n )
+{
+    ushort reqId = ReqId( board, n );
+    uchar frame[ 4 ] = { uchar( reqId >> 8 ), uchar( reqId ), board, 0x11 };
+
+    assert( x.Put( frame, sizeof( frame ), 0 ) );
+    }
+
+// Takes the next frame as Transmitter() does; returns its requestID
+//
+static ushort Take( XPI& x )
+{
+    assert( x.semaEmpty.Wait( 1, 0 ) );
+
+    uint board;
+    uint slot = x.NextSlot( board );
+
+    XPI::SC_SLOT& s = x.slots[ slot ];
+    assert( s.data[ 2 ] == board );
+
+    ushort reqId = ( s.data[ 0 ] << 8 ) | s.data[ 1 ];
+
+    s.next = x.freeSlot;
+    x.freeSlot = slot;
+    x.queuedBytes -= s.len + 2;
+    x.queuedFrames--;
+    x.semaFull.Release( s.len + 2 );
+    x.semaSlots.Release( 1 );
+
+    return reqId;
+    }
+
+// Sends the next frame to a board that does not respond; returns its requestID
+//
+static ushort Fail( XPI& x )
+{
+    x.isMCPU = true;
+    x.semaSent.Release( 2 );
+
+    x.Transmitter ();
+
+    x.isMCPU = false;
+    assert( x.semaSent.GetCount () == 0 );
+
+    return x.requestID;
+    }
+
+// Checks that the failure of reqId has been reported to the host
+//
+static void TakeFailure( ushort reqId )
+{
+    USBXMTR_LANE& lane = *usbOut.lane[ USBXMTR::LaneOf( XPI_IMSG_FLOW_CTRL ) ];
+
+    assert( lane.Poll () == USBXMTR_LANE::READY );
+
+    uint len = lane.PeekLength ();
+    assert( len == sizeof( XPI_IMSG_HEADER ) + 2 );
+
+    lane.Take( len );
+
+    uchar msg[ sizeof( XPI_IMSG_HEADER ) + 2 ];
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < len; i++, p = lane.Next( p ) )
+        msg[ i ] = *p;
+
+    lane.pRead += len + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    lane.FreeSpace( lane.FreeLength( len + 2 ) );
+
+    XPI_IMSG* pMsg = (XPI_IMSG*) msg;
+    assert( pMsg->type == XPI_IMSG_FLOW_CTRL );
+    assert( pMsg->data[ 0 ] == uchar( reqId >> 8 ) && pMsg->data[ 1 ] == uchar( reqId ) );
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// Frames to different boards are interleaved; frames to a board keep their order
+//
+static void TestRoundRobin( void )
+{
+    static XPI x;
+    dTimerTick = 1000;
+
+    Put( x, 4, 1 );
+    Put( x, 4, 2 );
+    Put( x, 4, 3 );
+    Put( x, 2, 1 );
+    Put( x, 6, 1 );
+
+    assert( Take( x ) == ReqId( 2, 1 ) );
+    assert( Take( x ) == ReqId( 4, 1 ) );
+    assert( Take( x ) == ReqId( 6, 1 ) );
+    assert( Take( x ) == ReqId( 4, 2 ) );
+    assert( Take( x ) == ReqId( 4, 3 ) );
+
+    assert( x.semaEmpty.GetCount () == 0 );
+    assert( x.semaSlots.GetCount () == XPI::XPI_XMTR_SLOTS );
+    assert( x.semaFull.GetCount () == XPI::XPI_XMTR_BUF_SIZE );
+    }
+
+// Frames queued behind a dead board are sent while the board is held off;
+// the board is served again when it is the only one left or its holdoff expires
+//
+static void TestDeadBoard( void )
+{
+    static XPI x;
+    dTimerTick = 2000;
+
+    Put( x, 3, 1 );
+    Put( x, 3, 2 );
+    Put( x, 3, 3 );
+    Put( x, 7, 1 );
+    Put( x, 9, 1 );
+    Put( x, 7, 2 );
+    Put( x, 9, 2 );
+
+    assert( Fail( x ) == ReqId( 3, 1 ) );
+    TakeFailure( ReqId( 3, 1 ) );
+    assert( x.scQueue[ 3 ].holdoff == ( ( 2000 + XPI::SC_HOLDOFF ) | 1 ) );
+
+    assert( Take( x ) == ReqId( 7, 1 ) );
+    assert( Take( x ) == ReqId( 9, 1 ) );
+    assert( Take( x ) == ReqId( 7, 2 ) );
+    assert( Take( x ) == ReqId( 9, 2 ) );
+
+    // Only the held off board has frames
+    //
+    assert( Take( x ) == ReqId( 3, 2 ) );
+
+    // Holdoff expired: round-robin again
+    //
+    dTimerTick = 2000 + XPI::SC_HOLDOFF + 10;
+    Put( x, 7, 3 );
+
+    assert( Take( x ) == ReqId( 7, 3 ) );
+    assert( Take( x ) == ReqId( 3, 3 ) );
+    assert( x.scQueue[ 3 ].holdoff == 0 );
+
+    assert( x.semaEmpty.GetCount () == 0 );
+    assert( x.semaSlots.GetCount () == XPI::XPI_XMTR_SLOTS );
+    assert( x.queuedFrames == 0 && x.queuedBytes == 0 );
+    }
+
+int main( void )
+{
+    TestRoundRobin ();
+    TestDeadBoard ();
+
+    printf( "testScBoards: OK\n" );
+    return 0;
+    }
@@ -0,0 +1,138 @@
+//---------------------------------------------------------------------------------------
+//      XPI per-board RTT: time base of SampleRtt() across the TC1 wrap, and the
+//      ACK and poll timeouts of BoardTimeout() with their clamp to SC_TIMEOUT_MIN
+//      .. SC_TIMEOUT_MAX
+//---------------------------------------------------------------------------------------
+//
+// Time is simulated in microseconds; dTimerTick and TC1 (hostTc1) follow it as
+// TC0 and TC1 do on the target.
+//
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "sam7xpud.hpp"
+#include "hostRtos.hpp"
+
+extern volatile ulong dTimerTick;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+static unsigned long long nowUs;
+
+static void SetTime( unsigned long long us )
+{
+    nowUs = us;
+    dTimerTick = ulong( us / 1000 );
+    hostTc1 = unsigned( us * LAT_TICKS_PER_US );
+    }
+
+// Takes an RTT sample of us for board; returns the smoothed RTT in us
+//
+static uint Sample( XPI& x, uint board, uint us )
+{
+    x.StartRtt( board );
+    SetTime( nowUs + us );
+    x.SampleRtt( board );
+
+    return x.scRtt[ board ].srtt8 >> 3;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// The first sample of a board is its smoothed RTT, below, across and beyond the
+// TC1 wrap, wherever it starts within a tick. LAT_WRAP_US is truncated, so each
+// wrap added loses up to a microsecond.
+//
+static void TestTimeBase( void )
+{
+    static XPI x;
+
+    static const uint rtts[] =
+    {
+        350, 999, 1000, 4321, 9950, 10500, LAT_WRAP_US - 1, LAT_WRAP_US + 1,
+        11800, 15000, 21700, 25000
+        };
+    static const uint offsets[] = { 0, 1, 450, 999 };
+
+    uint board = 0;
+
+    for ( uint i = 0; i < sizeof( rtts ) / sizeof( rtts[ 0 ] ); i++ )
+    {
+        for ( uint j = 0; j < sizeof( offsets ) / sizeof( offsets[ 0 ] ); j++ )
+        {
+            assert( board < XPI::MAX_BOARD_COUNT );
+
+            SetTime( 5000000 + 7 * 1000 * board + offsets[ j ] );
+
+            uint rtt = Sample( x, board, rtts[ i ] );
+            assert( rtt <= rtts[ i ] && rtt + 2 >= rtts[ i ] );
+
+            ++board;
+            }
+        }
+    }
+
+// Timeouts follow the smoothed RTT plus four deviations and are clamped;
+// only ACK timeouts are backed off
+//
+static void TestTimeout( void )
+{
+    static XPI x;
+    SetTime( 1000000 );
+
+    // No samples: the default as is
+    //
+    assert( x.BoardTimeout( 1, XPI::RECEIVE_TIMEOUT, true ) == XPI::RECEIVE_TIMEOUT );
+    assert( x.BoardTimeout( 1, XPI::EIRQ_POLL_DELAY, false ) == XPI::EIRQ_POLL_DELAY );
+
+    // Shortest RTT, with the deviation at SC_RTTVAR_MIN:
+    // ( 0 + 250 + 999 ) / 1000 + 1 = SC_TIMEOUT_MIN
+    //
+    Sample( x, 2, 0 );
+    assert( x.BoardTimeout( 2, XPI::RECEIVE_TIMEOUT, true ) == XPI::SC_TIMEOUT_MIN );
+
+    // 1 ms: ( 1000 + 2000 + 999 ) / 1000 + 1 = 4 ms
+    //
+    Sample( x, 3, 1000 );
+    assert( x.BoardTimeout( 3, XPI::RECEIVE_TIMEOUT, true ) == 4 );
+
+    // 3 ms: 10 ms, backed off to 20 ms, and clamped to SC_TIMEOUT_MAX at the
+    // next timeout
+    //
+    Sample( x, 4, 3000 );
+    assert( x.BoardTimeout( 4, XPI::RECEIVE_TIMEOUT, true ) == 10 );
+
+    x.TimeoutRtt( 4 );
+    assert( x.BoardTimeout( 4, XPI::RECEIVE_TIMEOUT, true ) == 20 );
+    assert( x.BoardTimeout( 4, XPI::EIRQ_POLL_DELAY, false ) == 10 );
+
+    x.TimeoutRtt( 4 );
+    assert( x.scRtt[ 4 ].backoff == XPI::SC_BACKOFF_MAX );
+    assert( x.BoardTimeout( 4, XPI::RECEIVE_TIMEOUT, true ) == XPI::SC_TIMEOUT_MAX );
+
+    // The next sample clears the backoff
+    //
+    Sample( x, 4, 3000 );
+    assert( x.scRtt[ 4 ].backoff == 0 );
+    assert( x.BoardTimeout( 4, XPI::RECEIVE_TIMEOUT, true ) < XPI::SC_TIMEOUT_MAX );
+
+    // Beyond the TC1 wrap: clamped to SC_TIMEOUT_MAX
+    //
+    Sample( x, 5, 15000 );
+    assert( x.BoardTimeout( 5, XPI::RECEIVE_TIMEOUT, true ) == XPI::SC_TIMEOUT_MAX );
+    assert( x.BoardTimeout( 5, XPI::EIRQ_POLL_DELAY, false ) == XPI::SC_TIMEOUT_MAX );
+    }
+
+int main( void )
+{
+    TestTimeBase ();
+    TestTimeout ();
+
+    printf( "testScRtt: OK\n" );
+    return 0;
+    }
@@ -0,0 +1,103 @@
+//---------------------------------------------------------------------------------------
+//      UDP_WriteFifo() / UDP_ReadFifo(): unrolled endpoint FIFO copy kernels,
+//      checked against a byte loop on a model of the UDP_FDR register
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+
+// Endpoint FIFO: every write of the data register pushes an octet, every read
+// pops one
+//
+class FIFO_MODEL
+{
+public:
+
+    uchar data[ 256 ];
+    uint head;
+    uint tail;
+
+    FIFO_MODEL( void )
+    {
+        head = tail = 0;
+        }
+
+    FIFO_MODEL& operator = ( uint value )
+    {
+        assert( tail < sizeof( data ) );
+        data[ tail++ ] = uchar( value );
+        return *this;
+        }
+
+    operator uint ( void )
+    {
+        assert( head < tail );
+        return data[ head++ ];
+        }
+    };
+
+#define UDP_FIFO_REG FIFO_MODEL
+#include "../src/usb/usbFifo.cpp"
+
+enum { LEN_MAX = 70 };
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// Every length up to LEN_MAX, so the unrolled loop and all switch cases are hit
+//
+static void TestWrite( void )
+{
+    uchar src[ LEN_MAX ];
+    for ( uint i = 0; i < LEN_MAX; i++ )
+        src[ i ] = uchar( 0x5A ^ ( i * 7 ) );
+
+    for ( uint len = 0; len <= LEN_MAX; len++ )
+    {
+        FIFO_MODEL fifo, ref;
+
+        UDP_WriteFifo( &fifo, src, len );
+
+        for ( uint i = 0; i < len; i++ )
+            ref = src[ i ];
+
+        assert( fifo.tail == ref.tail );
+        assert( memcmp( fifo.data, ref.data, len ) == 0 );
+        }
+    }
+
+static void TestRead( void )
+{
+    for ( uint len = 0; len <= LEN_MAX; len++ )
+    {
+        FIFO_MODEL fifo;
+        for ( uint i = 0; i < LEN_MAX; i++ )
+            fifo = 0xA5 ^ ( i * 3 );
+
+        uchar dst[ LEN_MAX + 1 ];
+        memset( dst, 0xEE, sizeof( dst ) );
+
+        UDP_ReadFifo( &fifo, dst, len );
+
+        assert( fifo.head == len );
+        for ( uint i = 0; i < len; i++ )
+            assert( dst[ i ] == uchar( 0xA5 ^ ( i * 3 ) ) );
+
+        // Nothing written past the end
+        //
+        assert( dst[ len ] == 0xEE );
+        }
+    }
+
+int main( void )
+{
+    TestWrite ();
+    TestRead ();
+
+    printf( "testUdpFifo: OK\n" );
+    return 0;
+    }
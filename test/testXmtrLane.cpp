@@ -0,0 +1,424 @@
+//---------------------------------------------------------------------------------------
+//      USBXMTR_LANE: producer Reserve()/Commit() and Transmitter() side of the
+//      circular buffer, for the backend selected by USB_XMTR_LOCKFREE
+//---------------------------------------------------------------------------------------
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sam7xpud.hpp"
+
+extern USBXMTR usbOut;
+
+enum { LANE_SIZE = 64 };
+
+typedef USBXMTR_LANE_BUF< LANE_SIZE > LANE;
+
+//---------------------------------------------------------------------------------------
+//      Helpers
+//---------------------------------------------------------------------------------------
+
+static void Init( LANE& lane )
+{
+    lane.pOwner = &usbOut;
+    }
+
+// Reserves a packet of len octets filled with fill and commits it
+//
+static uchar* Produce( LANE& lane, uint len, uchar fill )
+{
+    uchar* p = lane.Reserve( len, 0 );
+    assert( p != NULL );
+
+    memset( p, fill, len );
+    lane.Commit( p );
+
+    return p;
+    }
+
+// Takes the next packet as Transmitter() does, checks its length and contents,
+// and returns the number of octets to free when its transfer completes
+//
+static uint Consume( LANE& lane, uint len, uchar fill )
+{
+    int status;
+    while ( ( status = lane.Poll () ) == USBXMTR_LANE::SKIP )
+        lane.Skip ();
+
+    assert( status == USBXMTR_LANE::READY );
+    assert( lane.PeekLength () == len );
+
+    lane.Take( len );
+
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < len; i++, p = lane.Next( p ) )
+        assert( *p == fill );
+
+    lane.pRead += len + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    return lane.FreeLength( len + 2 );
+    }
+
+// Takes the next packet, if any, copies it to data and frees its space;
+// returns its length, or -1 if there is no packet
+//
+static int Take( USBXMTR_LANE& lane, uchar* data )
+{
+    int status;
+    while ( ( status = lane.Poll () ) == USBXMTR_LANE::SKIP )
+        lane.Skip ();
+
+    if ( status != USBXMTR_LANE::READY )
+        return -1;
+
+    uint len = lane.PeekLength ();
+    lane.Take( len );
+
+    uchar* p = lane.Next( lane.Next( lane.pRead ) );
+    for ( uint i = 0; i < len; i++, p = lane.Next( p ) )
+        data[ i ] = *p;
+
+    lane.pRead += len + 2;
+    if ( lane.pRead >= lane.pMax )
+        lane.pRead -= lane.bufSize;
+
+    lane.FreeSpace( lane.FreeLength( len + 2 ) );
+
+    return len;
+    }
+
+//---------------------------------------------------------------------------------------
+//      Tests
+//---------------------------------------------------------------------------------------
+
+// Packets go in and out in order, and all space is returned
+//
+static void TestInOrder( void )
+{
+    LANE lane;
+    Init( lane );
+
+    assert( lane.Poll () == USBXMTR_LANE::EMPTY );
+
+    Produce( lane, 10, 0xA1 );
+    Produce( lane, 20, 0xA2 );
+
+    uint freeLen = Consume( lane, 10, 0xA1 );
+    freeLen += Consume( lane, 20, 0xA2 );
+    assert( freeLen == 34 );
+    assert( lane.Poll () == USBXMTR_LANE::EMPTY );
+
+    lane.FreeSpace( freeLen );
+
+#ifdef USB_XMTR_LOCKFREE
+    assert( lane.used == 0 && lane.held == 0 );
+#else
+    assert( lane.semaFull.GetCount () == LANE_SIZE );
+#endif
+    }
+
+// A message dropped for lack of space leaves a gap in sequence numbers; a report
+// of drops (XPI_IMSG_LOST) that does not fit is retried and takes no number
+//
+static void TestSeqGaps( void )
+{
+    USBXMTR_LANE& lane = *usbOut.lane[ USB_LANE_CTRL ];
+    usbOut.SetSequencing( true );
+
+    ushort seq = usbOut.seqNo;
+
+    XPI_IMSG* pMsg = usbOut.BeginMsg( XPI_IMSG_FLOW_CTRL, 1, 2, 0 );
+    assert( pMsg != NULL );
+    usbOut.Commit( pMsg );
+
+    // Fill the rest of the lane
+    //
+    uchar fill = 0;
+    while ( lane.Put( &fill, 1, 0 ) )
+        ;
+
+    assert( usbOut.BeginMsg( XPI_IMSG_LOST, 0, 3, 0 ) == NULL );
+    assert( usbOut.BeginMsg( XPI_IMSG_LOST, 0, 3, 0 ) == NULL );
+    assert( usbOut.seqNo == seq + 1 );
+
+    assert( usbOut.BeginMsg( XPI_IMSG_FLOW_CTRL, 2, 2, 0 ) == NULL );
+    assert( usbOut.seqNo == seq + 2 );
+
+    uchar data[ USB_LANE_CTRL_SIZE ];
+    uint msgLen = sizeof( XPI_IMSG_HEADER ) + 2 + 2;
+
+    assert( Take( lane, data ) == int( msgLen ) );
+    assert( data[ msgLen - 2 ] == uchar( seq >> 8 ) && data[ msgLen - 1 ] == uchar( seq ) );
+
+    while ( Take( lane, data ) == 1 )
+        ;
+
+    pMsg = usbOut.BeginMsg( XPI_IMSG_FLOW_CTRL, 3, 2, 0 );
+    assert( pMsg != NULL );
+    usbOut.Commit( pMsg );
+
+    seq += 2;
+    assert( Take( lane, data ) == int( msgLen ) );
+    assert( data[ msgLen - 2 ] == uchar( seq >> 8 ) && data[ msgLen - 1 ] == uchar( seq ) );
+    assert( Take( lane, data ) == -1 );
+
+    usbOut.SetSequencing( false );
+    }
+
+#ifdef USB_XMTR_LOCKFREE
+
+// Sequence numbers are taken with the space of the packet, so they follow the
+// order of packets in the lane whatever the order of Commit()
+//
+static void TestSeqOrder( void )
+{
+    LANE lane;
+    Init( lane );
+
+    ushort seqA, seqB;
+    uchar* pA = lane.Reserve( 10, 0, &seqA );
+    uchar* pB = lane.Reserve( 12, 0, &seqB );
+    assert( pA != NULL && pB != NULL );
+    assert( ushort( seqB - seqA ) == 1 );
+
+    memset( pB, 0xE4, 12 );
+    lane.Commit( pB );
+    memset( pA, 0xE3, 10 );
+    lane.Commit( pA );
+
+    uint freeLen = Consume( lane, 10, 0xE3 );
+    freeLen += Consume( lane, 12, 0xE4 );
+    lane.FreeSpace( freeLen );
+    }
+
+// A packet that does not fit below pMax goes to the beginning of the buffer;
+// the rest of the buffer is padded with a skip record that Transmitter() skips
+// and frees together with the packet.
+//
+static void TestReserveAcrossEnd( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 30, 0xB1 );
+    Produce( lane, 10, 0xB2 );
+    lane.FreeSpace( Consume( lane, 30, 0xB1 ) );
+
+    // 12 octets used up to pWrite; 32 more do not fit below pMax
+    //
+    assert( lane.pWrite == lane.buf + 44 );
+
+    uchar* p = lane.Reserve( 30, 0 );
+    assert( p == lane.buf + 2 );
+    assert( lane.buf[ 44 ] == USB_XMTR_SKIP_MSB && lane.buf[ 45 ] == USB_XMTR_SKIP_LSB );
+    assert( lane.used == 12 + 20 + 32 );
+
+    // Not committed yet: packet in front of the skip record, then nothing ready
+    //
+    uint freeLen = Consume( lane, 10, 0xB2 );
+    assert( freeLen == 12 );
+
+    assert( lane.Poll () == USBXMTR_LANE::SKIP );
+    lane.Skip ();
+    assert( lane.pRead == lane.buf );
+    assert( lane.Poll () == USBXMTR_LANE::EMPTY );
+
+    memset( p, 0xB3, 30 );
+    lane.Commit( p );
+
+    // Padding is freed with the packet that follows it
+    //
+    assert( Consume( lane, 30, 0xB3 ) == 20 + 32 );
+
+    lane.FreeSpace( freeLen + 20 + 32 );
+    assert( lane.used == 0 && lane.held == 0 );
+    }
+
+// With a single octet left below pMax there is no room for the skip header;
+// Transmitter() skips the octet anyway.
+//
+static void TestSingleOctetSkip( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 50, 0xC1 );
+    Produce( lane, 9, 0xC2 );
+    lane.FreeSpace( Consume( lane, 50, 0xC1 ) );
+    assert( lane.pWrite == lane.buf + 63 );
+
+    Produce( lane, 10, 0xC3 );
+
+    uint freeLen = Consume( lane, 9, 0xC2 );
+    assert( lane.Poll () == USBXMTR_LANE::SKIP );
+
+    freeLen += Consume( lane, 10, 0xC3 );
+    assert( freeLen == 11 + 1 + 12 );
+
+    lane.FreeSpace( freeLen );
+    assert( lane.used == 0 && lane.held == 0 );
+    }
+
+// An empty lane starts over at the beginning of the buffer, so a packet of
+// the whole buffer size fits wherever the previous one ended
+//
+static void TestEmptyRestart( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 30, 0xC4 );
+    lane.FreeSpace( Consume( lane, 30, 0xC4 ) );
+    assert( lane.pWrite == lane.buf + 32 );
+
+    uchar data[ LANE_SIZE - 2 ];
+    memset( data, 0xC5, sizeof( data ) );
+
+    assert( lane.Put( data, sizeof( data ), 0 ) );
+    assert( lane.pRead == lane.buf );
+
+    lane.FreeSpace( Consume( lane, sizeof( data ), 0xC5 ) );
+    assert( lane.used == 0 && lane.held == 0 );
+
+    assert( ! lane.Put( data, LANE_SIZE - 1, 0 ) );
+    }
+
+// Reserve() that does not wait fails on a full buffer without leaving a waiter
+//
+static void TestFull( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 40, 0xD1 );
+    assert( lane.Reserve( 30, 0 ) == NULL );
+    assert( lane.spaceWaiters == 0 );
+
+    lane.FreeSpace( Consume( lane, 40, 0xD1 ) );
+    assert( lane.Reserve( 30, 0 ) != NULL );
+    }
+
+// Packets are sent in reservation order: a packet committed from an ISR waits
+// behind a packet reserved earlier by a task and not yet committed
+//
+static void TestOutOfOrderCommit( void )
+{
+    LANE lane;
+    Init( lane );
+
+    uchar* pTask = lane.Reserve( 10, 0 );
+    uchar* pIsr  = lane.ReserveFromISR( 12 );
+    assert( pTask != NULL && pIsr != NULL && pIsr != pTask );
+
+    memset( pIsr, 0xE2, 12 );
+    usbOut.dataWaiter = true;
+    lane.CommitFromISR( pIsr, pdFALSE );
+
+    // Transmitter() waiting for data is woken up once
+    //
+    assert( ! usbOut.dataWaiter );
+    assert( usbOut.semaReady.GetCount () == 1 );
+    usbOut.semaReady.Wait( 1, 0 );
+
+    assert( lane.Poll () == USBXMTR_LANE::EMPTY );
+
+    memset( pTask, 0xE1, 10 );
+    lane.Commit( pTask );
+
+    uint freeLen = Consume( lane, 10, 0xE1 );
+    freeLen += Consume( lane, 12, 0xE2 );
+
+    lane.FreeSpace( freeLen );
+    assert( lane.used == 0 && lane.held == 0 );
+    }
+
+// A task that finds the buffer full is counted as a space waiter and woken up
+// through semaFull by FreeSpace(); ISRs never wait
+//
+static void TestSpaceWaiter( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 40, 0xF1 );
+
+    assert( lane.ReserveFromISR( 30 ) == NULL );
+    assert( lane.spaceWaiters == 0 );
+
+    assert( lane.Reserve( 30, 10 ) == NULL );
+    assert( lane.spaceWaiters == 1 );
+    assert( lane.semaFull.GetCount () == 0 );
+
+    lane.FreeSpace( Consume( lane, 40, 0xF1 ) );
+    assert( lane.spaceWaiters == 0 );
+    assert( lane.semaFull.GetCount () == 1 );
+
+    // The doorbell is only a hint; space is taken by TryReserve()
+    //
+    assert( lane.Reserve( 30, 10 ) != NULL );
+    }
+
+#else // USB_XMTR_LOCKFREE
+
+// A packet reserved near pMax is built linearly into the overflow area and
+// folded back to the beginning of the buffer by Commit()
+//
+static void TestReserveAcrossEnd( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 20, 0xB1 );
+    Produce( lane, 20, 0xB2 );
+    lane.FreeSpace( Consume( lane, 20, 0xB1 ) + Consume( lane, 20, 0xB2 ) );
+
+    uchar* p = lane.Reserve( 30, 0 );
+    assert( p == lane.buf + 46 );
+    assert( p + 30 > lane.pMax );
+
+    memset( p, 0xB3, 30 );
+    lane.Commit( p );
+    assert( lane.pWrite == lane.buf + 12 );
+    assert( lane.buf[ 0 ] == 0xB3 && lane.buf[ 11 ] == 0xB3 );
+
+    lane.FreeSpace( Consume( lane, 30, 0xB3 ) );
+    assert( lane.pRead == lane.pWrite );
+    assert( lane.semaFull.GetCount () == LANE_SIZE );
+    }
+
+// Reserve() that does not wait fails on a full buffer
+//
+static void TestFull( void )
+{
+    LANE lane;
+    Init( lane );
+
+    Produce( lane, 40, 0xD1 );
+    assert( lane.Reserve( 30, 0 ) == NULL );
+
+    lane.FreeSpace( Consume( lane, 40, 0xD1 ) );
+    assert( lane.Reserve( 30, 0 ) != NULL );
+    }
+
+#endif // USB_XMTR_LOCKFREE
+
+int main( void )
+{
+    TestInOrder ();
+    TestSeqGaps ();
+    TestReserveAcrossEnd ();
+#ifdef USB_XMTR_LOCKFREE
+    TestSeqOrder ();
+    TestSingleOctetSkip ();
+    TestEmptyRestart ();
+    TestOutOfOrderCommit ();
+    TestSpaceWaiter ();
+#endif
+    TestFull ();
+
+    printf( "testXmtrLane: OK\n" );
+    return 0;
+    }